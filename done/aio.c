@@ -0,0 +1,416 @@
+#define _GNU_SOURCE // for MAP_POPULATE and syscall()
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+#include "bdev.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+/*
+ * io_uring engine, on top of the raw system calls (no liburing).
+ * Requires Linux 5.6 (IORING_OP_READ / IORING_OP_WRITE).
+ */
+
+struct aio_uring {
+    int ring_fd;                  // descriptor of the ring
+    unsigned int entries;         // number of submission queue entries
+    unsigned int *sq_tail;        // submission queue tail (written by us)
+    unsigned int *sq_mask;
+    unsigned int *sq_array;       // indexes of the submitted sqes
+    struct io_uring_sqe *sqes;    // submission queue entries
+    unsigned int *cq_head;        // completion queue head (written by us)
+    unsigned int *cq_tail;        // completion queue tail (written by the kernel)
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;    // completion queue entries
+    void *sq_ring;                // mapping of the submission ring
+    size_t sq_ring_size;
+    void *cq_ring;                // mapping of the completion ring (may be sq_ring)
+    size_t cq_ring_size;
+    size_t sqes_size;             // size of the mapping of sqes
+};
+
+/**
+ * @brief release the rings of the engine
+ */
+static void aio_uring_free(struct aio_uring *r)
+{
+    if(r == NULL) {
+        return;
+    }
+    if(r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if(r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if(r->sq_ring != NULL) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->ring_fd);
+    free(r);
+}
+
+/**
+ * @brief set up an io_uring of (at least) depth entries
+ * @return the rings or NULL if io_uring is not available
+ */
+static struct aio_uring *aio_uring_alloc(unsigned int depth)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, depth, &p);
+    if(fd < 0) { // not supported (old kernel, seccomp, ...)
+        return NULL;
+    }
+    struct aio_uring *r = calloc(1, sizeof(struct aio_uring));
+    if(r == NULL) {
+        close(fd);
+        return NULL;
+    }
+    r->ring_fd = fd;
+    r->entries = p.sq_entries;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) { // both rings in one mapping
+        if(r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    void *sq = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) {
+        aio_uring_free(r);
+        return NULL;
+    }
+    r->sq_ring = sq;
+    void *cq = sq;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) {
+            aio_uring_free(r);
+            return NULL;
+        }
+    }
+    r->cq_ring = cq;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        aio_uring_free(r);
+        return NULL;
+    }
+    r->sqes = sqes;
+
+    r->sq_tail = (unsigned int*)((uint8_t*)sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int*)((uint8_t*)sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*)((uint8_t*)sq + p.sq_off.array);
+    r->cq_head = (unsigned int*)((uint8_t*)cq + p.cq_off.head);
+    r->cq_tail = (unsigned int*)((uint8_t*)cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int*)((uint8_t*)cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((uint8_t*)cq + p.cq_off.cqes);
+    return r;
+}
+
+static int aio_do(struct bdev *dev, struct aio_req *req);
+static void aio_threads_start(struct aio_ctx *ctx);
+static int aio_threads_run(struct aio_ctx *ctx, struct aio_req *reqs, size_t n);
+
+/**
+ * @brief reap the completions available in the ring
+ * @param inflight the number of requests in flight (IN-OUT)
+ * @return the number of requests completed
+ */
+static size_t aio_uring_reap(struct aio_uring *r, struct aio_req *reqs, size_t *inflight)
+{
+    size_t reaped = 0;
+    unsigned int head = *(r->cq_head);
+    unsigned int ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != ctail) {
+        struct io_uring_cqe *cqe = &(r->cqes[head & *(r->cq_mask)]);
+        struct aio_req *req = &(reqs[cqe->user_data]);
+        req->result = (cqe->res == (int)(req->count * SECTOR_SIZE)) ? 0 : ERR_IO; // error or short transfer
+        head++;
+        (*inflight)--;
+        reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE); // free the entries
+    return reaped;
+}
+
+/**
+ * @brief io_uring_enter() failed in aio_uring_run(): no request of the
+ *        batch may be left in the ring, where the kernel would still
+ *        write to its buffer and a later batch would reap it. The
+ *        requests the kernel has not consumed yet are taken back, those
+ *        in flight are waited for; the ring is then released and the
+ *        context goes on with the thread pool, which does the requests
+ *        left.
+ * @param next the first request not submitted
+ * @param tail the tail of the submission queue
+ * @param pending the last requests submitted, not consumed by the kernel
+ * @param inflight the number of requests in flight, pending ones included
+ * @return 0 if the requests left were done; ERR_IO if the requests in
+ *         flight could not be waited for
+ */
+static int aio_uring_fail(struct aio_ctx *ctx, struct aio_req *reqs, size_t n, size_t next, unsigned int tail,
+                          unsigned int pending, size_t inflight)
+{
+    struct aio_uring *r = ctx->uring;
+    __atomic_store_n(r->sq_tail, tail - pending, __ATOMIC_RELEASE); // no SQPOLL: only io_uring_enter() consumes them
+    inflight -= pending;
+    size_t first = next; // first request left to do
+    for(unsigned int p = 0; p < pending; first--) { // the pending ones are the last reads submitted
+        p += !reqs[first - 1].write;
+    }
+
+    int error = 0;
+    while(!error && inflight > 0) {
+        int ret = 0;
+        do {
+            ret = syscall(__NR_io_uring_enter, r->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while(ret < 0 && errno == EINTR);
+        error = (ret < 0) ? ERR_IO : 0;
+        aio_uring_reap(r, reqs, &inflight);
+    }
+    aio_uring_free(r); // on error, closing the ring cancels what is still in flight
+    ctx->uring = NULL;
+    aio_threads_start(ctx);
+    if(error) {
+        for(size_t i = 0; i < n; i++) {
+            reqs[i].result = ERR_IO;
+        }
+        return error;
+    }
+    for(size_t i = first; i < next; i++) { // the writes among them were done already
+        if(!reqs[i].write) {
+            reqs[i].result = aio_do(ctx->dev, &(reqs[i]));
+        }
+    }
+    return aio_threads_run(ctx, &(reqs[next]), n - next);
+}
+
+/**
+ * @brief aio_run() for the io_uring engine; writes are done synchronously
+ *        by the backend, which may elide zero sectors (see sector_write())
+ */
+static int aio_uring_run(struct aio_ctx *ctx, struct aio_req *reqs, size_t n)
+{
+    struct aio_uring *r = ctx->uring;
+    int fd = ctx->dev->fd;
+    unsigned int depth = (ctx->depth < r->entries) ? ctx->depth : r->entries; // max. requests in flight
+    size_t next = 0; // next request to submit
+    size_t inflight = 0; // submitted but not completed
+    size_t reaped = 0; // completed
+    unsigned int pending = 0; // published in the ring but not yet consumed by the kernel
+
+    while(reaped < n) {
+        /* fill the submission queue */
+        unsigned int tail = *(r->sq_tail); // we are the only producer
+        while(next < n && inflight < depth) {
+            if(reqs[next].write) { // the backend must see the data
+                reqs[next].result = aio_do(ctx->dev, &(reqs[next]));
+                next++;
+                reaped++;
+                continue;
+            }
+            unsigned int index = tail & *(r->sq_mask);
+            struct io_uring_sqe *sqe = &(r->sqes[index]);
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)reqs[next].data;
+            sqe->len = reqs[next].count * SECTOR_SIZE;
+            sqe->off = (uint64_t)reqs[next].sector * SECTOR_SIZE;
+            sqe->user_data = next;
+            r->sq_array[index] = index;
+            tail++;
+            next++;
+            inflight++;
+            pending++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE); // publish the batch
+        if(inflight == 0) { // only writes so far
+            continue;
+        }
+
+        /* submit the batch and wait for at least one completion */
+        int ret = 0;
+        do {
+            ret = syscall(__NR_io_uring_enter, r->ring_fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while(ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+        if(ret < 0) { // ring unusable
+            return aio_uring_fail(ctx, reqs, n, next, tail, pending, inflight);
+        }
+        pending -= ((unsigned int)ret < pending) ? (unsigned int)ret : pending; // the others are submitted with the next call
+
+        reaped += aio_uring_reap(r, reqs, &inflight);
+    }
+    return 0;
+}
+
+/*
+ * thread pool engine
+ */
+
+/**
+ * @brief perform one request synchronously
+ */
+static int aio_do(struct bdev *dev, struct aio_req *req)
+{
+    return req->write ? bdev_write(dev, req->sector, req->count, req->data)
+           : bdev_read(dev, req->sector, req->count, req->data);
+}
+
+/**
+ * @brief worker thread: takes the requests of the current batch one at a time
+ */
+static void *aio_worker(void *arg)
+{
+    struct aio_ctx *ctx = arg;
+    pthread_mutex_lock(&(ctx->lock));
+    while(1) {
+        while(!ctx->stop && (ctx->reqs == NULL || ctx->next >= ctx->nb_reqs)) { // wait for work
+            pthread_cond_wait(&(ctx->work), &(ctx->lock));
+        }
+        if(ctx->stop) {
+            break;
+        }
+        struct aio_req *req = &(ctx->reqs[ctx->next]);
+        ctx->next++;
+        pthread_mutex_unlock(&(ctx->lock));
+
+        req->result = aio_do(ctx->dev, req); // the backends are thread-safe
+
+        pthread_mutex_lock(&(ctx->lock));
+        ctx->completed++;
+        if(ctx->completed == ctx->nb_reqs) { // batch completed
+            pthread_cond_signal(&(ctx->done));
+        }
+    }
+    pthread_mutex_unlock(&(ctx->lock));
+    return NULL;
+}
+
+/**
+ * @brief start the threads of the thread pool engine, up to ctx->depth
+ */
+static void aio_threads_start(struct aio_ctx *ctx)
+{
+    size_t nb_threads = (ctx->depth < AIO_MAX_THREADS) ? ctx->depth : AIO_MAX_THREADS;
+    if(nb_threads == 1) { // depth 1: no need for a thread
+        nb_threads = 0;
+    }
+    for(size_t i = 0; i < nb_threads; i++) {
+        if(pthread_create(&(ctx->threads[i]), NULL, aio_worker, ctx)) { // keep the threads created so far
+            break;
+        }
+        ctx->nb_threads++;
+    }
+}
+
+/**
+ * @brief aio_run() for the thread pool engine
+ */
+static int aio_threads_run(struct aio_ctx *ctx, struct aio_req *reqs, size_t n)
+{
+    if(ctx->nb_threads == 0) { // no thread: synchronous
+        for(size_t i = 0; i < n; i++) {
+            reqs[i].result = aio_do(ctx->dev, &(reqs[i]));
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&(ctx->lock));
+    ctx->reqs = reqs;
+    ctx->nb_reqs = n;
+    ctx->next = 0;
+    ctx->completed = 0;
+    pthread_cond_broadcast(&(ctx->work));
+    while(ctx->completed < n) {
+        pthread_cond_wait(&(ctx->done), &(ctx->lock));
+    }
+    ctx->reqs = NULL;
+    ctx->nb_reqs = 0;
+    pthread_mutex_unlock(&(ctx->lock));
+    return 0;
+}
+
+struct aio_ctx *aio_alloc(struct bdev *dev, unsigned int depth, enum aio_engine engine)
+{
+    if(dev == NULL) {
+        return NULL;
+    }
+    if(depth == 0) { // default depth
+        depth = AIO_DEFAULT_DEPTH;
+    }
+    struct aio_ctx *ctx = calloc(1, sizeof(struct aio_ctx));
+    if(ctx == NULL) {
+        return NULL;
+    }
+    ctx->dev = dev;
+    ctx->depth = depth;
+    pthread_mutex_init(&(ctx->lock), NULL);
+    pthread_mutex_init(&(ctx->run_lock), NULL);
+    pthread_cond_init(&(ctx->work), NULL);
+    pthread_cond_init(&(ctx->done), NULL);
+
+    if(engine != AIO_THREADS) {
+        ctx->uring = (dev->fd >= 0) ? aio_uring_alloc(depth) : NULL; // io_uring needs a descriptor
+        if(ctx->uring != NULL) {
+            return ctx;
+        }
+        if(engine == AIO_URING) { // io_uring required but not available
+            aio_free(ctx);
+            return NULL;
+        }
+    }
+
+    aio_threads_start(ctx);
+    return ctx;
+}
+
+void aio_free(struct aio_ctx *ctx)
+{
+    if(ctx == NULL) {
+        return;
+    }
+    if(ctx->uring != NULL) {
+        aio_uring_free(ctx->uring);
+    }
+    pthread_mutex_lock(&(ctx->lock));
+    ctx->stop = 1;
+    pthread_cond_broadcast(&(ctx->work));
+    pthread_mutex_unlock(&(ctx->lock));
+    for(size_t i = 0; i < ctx->nb_threads; i++) {
+        pthread_join(ctx->threads[i], NULL);
+    }
+    pthread_cond_destroy(&(ctx->work));
+    pthread_cond_destroy(&(ctx->done));
+    pthread_mutex_destroy(&(ctx->lock));
+    pthread_mutex_destroy(&(ctx->run_lock));
+    free(ctx);
+}
+
+const char *aio_engine_name(const struct aio_ctx *ctx)
+{
+    return (ctx != NULL && ctx->uring != NULL) ? "io_uring" : "threads";
+}
+
+int aio_run(struct aio_ctx *ctx, struct aio_req *reqs, size_t n)
+{
+    M_REQUIRE_NON_NULL(ctx);
+    M_REQUIRE_NON_NULL(reqs);
+
+    pthread_mutex_lock(&(ctx->run_lock));
+    int error = (ctx->uring != NULL) ? aio_uring_run(ctx, reqs, n) : aio_threads_run(ctx, reqs, n);
+    pthread_mutex_unlock(&(ctx->run_lock));
+
+    for(size_t i = 0; !error && i < n; i++) { // first failed request
+        error = reqs[i].result;
+    }
+    return error;
+}
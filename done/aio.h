@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file aio.h
+ * @brief asynchronous, batched sector I/O
+ *
+ * A batch of requests is kept in flight up to the queue depth of the
+ * context; completions are reaped as they arrive and new requests are
+ * submitted in the freed slots. Two engines are available: io_uring
+ * (one io_uring_enter() per submitted batch) and, when io_uring cannot
+ * be set up, a pool of threads doing positional reads and writes. If
+ * io_uring_enter() fails, the requests of the batch are completed (or
+ * taken back from the ring) before the ring is released, and the context
+ * goes on with the thread pool.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AIO_DEFAULT_DEPTH 32 // default number of requests in flight
+#define AIO_MAX_THREADS 16   // max. number of threads of the thread pool engine
+
+enum aio_engine {
+    AIO_AUTO,                // io_uring if available, threads otherwise
+    AIO_URING,               // io_uring only
+    AIO_THREADS              // thread pool only
+};
+
+/**
+ * @brief one request: count contiguous sectors from/to data
+ */
+struct aio_req {
+    uint32_t sector;         // first sector
+    uint32_t count;          // number of sectors
+    void *data;              // count * 512-bytes of memory
+    int write;               // 0 to read, 1 to write
+    int result;              // set by aio_run(): 0 on success; <0 on error
+};
+
+struct aio_uring;            // io_uring rings (defined in aio.c)
+struct bdev;
+
+struct aio_ctx {
+    struct bdev *dev;        // the disk
+    unsigned int depth;      // max. number of requests in flight
+    struct aio_uring *uring; // io_uring engine, NULL for the thread pool
+
+    // thread pool engine
+    size_t nb_threads;       // number of worker threads
+    pthread_t threads[AIO_MAX_THREADS];
+    pthread_mutex_t lock;    // protects the fields below
+    pthread_cond_t work;     // signaled when a batch is available or on stop
+    pthread_cond_t done;     // signaled when the batch is completed
+    struct aio_req *reqs;    // current batch
+    size_t nb_reqs;          // size of the current batch
+    size_t next;             // next request of the batch to process
+    size_t completed;        // number of completed requests of the batch
+    int stop;                // 1 when the workers must exit
+
+    pthread_mutex_t run_lock; // one batch at a time
+};
+
+/**
+ * @brief create an asynchronous I/O context on the given disk
+ * @param dev the disk; io_uring needs a descriptor (dev->fd)
+ * @param depth the queue depth, 0 for AIO_DEFAULT_DEPTH
+ * @param engine the engine to use
+ * @return the new context or NULL on failure (e.g. AIO_URING unavailable)
+ */
+struct aio_ctx *aio_alloc(struct bdev *dev, unsigned int depth, enum aio_engine engine);
+
+/**
+ * @brief release the context (and stop its threads)
+ * @param ctx the context (may be NULL)
+ */
+void aio_free(struct aio_ctx *ctx);
+
+/**
+ * @brief name of the engine of the context
+ * @param ctx the context
+ * @return "io_uring" or "threads"
+ */
+const char *aio_engine_name(const struct aio_ctx *ctx);
+
+/**
+ * @brief perform all the requests, with up to ctx->depth of them in
+ *        flight, and wait for their completion; each request gets its
+ *        own result
+ * @param ctx the context
+ * @param reqs the requests (IN-OUT: result)
+ * @param n the number of requests
+ * @return 0 if all requests succeeded; the first error (<0) otherwise
+ */
+int aio_run(struct aio_ctx *ctx, struct aio_req *reqs, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
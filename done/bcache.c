@@ -0,0 +1,544 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "bcache.h"
+#include "bdev.h"
+#include "error.h"
+
+#define BCACHE_STACK_RUNS 64 // sub-runs of bcache_read_runs() held on the stack
+
+/**
+ * @brief current time, in milliseconds (monotonic)
+ */
+static uint64_t bcache_now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/**
+ * @brief hash bucket of the given sector
+ */
+static size_t bcache_bucket(const struct bcache *c, uint32_t sector)
+{
+    return sector % c->nb_buckets;
+}
+
+/**
+ * @brief find the valid buffer holding sector; lock must be held
+ * @return the buffer or NULL if sector is not cached
+ */
+static struct bcache_buf *bcache_lookup(struct bcache *c, uint32_t sector)
+{
+    struct bcache_buf *b = c->buckets[bcache_bucket(c, sector)];
+    while(b != NULL && b->sector != sector) { // walk the chain
+        b = b->hash_next;
+    }
+    return b;
+}
+
+/**
+ * @brief remove b from its hash chain; lock must be held
+ */
+static void bcache_unhash(struct bcache *c, struct bcache_buf *b)
+{
+    struct bcache_buf **p = &(c->buckets[bcache_bucket(c, b->sector)]);
+    while(*p != NULL && *p != b) { // find the link pointing to b
+        p = &((*p)->hash_next);
+    }
+    if(*p == b) {
+        *p = b->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+/**
+ * @brief move b to the head of the LRU list (most recently used); lock must be held
+ */
+static void bcache_touch(struct bcache *c, struct bcache_buf *b)
+{
+    if(c->lru_head == b) { // already most recently used
+        return;
+    }
+    // unlink
+    b->lru_prev->lru_next = b->lru_next; // b is not the head: it has a predecessor
+    if(b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        c->lru_tail = b->lru_prev;
+    }
+    // insert at head
+    b->lru_prev = NULL;
+    b->lru_next = c->lru_head;
+    c->lru_head->lru_prev = b;
+    c->lru_head = b;
+}
+
+/**
+ * @brief mark b dirty; lock must be held
+ */
+static void bcache_mark_dirty(struct bcache *c, struct bcache_buf *b)
+{
+    if(!b->dirty) {
+        b->dirty = 1;
+        b->dirty_time = bcache_now_ms();
+        c->nb_dirty++;
+        if(c->flusher_running && c->nb_dirty >= c->flush_dirty) { // too many dirty buffers
+            pthread_cond_signal(&(c->flusher_wake));
+        }
+    }
+}
+
+/**
+ * @brief order of buffers by sector, for qsort()
+ */
+static int bcache_cmp_sector(const void *a, const void *b)
+{
+    uint32_t sa = (*(struct bcache_buf* const*)a)->sector;
+    uint32_t sb = (*(struct bcache_buf* const*)b)->sector;
+    return (sa > sb) - (sa < sb);
+}
+
+/**
+ * @brief write back every dirty unpinned buffer, in sector order, with
+ *        one I/O per run of adjacent sectors; lock must be held
+ * @return 0 on success; <0 on error (all buffers stay dirty)
+ */
+static int bcache_flush(struct bcache *c)
+{
+    size_t n = 0;
+    for(size_t i = 0; i < c->size; i++) { // collect the dirty set
+        struct bcache_buf *b = &(c->bufs[i]);
+        if(b->valid && b->dirty && b->pins == 0) { // a pinned buffer may be being modified
+            c->flush_bufs[n++] = b;
+        }
+    }
+    if(n == 0) {
+        return 0;
+    }
+    qsort(c->flush_bufs, n, sizeof(struct bcache_buf*), bcache_cmp_sector); // elevator order
+    size_t runs = 0;
+    for(size_t i = 0; i < n; i++) {
+        c->flush_vec[i].sector = c->flush_bufs[i]->sector;
+        c->flush_vec[i].data = c->flush_bufs[i]->data;
+        if(i == 0 || c->flush_vec[i].sector != c->flush_vec[i - 1].sector + 1) { // starts a run
+            runs++;
+        }
+    }
+    int error = bdev_writev(c->dev, c->flush_vec, n); // adjacent sectors are written together
+    if(error) { // error occured
+        return error; // propagate error, the buffers stay dirty
+    }
+    for(size_t i = 0; i < n; i++) {
+        c->flush_bufs[i]->dirty = 0;
+    }
+    c->nb_dirty -= n;
+    c->stats.writebacks += n;
+    c->stats.write_ios += runs;
+    c->stats.flushes++;
+    return 0;
+}
+
+/**
+ * @brief get the buffer of sector, pinned; lock must be held
+ * @param read 1 to read the sector from disk on a miss, 0 if the caller
+ *        overwrites the whole buffer
+ * @return 0 on success; <0 on error
+ */
+static int bcache_getblk(struct bcache *c, uint32_t sector, int read, struct bcache_buf **buf)
+{
+    struct bcache_buf *b = bcache_lookup(c, sector);
+    if(b != NULL) { // hit
+        c->stats.hits++;
+    } else { // miss: reuse the least recently used unpinned buffer
+        b = c->lru_tail;
+        while(b != NULL && b->pins > 0) {
+            b = b->lru_prev;
+        }
+        if(b == NULL) { // all buffers pinned
+            return ERR_NOMEM;
+        }
+        if(b->valid) { // buffer holds another sector
+            if(b->dirty) { // write back the whole dirty set, not just b
+                int error = bcache_flush(c);
+                if(error) { // error occured
+                    return error; // propagate error
+                }
+            }
+            bcache_unhash(c, b);
+            b->valid = 0;
+            c->stats.evictions++;
+        }
+        if(read) {
+            int error = bdev_read(c->dev, sector, 1, b->data);
+            if(error) { // error occured, b stays invalid
+                return error; // propagate error
+            }
+        }
+        b->sector = sector;
+        b->valid = 1;
+        b->dirty = 0;
+        size_t bucket = bcache_bucket(c, sector);
+        b->hash_next = c->buckets[bucket];
+        c->buckets[bucket] = b;
+        c->stats.misses++;
+    }
+    b->pins++;
+    bcache_touch(c, b);
+    *buf = b;
+    return 0;
+}
+
+struct bcache *bcache_alloc(struct bdev *dev, size_t size)
+{
+    if(dev == NULL) {
+        return NULL;
+    }
+    if(size == 0) { // default size
+        size = BCACHE_DEFAULT_SIZE;
+    }
+    struct bcache *c = calloc(1, sizeof(struct bcache));
+    if(c == NULL) {
+        return NULL;
+    }
+    c->dev = dev;
+    c->size = size;
+    c->nb_buckets = size;
+    c->bufs = calloc(size, sizeof(struct bcache_buf));
+    c->buckets = calloc(c->nb_buckets, sizeof(struct bcache_buf*));
+    c->flush_bufs = calloc(size, sizeof(struct bcache_buf*));
+    c->flush_vec = calloc(size, sizeof(struct sector_iovec));
+    if(c->bufs == NULL || c->buckets == NULL || c->flush_bufs == NULL || c->flush_vec == NULL
+       || pthread_mutex_init(&(c->lock), NULL)) {
+        free(c->bufs);
+        free(c->buckets);
+        free(c->flush_bufs);
+        free(c->flush_vec);
+        free(c);
+        return NULL;
+    }
+    pthread_cond_init(&(c->flusher_wake), NULL);
+    for(size_t i = 0; i < size; i++) { // chain all buffers in the LRU list
+        c->bufs[i].lru_prev = (i > 0) ? &(c->bufs[i - 1]) : NULL;
+        c->bufs[i].lru_next = (i + 1 < size) ? &(c->bufs[i + 1]) : NULL;
+    }
+    c->lru_head = &(c->bufs[0]);
+    c->lru_tail = &(c->bufs[size - 1]);
+    return c;
+}
+
+/**
+ * @brief the background flusher thread
+ */
+static void *bcache_flusher(void *arg)
+{
+    struct bcache *c = arg;
+    pthread_mutex_lock(&(c->lock));
+    while(!c->flusher_stop) {
+        // wake up at least twice per age period
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        uint64_t ns = until.tv_nsec + (uint64_t)(c->flush_age_ms / 2 + 1) * 1000000;
+        until.tv_sec += ns / 1000000000;
+        until.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&(c->flusher_wake), &(c->lock), &until);
+        if(c->flusher_stop || c->nb_dirty == 0) {
+            continue;
+        }
+
+        int flush = (c->nb_dirty >= c->flush_dirty);
+        uint64_t now = bcache_now_ms();
+        for(size_t i = 0; !flush && i < c->size; i++) { // is some buffer too old?
+            struct bcache_buf *b = &(c->bufs[i]);
+            flush = b->valid && b->dirty && now - b->dirty_time >= c->flush_age_ms;
+        }
+        if(flush) {
+            bcache_flush(c); // on error, the buffers stay dirty: retried next time
+        }
+    }
+    pthread_mutex_unlock(&(c->lock));
+    return NULL;
+}
+
+int bcache_start_flusher(struct bcache *c, unsigned int age_ms, size_t max_dirty)
+{
+    M_REQUIRE_NON_NULL(c);
+    if(c->flusher_running) { // already started
+        return 0;
+    }
+    c->flush_age_ms = (age_ms == 0) ? BCACHE_FLUSH_AGE_MS : age_ms;
+    c->flush_dirty = (max_dirty == 0 || max_dirty > c->size) ? (c->size + 1) / 2 : max_dirty;
+    c->flusher_stop = 0;
+    if(pthread_create(&(c->flusher), NULL, bcache_flusher, c)) {
+        return ERR_NOMEM;
+    }
+    c->flusher_running = 1;
+    return 0;
+}
+
+void bcache_free(struct bcache *c)
+{
+    if(c != NULL) {
+        if(c->flusher_running) { // stop the flusher
+            pthread_mutex_lock(&(c->lock));
+            c->flusher_stop = 1;
+            pthread_cond_signal(&(c->flusher_wake));
+            pthread_mutex_unlock(&(c->lock));
+            pthread_join(c->flusher, NULL);
+        }
+        pthread_cond_destroy(&(c->flusher_wake));
+        pthread_mutex_destroy(&(c->lock));
+        free(c->bufs);
+        free(c->buckets);
+        free(c->flush_bufs);
+        free(c->flush_vec);
+        free(c);
+    }
+}
+
+int bcache_get(struct bcache *c, uint32_t sector, struct bcache_buf **buf)
+{
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(buf);
+
+    pthread_mutex_lock(&(c->lock));
+    int error = bcache_getblk(c, sector, 1, buf);
+    pthread_mutex_unlock(&(c->lock));
+    return error;
+}
+
+void bcache_put(struct bcache *c, struct bcache_buf *buf, int dirty)
+{
+    if(c != NULL && buf != NULL) {
+        pthread_mutex_lock(&(c->lock));
+        if(dirty) {
+            bcache_mark_dirty(c, buf);
+        }
+        if(buf->pins > 0) {
+            buf->pins--;
+        }
+        pthread_mutex_unlock(&(c->lock));
+    }
+}
+
+int bcache_read(struct bcache *c, uint32_t sector, void *data)
+{
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(data);
+
+    struct bcache_buf *b = NULL;
+    pthread_mutex_lock(&(c->lock));
+    int error = bcache_getblk(c, sector, 1, &b);
+    if(!error) {
+        memcpy(data, b->data, SECTOR_SIZE);
+        b->pins--;
+    }
+    pthread_mutex_unlock(&(c->lock));
+    return error;
+}
+
+int bcache_write(struct bcache *c, uint32_t sector, const void *data)
+{
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(data);
+
+    struct bcache_buf *b = NULL;
+    pthread_mutex_lock(&(c->lock));
+    int error = bcache_getblk(c, sector, 0, &b); // whole sector overwritten: no need to read it
+    if(!error) {
+        memcpy(b->data, data, SECTOR_SIZE);
+        bcache_mark_dirty(c, b);
+        b->pins--;
+    }
+    pthread_mutex_unlock(&(c->lock));
+    return error;
+}
+
+int bcache_read_range(struct bcache *c, uint32_t first, uint32_t count, void *data)
+{
+    struct aio_req run = { first, count, data, 0, 0 };
+    return bcache_read_runs(c, NULL, &run, 1);
+}
+
+/**
+ * @brief copy into the runs the sectors of the sub-runs that are cached
+ *        now; lock must be held
+ */
+static void bcache_copy_cached(struct bcache *c, const struct aio_req *reqs, size_t nb)
+{
+    for(size_t i = 0; i < nb; i++) {
+        uint8_t *out = reqs[i].data;
+        for(uint32_t s = 0; s < reqs[i].count; s++) {
+            struct bcache_buf *b = bcache_lookup(c, reqs[i].sector + s);
+            if(b != NULL) { // cached during the I/O: at least as recent as the disk
+                memcpy(&(out[s * SECTOR_SIZE]), b->data, SECTOR_SIZE);
+            }
+        }
+    }
+}
+
+int bcache_read_runs(struct bcache *c, struct aio_ctx *aio, struct aio_req *runs, size_t n)
+{
+    M_REQUIRE_NON_NULL(c);
+    M_REQUIRE_NON_NULL(runs);
+
+    size_t max = 0; // max. number of uncached sub-runs: one per sector
+    for(size_t r = 0; r < n; r++) {
+        M_REQUIRE_NON_NULL(runs[r].data);
+        max += runs[r].count;
+    }
+    if(max == 0) { // nothing to read
+        return 0;
+    }
+    struct aio_req stack_reqs[BCACHE_STACK_RUNS]; // small batches need no allocation
+    size_t stack_owner[BCACHE_STACK_RUNS];
+    struct aio_req *reqs = (max <= BCACHE_STACK_RUNS) ? stack_reqs : calloc(max, sizeof(struct aio_req)); // uncached sub-runs
+    size_t *owner = (max <= BCACHE_STACK_RUNS) ? stack_owner : calloc(max, sizeof(size_t)); // run of each sub-run
+    if(reqs == NULL || owner == NULL) {
+        if(reqs != stack_reqs) {
+            free(reqs);
+            free(owner);
+        }
+        return ERR_NOMEM;
+    }
+
+    size_t nb = 0; // number of sub-runs
+    pthread_mutex_lock(&(c->lock));
+    for(size_t r = 0; r < n; r++) {
+        uint8_t *out = runs[r].data;
+        uint32_t first = runs[r].sector;
+        uint32_t i = 0;
+        runs[r].result = 0;
+        while(i < runs[r].count) {
+            struct bcache_buf *b = bcache_lookup(c, first + i);
+            if(b != NULL) { // cached: may be more recent than the disk
+                memcpy(&(out[i * SECTOR_SIZE]), b->data, SECTOR_SIZE);
+                c->stats.hits++;
+                i++;
+            } else { // run of uncached sectors, one I/O
+                uint32_t len = 1;
+                while(i + len < runs[r].count && bcache_lookup(c, first + i + len) == NULL) {
+                    len++;
+                }
+                reqs[nb] = (struct aio_req) { first + i, len, &(out[i * SECTOR_SIZE]), 0, 0 };
+                owner[nb] = r;
+                nb++;
+                c->stats.misses += len;
+                i += len;
+            }
+        }
+    }
+    uint64_t writebacks = c->stats.writebacks; // the disk changes only through a write back
+    // the I/O runs without the lock: other readers and writers go on
+    // meanwhile; the memory backends only copy, and keep it
+    int unlocked = (c->dev->ops->view == NULL);
+    if(unlocked) {
+        pthread_mutex_unlock(&(c->lock));
+    }
+
+    int error = 0;
+    if(aio != NULL && nb > 1) { // all sub-runs in flight together
+        error = aio_run(aio, reqs, nb);
+    } else {
+        for(size_t i = 0; i < nb; i++) {
+            reqs[i].result = bdev_read(c->dev, reqs[i].sector, reqs[i].count, reqs[i].data);
+            if(!error) {
+                error = reqs[i].result;
+            }
+        }
+    }
+
+    // publish: a sector cached meanwhile (e.g. written) is taken from the
+    // cache; if dirty sectors reached the disk meanwhile, one of them may
+    // have been read half written (or before its checksum, which fails),
+    // so the sub-runs are read again under the lock, where no write back
+    // can happen, whatever the first read returned
+    if(unlocked) {
+        pthread_mutex_lock(&(c->lock));
+    }
+    if(c->stats.writebacks != writebacks) {
+        error = 0;
+        for(size_t i = 0; i < nb; i++) {
+            reqs[i].result = bdev_read(c->dev, reqs[i].sector, reqs[i].count, reqs[i].data);
+            if(!error) {
+                error = reqs[i].result;
+            }
+        }
+    }
+    if(!error) {
+        bcache_copy_cached(c, reqs, nb);
+    }
+    pthread_mutex_unlock(&(c->lock));
+
+    for(size_t i = 0; i < nb; i++) { // result of each run: its first failed sub-run
+        if(reqs[i].result && !runs[owner[i]].result) {
+            runs[owner[i]].result = reqs[i].result;
+        }
+    }
+    if(reqs != stack_reqs) {
+        free(reqs);
+        free(owner);
+    }
+    return error;
+}
+
+int bcache_is_dirty(struct bcache *c, uint32_t sector)
+{
+    if(c == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&(c->lock));
+    struct bcache_buf *b = bcache_lookup(c, sector);
+    int dirty = (b != NULL && b->dirty);
+    pthread_mutex_unlock(&(c->lock));
+    return dirty;
+}
+
+const void *bcache_view(struct bcache *c, uint32_t sector)
+{
+    if(c == NULL || c->dev == NULL || c->dev->ops->view == NULL) { // backend without memory views
+        return NULL;
+    }
+    if(bcache_is_dirty(c, sector)) { // the backend is not up to date
+        return NULL;
+    }
+    return bdev_view(c->dev, sector); // NULL beyond the disk
+}
+
+int bcache_sync(struct bcache *c)
+{
+    M_REQUIRE_NON_NULL(c);
+
+    pthread_mutex_lock(&(c->lock));
+    int error = bcache_flush(c); // write back every dirty buffer
+    pthread_mutex_unlock(&(c->lock));
+    return error ? error : bdev_flush(c->dev);
+}
+
+void bcache_print_stats(struct bcache *c)
+{
+    printf("**********BUFFER CACHE START**********\n");
+    if(c == NULL) {
+        printf("NULL ptr\n");
+    } else {
+        pthread_mutex_lock(&(c->lock));
+        struct bcache_stats s = c->stats;
+        size_t dirty = c->nb_dirty;
+        pthread_mutex_unlock(&(c->lock));
+
+        uint64_t lookups = s.hits + s.misses;
+        printf("%-19s : %zu\n", "buffers", c->size);
+        printf("%-19s : %zu\n", "dirty", dirty);
+        printf("%-19s : %" PRIu64 "\n", "hits", s.hits);
+        printf("%-19s : %" PRIu64 "\n", "misses", s.misses);
+        printf("%-19s : %.1f%%\n", "hit rate", lookups ? 100.0 * s.hits / lookups : 0.0);
+        printf("%-19s : %" PRIu64 "\n", "writebacks", s.writebacks);
+        printf("%-19s : %" PRIu64 "\n", "write I/Os", s.write_ios);
+        printf("%-19s : %" PRIu64 "\n", "flushes", s.flushes);
+        printf("%-19s : %" PRIu64 "\n", "evictions", s.evictions);
+    }
+    printf("**********BUFFER CACHE END************\n");
+    fflush(stdout);
+}
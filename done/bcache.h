@@ -0,0 +1,202 @@
+#pragma once
+
+/**
+ * @file bcache.h
+ * @brief write-back buffer cache of disk sectors (getblk/brelse style)
+ *
+ * Buffers are indexed by a hash on the sector number and kept in LRU
+ * order. A buffer is pinned between bcache_get() and bcache_put() and
+ * is never evicted while pinned. Writes only mark buffers dirty; dirty
+ * buffers reach the disk when a dirty buffer is evicted, on bcache_sync(),
+ * on umountv6() or from the background flusher. All of them write the
+ * whole dirty set at once, sorted by sector, with adjacent sectors
+ * merged into one I/O: each sector is written once per flush.
+ * All functions are thread-safe.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "unixv6fs.h"
+#include "aio.h"
+#include "bdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCACHE_DEFAULT_SIZE 256 // number of buffers (sectors) of a cache
+#define BCACHE_FLUSH_AGE_MS 1000 // default age of the dirty buffers written back by the flusher
+
+struct bcache_buf {
+    uint32_t sector;                  // sector held by the buffer
+    int valid;                        // 1 if data holds the content of sector
+    int dirty;                        // 1 if data must be written back to disk
+    uint64_t dirty_time;              // when the buffer became dirty (ms, monotonic)
+    unsigned int pins;                // number of bcache_get() without bcache_put()
+    struct bcache_buf *hash_next;     // next buffer in the same hash bucket
+    struct bcache_buf *lru_prev;      // more recently used buffer
+    struct bcache_buf *lru_next;      // less recently used buffer
+    uint8_t data[SECTOR_SIZE];        // content of the sector
+};
+
+struct bcache_stats {
+    uint64_t hits;                    // sectors found in the cache
+    uint64_t misses;                  // sectors read from disk
+    uint64_t writebacks;              // dirty sectors written to disk
+    uint64_t write_ios;               // write I/Os (runs of adjacent sectors) to disk
+    uint64_t flushes;                 // writes of the dirty set
+    uint64_t evictions;               // buffers reused for another sector
+};
+
+struct bcache {
+    struct bdev *dev;                 // the disk
+    size_t size;                      // number of buffers
+    struct bcache_buf *bufs;          // the buffers
+    size_t nb_buckets;                // number of hash buckets
+    struct bcache_buf **buckets;      // hash buckets (chains of buffers)
+    struct bcache_buf *lru_head;      // most recently used buffer
+    struct bcache_buf *lru_tail;      // least recently used buffer
+    struct bcache_stats stats;        // counters
+    size_t nb_dirty;                  // number of dirty buffers
+    struct bcache_buf **flush_bufs;   // room for the dirty set, sorted by flushes
+    struct sector_iovec *flush_vec;   // room for the I/O of a flush
+    pthread_mutex_t lock;             // protects all the above
+
+    // background flusher
+    pthread_t flusher;                // the thread, if flusher_running
+    int flusher_running;
+    int flusher_stop;                 // 1 when the flusher must exit
+    pthread_cond_t flusher_wake;      // signaled on stop or when too many buffers are dirty
+    unsigned int flush_age_ms;        // dirty buffers older than this are written back
+    size_t flush_dirty;               // number of dirty buffers that triggers a flush
+};
+
+/**
+ * @brief allocate a new cache for the given disk
+ * @param dev the disk
+ * @param size the number of buffers, 0 for BCACHE_DEFAULT_SIZE
+ * @return the new cache or NULL on failure
+ */
+struct bcache *bcache_alloc(struct bdev *dev, size_t size);
+
+/**
+ * @brief start the background flusher: the dirty set is written back as
+ *        soon as a buffer has been dirty for age_ms or dirty buffers
+ *        reach max_dirty
+ * @param c the cache
+ * @param age_ms the age of dirty buffers, 0 for BCACHE_FLUSH_AGE_MS
+ * @param max_dirty the number of dirty buffers, 0 for half the cache
+ * @return 0 on success; <0 on error
+ */
+int bcache_start_flusher(struct bcache *c, unsigned int age_ms, size_t max_dirty);
+
+/**
+ * @brief free the cache, without writing back dirty buffers; the
+ *        flusher, if any, is stopped first
+ * @param c the cache (may be NULL)
+ */
+void bcache_free(struct bcache *c);
+
+/**
+ * @brief get the buffer of the given sector, pinned (getblk + bread)
+ * @param c the cache
+ * @param sector the sector
+ * @param buf the buffer, valid until bcache_put() (OUT)
+ * @return 0 on success; <0 on error
+ */
+int bcache_get(struct bcache *c, uint32_t sector, struct bcache_buf **buf);
+
+/**
+ * @brief unpin a buffer obtained from bcache_get() (brelse)
+ * @param c the cache
+ * @param buf the buffer
+ * @param dirty 1 if the content of the buffer was modified
+ */
+void bcache_put(struct bcache *c, struct bcache_buf *buf, int dirty);
+
+/**
+ * @brief read one sector through the cache
+ * @param c the cache
+ * @param sector the sector
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int bcache_read(struct bcache *c, uint32_t sector, void *data);
+
+/**
+ * @brief write one sector through the cache (delayed write)
+ * @param c the cache
+ * @param sector the sector
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int bcache_write(struct bcache *c, uint32_t sector, const void *data);
+
+/**
+ * @brief read count contiguous sectors; cached sectors are copied from
+ *        the cache, the others are read from disk with one I/O per run
+ *        and are not added to the cache (used for scans)
+ * @param c the cache
+ * @param first the first sector
+ * @param count the number of sectors
+ * @param data a pointer to count * 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int bcache_read_range(struct bcache *c, uint32_t first, uint32_t count, void *data);
+
+/**
+ * @brief read several runs of contiguous sectors at once; as for
+ *        bcache_read_range(), cached sectors are copied from the cache,
+ *        but all the uncached runs are submitted together to aio. The
+ *        I/O is done without the lock of the cache; the sectors cached
+ *        meanwhile are then copied from the cache, and if a write back
+ *        reached the disk meanwhile, the runs are read again under the
+ *        lock, whether the first read failed or not
+ * @param c the cache
+ * @param aio the asynchronous I/O context, NULL to read the runs one by one
+ * @param runs the runs to read (IN-OUT: result of each run)
+ * @param n the number of runs
+ * @return 0 if all runs were read; the first error (<0) otherwise
+ */
+int bcache_read_runs(struct bcache *c, struct aio_ctx *aio, struct aio_req *runs, size_t n);
+
+/**
+ * @brief tell whether the given sector is dirty in the cache,
+ *        i.e. whether the disk does not hold its latest content
+ * @param c the cache
+ * @param sector the sector
+ * @return 1 if dirty, 0 otherwise
+ */
+int bcache_is_dirty(struct bcache *c, uint32_t sector);
+
+/**
+ * @brief return a read-only view of one sector, straight into the memory
+ *        of the backend of the disk (see bdev_view()); no copy, no system call
+ * @param c the cache (may be NULL)
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @return a pointer to the 512 bytes of the sector, valid until umountv6();
+ *         NULL if the backend has no memory view, the sector is beyond the
+ *         disk or it is dirty in the cache, in which case the caller
+ *         shall use bcache_read()
+ */
+const void *bcache_view(struct bcache *c, uint32_t sector);
+
+/**
+ * @brief write back all dirty (unpinned) buffers, sorted and merged, and
+ *        flush the disk
+ * @param c the cache
+ * @return 0 on success; <0 on error
+ */
+int bcache_sync(struct bcache *c);
+
+/**
+ * @brief print the counters of the cache to stdout
+ * @param c the cache
+ */
+void bcache_print_stats(struct bcache *c);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,592 @@
+#define _GNU_SOURCE // for SEEK_DATA and SEEK_HOLE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bdev.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define BDEV_MAX_SECTORS 65536 // largest unix v6 disk (s_fsize is 16 bits)
+#define SECTOR_IOV_BATCH 64     // sectors per sector_readv() of the pread backend
+
+/**
+ * @brief tell whether sectors [first, first + count[ lie within size bytes
+ */
+static int bdev_in(size_t size, uint32_t first, uint32_t count)
+{
+    return ((size_t)first + count) * SECTOR_SIZE <= size;
+}
+
+/**
+ * @brief readv/writev of the backends without vectored I/O: one sector at a time
+ */
+static int bdev_loopv(struct bdev *dev, const struct sector_iovec *vec, size_t count, int write)
+{
+    M_REQUIRE_NON_NULL(vec);
+    for(size_t i = 0; i < count; i++) {
+        M_REQUIRE_NON_NULL(vec[i].data);
+        int error = write ? dev->ops->write(dev, vec[i].sector, 1, vec[i].data)
+                    : dev->ops->read(dev, vec[i].sector, 1, vec[i].data);
+        if(error) { // error occured
+            return error; // propagate error
+        }
+    }
+    return 0;
+}
+
+static int bdev_loop_readv(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    return bdev_loopv(dev, vec, count, 0);
+}
+
+static int bdev_loop_writev(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    return bdev_loopv(dev, vec, count, 1);
+}
+
+/*
+ * pread backend: positional I/O on the image (see sector.h); priv is a
+ * bitmap of the sectors known to read as zeros (holes of the image and
+ * sectors written with zeros), which are read without a system call and
+ * not written again with zeros; mem_size follows the size of the image
+ */
+
+/**
+ * @brief tell whether a sector is known to read as zeros
+ */
+static int pread_is_hole(struct bdev *dev, uint32_t sector)
+{
+    const uint64_t *holes = dev->priv;
+    return sector < BDEV_MAX_SECTORS
+           && (__atomic_load_n(&holes[sector / 64], __ATOMIC_RELAXED) >> (sector % 64)) & 1;
+}
+
+/**
+ * @brief record whether a sector just written reads as zeros
+ */
+static void pread_set_hole(struct bdev *dev, uint32_t sector, int hole)
+{
+    uint64_t *holes = dev->priv;
+    if(sector >= BDEV_MAX_SECTORS) {
+        return;
+    }
+    uint64_t bit = UINT64_C(1) << (sector % 64);
+    if(hole) {
+        __atomic_fetch_or(&holes[sector / 64], bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&holes[sector / 64], ~bit, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief record that sectors [first, end[ read as zeros, 64 at a time
+ */
+static void pread_set_holes(uint64_t *holes, uint32_t first, uint32_t end)
+{
+    end = (end < BDEV_MAX_SECTORS) ? end : BDEV_MAX_SECTORS;
+    while(first < end) {
+        uint32_t bits = 64 - first % 64; // up to the end of the word
+        bits = (end - first < bits) ? end - first : bits;
+        uint64_t mask = (bits == 64) ? ~UINT64_C(0) : ((UINT64_C(1) << bits) - 1) << (first % 64);
+        __atomic_fetch_or(&holes[first / 64], mask, __ATOMIC_RELAXED);
+        first += bits;
+    }
+}
+
+static int pread_read(struct bdev *dev, uint32_t first, uint32_t count, void *data)
+{
+    uint32_t s = 0;
+    while(s < count && pread_is_hole(dev, first + s)) {
+        s++;
+    }
+    if(s == count) { // only holes
+        memset(data, 0, (size_t)count * SECTOR_SIZE);
+        return 0;
+    }
+    return sector_read_range(dev->f, first, count, data);
+}
+
+/**
+ * @brief record the size of the image after writing sectors [first, end[:
+ *        the sectors skipped by a write past the end of the image are holes
+ */
+static void pread_grow(struct bdev *dev, uint32_t first, uint32_t end)
+{
+    pthread_mutex_lock(&(dev->lock));
+    if((size_t)end * SECTOR_SIZE > dev->mem_size) {
+        pread_set_holes(dev->priv, (dev->mem_size + SECTOR_SIZE - 1) / SECTOR_SIZE, first);
+        dev->mem_size = (size_t)end * SECTOR_SIZE;
+    }
+    pthread_mutex_unlock(&(dev->lock));
+}
+
+static int pread_write(struct bdev *dev, uint32_t first, uint32_t count, const void *data)
+{
+    const uint8_t *bytes = data;
+    uint32_t s = 0;
+    while(s < count && pread_is_hole(dev, first + s) && sector_is_zero(&bytes[(size_t)s * SECTOR_SIZE])) {
+        s++;
+    }
+    if(s == count) { // zeros over holes: nothing to do
+        return 0;
+    }
+    int error = sector_write_range(dev->f, first, count, data);
+    if(!error) {
+        pread_grow(dev, first, first + count);
+    }
+    for(s = 0; !error && s < count; s++) {
+        pread_set_hole(dev, first + s, sector_is_zero(&bytes[(size_t)s * SECTOR_SIZE]));
+    }
+    return error;
+}
+
+static int pread_readv(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    struct sector_iovec data[SECTOR_IOV_BATCH]; // the sectors that must be read
+    size_t nb = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(pread_is_hole(dev, vec[i].sector)) {
+            memset(vec[i].data, 0, SECTOR_SIZE);
+            continue;
+        }
+        data[nb++] = vec[i];
+        if(nb == SECTOR_IOV_BATCH) {
+            int error = sector_readv(dev->f, data, nb);
+            if(error) { // error occured
+                return error; // propagate error
+            }
+            nb = 0;
+        }
+    }
+    return (nb > 0) ? sector_readv(dev->f, data, nb) : 0;
+}
+
+static int pread_writev(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    int error = sector_writev(dev->f, vec, count);
+    for(size_t i = 0; !error && i < count; i++) {
+        pread_grow(dev, vec[i].sector, vec[i].sector + 1);
+        pread_set_hole(dev, vec[i].sector, sector_is_zero(vec[i].data));
+    }
+    return error;
+}
+
+static int pread_flush(struct bdev *dev)
+{
+    (void)dev;
+    return 0; // pwrite is not buffered
+}
+
+static uint32_t pread_size(struct bdev *dev)
+{
+    struct stat st;
+    return fstat(dev->fd, &st) ? 0 : st.st_size / SECTOR_SIZE;
+}
+
+static int file_close(struct bdev *dev)
+{
+    return fclose(dev->f) ? ERR_IO : 0;
+}
+
+static int pread_close(struct bdev *dev)
+{
+    free(dev->priv);
+    return file_close(dev);
+}
+
+static const struct bdev_ops pread_ops = {
+    "pread", pread_read, pread_write, pread_readv, pread_writev,
+    pread_flush, pread_size, pread_close, NULL
+};
+
+/*
+ * stdio backend: the original implementation, fseek + fread/fwrite
+ */
+
+/**
+ * @brief common part of stdio_read() and stdio_write()
+ */
+static int stdio_transfer(struct bdev *dev, uint32_t first, uint32_t count, void *data, int write)
+{
+    size_t bytes = (size_t)count * SECTOR_SIZE;
+    int error = 0;
+    pthread_mutex_lock(&(dev->lock)); // the cursor is shared
+    if(fseek(dev->f, (long)SECTOR_SIZE * first, SEEK_SET)) {
+        error = ERR_IO;
+    } else if(write) {
+        error = (fwrite(data, sizeof(uint8_t), bytes, dev->f) == bytes) ? 0 : ERR_IO;
+    } else {
+        error = (fread(data, sizeof(uint8_t), bytes, dev->f) == bytes) ? 0 : ERR_IO;
+    }
+    pthread_mutex_unlock(&(dev->lock));
+    return error;
+}
+
+static int stdio_read(struct bdev *dev, uint32_t first, uint32_t count, void *data)
+{
+    return stdio_transfer(dev, first, count, data, 0);
+}
+
+static int stdio_write(struct bdev *dev, uint32_t first, uint32_t count, const void *data)
+{
+    return stdio_transfer(dev, first, count, (void*)data, 1);
+}
+
+static int stdio_flush(struct bdev *dev)
+{
+    pthread_mutex_lock(&(dev->lock));
+    int error = fflush(dev->f) ? ERR_IO : 0;
+    pthread_mutex_unlock(&(dev->lock));
+    return error;
+}
+
+static uint32_t stdio_size(struct bdev *dev)
+{
+    pthread_mutex_lock(&(dev->lock));
+    long size = fseek(dev->f, 0, SEEK_END) ? 0 : ftell(dev->f); // includes buffered writes
+    pthread_mutex_unlock(&(dev->lock));
+    return (size > 0) ? size / SECTOR_SIZE : 0;
+}
+
+static const struct bdev_ops stdio_ops = {
+    "stdio", stdio_read, stdio_write, bdev_loop_readv, bdev_loop_writev,
+    stdio_flush, stdio_size, file_close, NULL
+};
+
+/*
+ * mmap backend: the image mapped read-write, shared with the page cache;
+ * the mapping does not grow, sectors written past its end use pwrite
+ */
+
+/**
+ * @brief common part of mmap_read() and mmap_write(): sectors within the
+ *        mapping are copied, the others (the image may be shorter than
+ *        the filesystem) use positional I/O
+ */
+static int mmap_transfer(struct bdev *dev, uint32_t first, uint32_t count, void *data, int write)
+{
+    uint32_t mapped = dev->mem_size / SECTOR_SIZE; // number of mapped sectors
+    uint32_t in = (first >= mapped) ? 0 : ((count < mapped - first) ? count : mapped - first); // sectors of the range within the mapping
+    uint8_t *mem = &(dev->mem[(size_t)first * SECTOR_SIZE]);
+    if(in > 0 && write) {
+        memcpy(mem, data, (size_t)in * SECTOR_SIZE);
+    } else if(in > 0) {
+        memcpy(data, mem, (size_t)in * SECTOR_SIZE);
+    }
+    if(in == count) { // the whole range is mapped
+        return 0;
+    }
+    uint8_t *rest = (uint8_t*)data + (size_t)in * SECTOR_SIZE;
+    return write ? sector_write_range(dev->f, first + in, count - in, rest)
+           : sector_read_range(dev->f, first + in, count - in, rest);
+}
+
+static int mmap_read(struct bdev *dev, uint32_t first, uint32_t count, void *data)
+{
+    return mmap_transfer(dev, first, count, data, 0);
+}
+
+static int mmap_write(struct bdev *dev, uint32_t first, uint32_t count, const void *data)
+{
+    return mmap_transfer(dev, first, count, (void*)data, 1);
+}
+
+static int mmap_flush(struct bdev *dev)
+{
+    (void)dev;
+    return 0; // shared mapping: the page cache already holds the writes
+}
+
+static int mmap_close(struct bdev *dev)
+{
+    munmap(dev->mem, dev->mem_size);
+    return file_close(dev);
+}
+
+static const void *mem_view(struct bdev *dev, uint32_t sector)
+{
+    size_t size = __atomic_load_n(&(dev->mem_size), __ATOMIC_ACQUIRE); // may grow (RAM)
+    return bdev_in(size, sector, 1) ? &(dev->mem[(size_t)sector * SECTOR_SIZE]) : NULL;
+}
+
+static const struct bdev_ops mmap_ops = {
+    "mmap", mmap_read, mmap_write, bdev_loop_readv, bdev_loop_writev,
+    mmap_flush, pread_size, mmap_close, mem_view
+};
+
+/*
+ * RAM backend: BDEV_MAX_SECTORS of address space reserved once (so
+ * that views stay valid), memory committed as sectors are written
+ */
+
+static int ram_read(struct bdev *dev, uint32_t first, uint32_t count, void *data)
+{
+    size_t size = __atomic_load_n(&(dev->mem_size), __ATOMIC_ACQUIRE);
+    if(!bdev_in(size, first, count)) { // beyond the data, as a short read of a file
+        return ERR_IO;
+    }
+    memcpy(data, &(dev->mem[(size_t)first * SECTOR_SIZE]), (size_t)count * SECTOR_SIZE);
+    return 0;
+}
+
+static int ram_write(struct bdev *dev, uint32_t first, uint32_t count, const void *data)
+{
+    if(!bdev_in((size_t)BDEV_MAX_SECTORS * SECTOR_SIZE, first, count)) { // beyond the largest disk
+        return ERR_IO;
+    }
+    memcpy(&(dev->mem[(size_t)first * SECTOR_SIZE]), data, (size_t)count * SECTOR_SIZE);
+    size_t end = ((size_t)first + count) * SECTOR_SIZE;
+    pthread_mutex_lock(&(dev->lock));
+    if(end > dev->mem_size) { // the disk grows, as a file written past its end
+        __atomic_store_n(&(dev->mem_size), end, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(dev->lock));
+    return 0;
+}
+
+static int ram_flush(struct bdev *dev)
+{
+    (void)dev;
+    return 0; // nothing to write back
+}
+
+static uint32_t ram_size(struct bdev *dev)
+{
+    return __atomic_load_n(&(dev->mem_size), __ATOMIC_ACQUIRE) / SECTOR_SIZE;
+}
+
+static int ram_close(struct bdev *dev)
+{
+    munmap(dev->mem, (size_t)BDEV_MAX_SECTORS * SECTOR_SIZE);
+    return 0;
+}
+
+static const struct bdev_ops ram_ops = {
+    "ram", ram_read, ram_write, bdev_loop_readv, bdev_loop_writev,
+    ram_flush, ram_size, ram_close, mem_view
+};
+
+/**
+ * @brief open the image file of a file backend
+ * @return 0 on success; <0 on error
+ */
+static int bdev_open_file(struct bdev *dev, const char *filename, int create)
+{
+    if(filename == NULL) {
+        return ERR_BAD_PARAMETER;
+    }
+    dev->f = fopen(filename, create ? "w+b" : "r+b"); // binary read and write mode
+    if(dev->f == NULL) { // open error
+        return ERR_IO;
+    }
+    dev->fd = fileno(dev->f);
+    return 0;
+}
+
+/**
+ * @brief open the image of the pread backend and find its holes with
+ *        SEEK_DATA/SEEK_HOLE (nothing is known if they are not supported)
+ * @return 0 on success; <0 on error
+ */
+static int bdev_open_pread(struct bdev *dev, const char *filename, int create)
+{
+    uint64_t *holes = calloc(BDEV_MAX_SECTORS / 64, sizeof(uint64_t));
+    if(holes == NULL) {
+        return ERR_NOMEM;
+    }
+    int error = bdev_open_file(dev, filename, create);
+    if(error) {
+        free(holes);
+        return error;
+    }
+    dev->priv = holes;
+
+    off_t end = lseek(dev->fd, 0, SEEK_END);
+    dev->mem_size = (end > 0) ? end : 0;
+    off_t pos = 0; // start of the next hole
+    while(pos < end) {
+        off_t data = lseek(dev->fd, pos, SEEK_DATA);
+        if(data < 0 && errno != ENXIO) { // not supported
+            break;
+        }
+        data = (data < 0) ? end : data; // ENXIO: a hole up to the end
+        uint32_t last = (data / SECTOR_SIZE < BDEV_MAX_SECTORS) ? data / SECTOR_SIZE : BDEV_MAX_SECTORS;
+        pread_set_holes(holes, (pos + SECTOR_SIZE - 1) / SECTOR_SIZE, last); // whole sectors of [pos, data[
+        pos = (data < end) ? lseek(dev->fd, data, SEEK_HOLE) : end;
+        if(pos < 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief set up the mapping of the mmap backend
+ * @return 0 on success; <0 on error
+ */
+static int bdev_open_mmap(struct bdev *dev, const char *filename, int create)
+{
+    if(create) { // an empty file cannot be mapped
+        return ERR_BAD_PARAMETER;
+    }
+    int error = bdev_open_file(dev, filename, 0);
+    if(error) {
+        return error;
+    }
+    struct stat st;
+    if(fstat(dev->fd, &st) || st.st_size < SECTOR_SIZE) {
+        fclose(dev->f);
+        return ERR_IO;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if(map == MAP_FAILED) {
+        fclose(dev->f);
+        return ERR_IO;
+    }
+    dev->mem = map;
+    dev->mem_size = st.st_size - st.st_size % SECTOR_SIZE; // whole sectors only
+    return 0;
+}
+
+/**
+ * @brief set up the memory of the RAM backend, loaded from filename
+ * @return 0 on success; <0 on error
+ */
+static int bdev_open_ram(struct bdev *dev, const char *filename, int create)
+{
+    size_t max = (size_t)BDEV_MAX_SECTORS * SECTOR_SIZE;
+    void *mem = mmap(NULL, max, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED) {
+        return ERR_NOMEM;
+    }
+    dev->mem = mem;
+    if(filename != NULL && !create) { // load the image
+        FILE *f = fopen(filename, "rb");
+        if(f == NULL) {
+            munmap(mem, max);
+            return ERR_IO;
+        }
+        dev->mem_size = fread(mem, sizeof(uint8_t), max, f);
+        fclose(f);
+    }
+    return 0;
+}
+
+struct bdev *bdev_open(const char *filename, enum bdev_type type, int create)
+{
+    struct bdev *dev = calloc(1, sizeof(struct bdev));
+    if(dev == NULL) {
+        return NULL;
+    }
+    dev->fd = -1;
+    int error = 0;
+    switch(type) {
+    case BDEV_PREAD:
+        dev->ops = &pread_ops;
+        error = bdev_open_pread(dev, filename, create);
+        break;
+    case BDEV_STDIO:
+        dev->ops = &stdio_ops;
+        error = bdev_open_file(dev, filename, create);
+        dev->fd = -1; // the stdio buffer would not see asynchronous I/O
+        break;
+    case BDEV_MMAP:
+        dev->ops = &mmap_ops;
+        error = bdev_open_mmap(dev, filename, create);
+        break;
+    case BDEV_RAM:
+        dev->ops = &ram_ops;
+        error = bdev_open_ram(dev, filename, create);
+        break;
+    default:
+        error = ERR_BAD_PARAMETER;
+    }
+    if(error || pthread_mutex_init(&(dev->lock), NULL)) {
+        if(!error) { // the backend is open
+            dev->ops->close(dev);
+        }
+        free(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+const char *bdev_name(const struct bdev *dev)
+{
+    return (dev != NULL) ? dev->ops->name : "none";
+}
+
+/**
+ * @brief count one request of count sectors
+ */
+static void bdev_count(uint64_t *requests, uint64_t *sectors, uint64_t count)
+{
+    __atomic_fetch_add(requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(sectors, count, __ATOMIC_RELAXED);
+}
+
+int bdev_read(struct bdev *dev, uint32_t first, uint32_t count, void *data)
+{
+    M_REQUIRE_NON_NULL(dev);
+    M_REQUIRE_NON_NULL(data);
+    bdev_count(&(dev->stats.reads), &(dev->stats.sectors_read), count);
+    return dev->ops->read(dev, first, count, data);
+}
+
+int bdev_write(struct bdev *dev, uint32_t first, uint32_t count, const void *data)
+{
+    M_REQUIRE_NON_NULL(dev);
+    M_REQUIRE_NON_NULL(data);
+    bdev_count(&(dev->stats.writes), &(dev->stats.sectors_written), count);
+    return dev->ops->write(dev, first, count, data);
+}
+
+int bdev_readv(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    M_REQUIRE_NON_NULL(dev);
+    M_REQUIRE_NON_NULL(vec);
+    bdev_count(&(dev->stats.reads), &(dev->stats.sectors_read), count);
+    return dev->ops->readv(dev, vec, count);
+}
+
+int bdev_writev(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    M_REQUIRE_NON_NULL(dev);
+    M_REQUIRE_NON_NULL(vec);
+    bdev_count(&(dev->stats.writes), &(dev->stats.sectors_written), count);
+    return dev->ops->writev(dev, vec, count);
+}
+
+int bdev_flush(struct bdev *dev)
+{
+    M_REQUIRE_NON_NULL(dev);
+    return dev->ops->flush(dev);
+}
+
+uint32_t bdev_size(struct bdev *dev)
+{
+    return (dev != NULL) ? dev->ops->size(dev) : 0;
+}
+
+int bdev_close(struct bdev *dev)
+{
+    if(dev == NULL) {
+        return 0;
+    }
+    int error = dev->ops->flush(dev);
+    int closeError = dev->ops->close(dev);
+    pthread_mutex_destroy(&(dev->lock));
+    free(dev);
+    return error ? error : closeError;
+}
+
+const void *bdev_view(struct bdev *dev, uint32_t sector)
+{
+    if(dev == NULL || dev->ops->view == NULL) { // no memory view
+        return NULL;
+    }
+    return dev->ops->view(dev, sector);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+/**
+ * @file bdev.h
+ * @brief block devices: the virtual disk behind a filesystem
+ *
+ * A block device is a table of operations (struct bdev_ops) and the
+ * state of one open disk. The backend is chosen when the disk is opened;
+ * the layers above (buffer cache, inode, file and directory layers) only
+ * use the bdev_*() functions and never see the underlying I/O strategy.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "sector.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum bdev_type {
+    BDEV_PREAD,              // positional reads and writes on the image file (default)
+    BDEV_STDIO,              // fseek + fread/fwrite on the image file
+    BDEV_MMAP,               // the image file mapped in memory (pread/pwrite past its end)
+    BDEV_RAM                 // in-memory disk, never written back to a file
+};
+
+struct bdev;
+
+/**
+ * @brief operations of a backend; all sector numbers and counts are in
+ *        sector units, all functions return 0 on success and <0 on error
+ */
+struct bdev_ops {
+    const char *name;
+    int (*read)(struct bdev *dev, uint32_t first, uint32_t count, void *data);
+    int (*write)(struct bdev *dev, uint32_t first, uint32_t count, const void *data);
+    int (*readv)(struct bdev *dev, const struct sector_iovec *vec, size_t count);
+    int (*writev)(struct bdev *dev, const struct sector_iovec *vec, size_t count);
+    int (*flush)(struct bdev *dev);                          // written data reaches the image
+    uint32_t (*size)(struct bdev *dev);                      // number of sectors of the disk
+    int (*close)(struct bdev *dev);                          // flush and release dev
+    const void *(*view)(struct bdev *dev, uint32_t sector);  // optional (NULL): sector in memory
+};
+
+/**
+ * @brief counters of the requests made through bdev_*(), whatever the backend
+ */
+struct bdev_stats {
+    uint64_t reads;              // read requests (bdev_read() or bdev_readv())
+    uint64_t writes;             // write requests (bdev_write() or bdev_writev())
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+};
+
+struct bdev {
+    const struct bdev_ops *ops;  // the backend
+    FILE *f;                     // file backends: the image, NULL otherwise
+    int fd;                      // descriptor usable for asynchronous reads, -1 if none
+    uint8_t *mem;                // mmap and RAM backends: the content of the disk
+    size_t mem_size;             // mmap: size of the mapping; RAM: bytes holding data; pread: size of the image
+    pthread_mutex_t lock;        // stdio: protects the cursor of f; RAM, pread: protects mem_size
+    void *priv;                  // private data of other backends
+    struct bdev_stats stats;     // updated atomically (not by the io_uring engine of aio.c)
+};
+
+/**
+ * @brief open a disk with the given backend
+ *
+ *        File backends open filename in binary read and write mode, or
+ *        create (truncate) it if create is set. BDEV_RAM loads the
+ *        content of filename in memory; it starts empty if create is set
+ *        or filename is NULL. BDEV_MMAP cannot create a disk; it maps
+ *        the image as it is when opened.
+ *
+ * @param filename the image file
+ * @param type the backend
+ * @param create 1 to start from an empty disk
+ * @return the new device or NULL on failure
+ */
+struct bdev *bdev_open(const char *filename, enum bdev_type type, int create);
+
+/**
+ * @brief name of the backend of the device
+ */
+const char *bdev_name(const struct bdev *dev);
+
+/**
+ * @brief read count contiguous sectors
+ * @param dev the device
+ * @param first the first sector
+ * @param count the number of sectors
+ * @param data a pointer to count * 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int bdev_read(struct bdev *dev, uint32_t first, uint32_t count, void *data);
+
+/**
+ * @brief write count contiguous sectors
+ * @param dev the device
+ * @param first the first sector
+ * @param count the number of sectors
+ * @param data a pointer to count * 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int bdev_write(struct bdev *dev, uint32_t first, uint32_t count, const void *data);
+
+/**
+ * @brief read a list of sectors, each into its own buffer (see sector_readv())
+ * @return 0 on success; <0 on error
+ */
+int bdev_readv(struct bdev *dev, const struct sector_iovec *vec, size_t count);
+
+/**
+ * @brief write a list of sectors, each from its own buffer (see sector_writev())
+ * @return 0 on success; <0 on error
+ */
+int bdev_writev(struct bdev *dev, const struct sector_iovec *vec, size_t count);
+
+/**
+ * @brief make the data written so far visible in the image file
+ * @return 0 on success; <0 on error
+ */
+int bdev_flush(struct bdev *dev);
+
+/**
+ * @brief size of the disk
+ * @return the number of sectors of the disk, 0 if dev is NULL
+ */
+uint32_t bdev_size(struct bdev *dev);
+
+/**
+ * @brief flush and close the device; dev is released even on error
+ * @param dev the device (may be NULL)
+ * @return 0 on success; <0 on error
+ */
+int bdev_close(struct bdev *dev);
+
+/**
+ * @brief read-only view of one sector, straight into the memory of the
+ *        backend; no copy, no system call
+ * @param dev the device
+ * @param sector the sector
+ * @return a pointer to the 512 bytes of the sector, valid until
+ *         bdev_close(); NULL if the backend has no memory view or the
+ *         sector is beyond the disk
+ */
+const void *bdev_view(struct bdev *dev, uint32_t sector);
+
+#ifdef __cplusplus
+}
+#endif
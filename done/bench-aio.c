@@ -0,0 +1,115 @@
+/**
+ * @file bench-aio.c
+ * @brief measures random one-sector reads through aio_run() on a large
+ *        synthetic disk, for both engines and several queue depths
+ */
+
+#define _DEFAULT_SOURCE // for posix_fadvise()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bench-core.h"
+#include "aio.h"
+#include "bdev.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define NB_SECTORS 65535 // largest unix v6 disk (s_fsize is 16 bits)
+#define NB_READS 20000
+#define WRITE_CHUNK 128 // sectors written with a single I/O when creating the disk
+#define USAGE "bench-aio <scratch diskname>"
+
+/**
+ * @brief write NB_SECTORS sectors of random data
+ * @return 0 on success; <0 on error
+ */
+static int make_disk(struct bdev *dev)
+{
+    uint8_t data[WRITE_CHUNK * SECTOR_SIZE];
+    for(uint32_t s = 0; s < NB_SECTORS; s += WRITE_CHUNK) {
+        uint32_t nb = (NB_SECTORS - s < WRITE_CHUNK) ? NB_SECTORS - s : WRITE_CHUNK;
+        for(size_t i = 0; i < sizeof(data); i++) {
+            data[i] = rand();
+        }
+        int error = bdev_write(dev, s, nb, data);
+        if(error) {
+            return error;
+        }
+    }
+    return fsync(dev->fd) ? ERR_IO : 0; // clean pages: they can be dropped from the page cache
+}
+
+/**
+ * @brief read NB_READS random sectors, with up to depth of them in flight
+ * @return the mean time per sector in nanoseconds, <0 on error
+ */
+static double bench(struct bdev *dev, enum aio_engine engine, unsigned int depth, struct aio_req *reqs)
+{
+    struct aio_ctx *ctx = aio_alloc(dev, depth, engine);
+    if(ctx == NULL) {
+        return -1;
+    }
+    srand(42); // same sectors for every run
+    for(size_t i = 0; i < NB_READS; i++) {
+        reqs[i].sector = rand() % NB_SECTORS;
+    }
+    posix_fadvise(dev->fd, 0, 0, POSIX_FADV_DONTNEED); // start with a cold page cache
+
+    double start = now();
+    int error = aio_run(ctx, reqs, NB_READS);
+    double time = now() - start;
+    aio_free(ctx);
+    return error ? -1 : time * 1e9 / NB_READS;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    struct bdev *dev = bdev_open(argv[1], BDEV_PREAD, 1);
+    if(dev == NULL) {
+        fprintf(stderr, "cannot create %s\n", argv[1]);
+        return 1;
+    }
+    if(make_disk(dev)) {
+        fprintf(stderr, "cannot write %s\n", argv[1]);
+        bdev_close(dev);
+        return 1;
+    }
+
+    static uint8_t buffers[NB_READS][SECTOR_SIZE];
+    static struct aio_req reqs[NB_READS];
+    for(size_t i = 0; i < NB_READS; i++) {
+        reqs[i] = (struct aio_req) { 0, 1, buffers[i], 0, 0 };
+    }
+
+    const unsigned int depths[] = { 1, 8, 32, 128 };
+    const enum aio_engine engines[] = { AIO_URING, AIO_THREADS };
+    const char *names[] = { "io_uring", "threads" };
+
+    printf("%u sectors, %d random reads of one sector\n", NB_SECTORS, NB_READS);
+    printf("%-10s :", "depth");
+    for(size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        printf(" %8u", depths[d]);
+    }
+    printf(" (ns/sector)\n");
+    for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        printf("%-10s :", names[e]);
+        for(size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            double t = bench(dev, engines[e], depths[d], reqs);
+            if(t < 0) {
+                printf(" %8s", "n/a");
+            } else {
+                printf(" %8.1f", t);
+            }
+        }
+        printf("\n");
+    }
+    bdev_close(dev);
+    return 0;
+}
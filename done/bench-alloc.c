@@ -0,0 +1,129 @@
+/**
+ * @file bench-alloc.c
+ * @brief measures the fragmentation of files written together: several
+ *        writers append to their own file in turn, one chunk each time,
+ *        then the mean number of extents (runs of contiguous data
+ *        sectors) per file is reported
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "inode.h"
+#include "direntv6.h"
+#include "filev6.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define NB_BLOCKS 65535 // largest unix v6 disk (s_fsize is 16 bits)
+#define NB_INODES 4096
+#define FILE_SIZE (64 * 1024) // large files: indirect sectors too
+#define MAX_WRITERS 16
+#define USAGE "bench-alloc <scratch diskname>"
+
+/**
+ * @brief number of runs of contiguous data sectors of a file
+ * @return the number of extents; <0 on error
+ */
+static int extents(const struct unix_filesystem *u, uint16_t inr)
+{
+    struct inode inode;
+    int error = inode_read(u, inr, &inode);
+    if(error) {
+        return error;
+    }
+    int32_t nb = (inode_getsize(&inode) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int count = 0;
+    int previous = -1;
+    for(int32_t s = 0; s < nb; s++) {
+        int sector = inode_findsector(u, &inode, s);
+        if(sector < 0) {
+            return sector;
+        }
+        count += (sector != previous + 1);
+        previous = sector;
+    }
+    return count;
+}
+
+/**
+ * @brief context of write_files()
+ */
+struct alloc_bench {
+    int nb_writers;
+    int chunk; // bytes written per call
+    double mixed; // mean extents per file written together
+    double alone; // mean extents per file written alone
+};
+
+/**
+ * @brief callback of populate(): nb_writers files of a directory written
+ *        in turn by chunks of chunk bytes, then as many written one after
+ *        the other in a second directory
+ * @param ctx the struct alloc_bench, whose means are set (OUT)
+ * @return 0 on success; <0 on error
+ */
+static int write_files(struct unix_filesystem *u, void *ctx)
+{
+    static char content[FILE_SIZE];
+    memset(content, 'x', sizeof(content));
+    struct alloc_bench *b = ctx;
+    int nb_writers = b->nb_writers;
+    int chunk = b->chunk;
+
+    const char *dirs[] = { "/mixed", "/alone" };
+    int total[2] = { 0, 0 };
+    int error = 0;
+    for(int d = 0; !error && d < 2; d++) {
+        error = direntv6_create(u, dirs[d], IALLOC | IFDIR);
+        struct filev6 files[MAX_WRITERS];
+        for(int w = 0; !error && w < nb_writers; w++) {
+            char name[32];
+            snprintf(name, sizeof(name), "%s/%d", dirs[d], w);
+            int inr = direntv6_create(u, name, IALLOC);
+            inr = (inr < 0) ? inr : direntv6_dirlookup(u, ROOT_INUMBER, name);
+            error = (inr < 0) ? inr : filev6_open(u, inr, &(files[w]));
+            for(int off = 0; d == 1 && !error && off < FILE_SIZE; off += chunk) { // alone: the whole file now
+                error = filev6_writebytes(u, &(files[w]), content, chunk);
+            }
+        }
+        for(int off = 0; d == 0 && !error && off < FILE_SIZE; off += chunk) { // mixed: a chunk of each file in turn
+            for(int w = 0; !error && w < nb_writers; w++) {
+                error = filev6_writebytes(u, &(files[w]), content, chunk);
+            }
+        }
+        for(int w = 0; !error && w < nb_writers; w++) {
+            int e = extents(u, files[w].i_number);
+            error = (e < 0) ? e : 0;
+            total[d] += (e < 0) ? 0 : e;
+        }
+    }
+    b->mixed = (double)total[0] / nb_writers;
+    b->alone = (double)total[1] / nb_writers;
+    return error;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    const int chunks[] = { SECTOR_SIZE, 4 * SECTOR_SIZE, 16 * SECTOR_SIZE };
+    printf("files of %d bytes, %d blocks\n", FILE_SIZE, NB_BLOCKS);
+    printf("%-8s %8s : %14s %14s\n", "writers", "chunk", "extents mixed", "extents alone");
+    for(int nb_writers = 2; nb_writers <= MAX_WRITERS; nb_writers *= 2) {
+        for(size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            struct alloc_bench b = { nb_writers, chunks[c], 0, 0 };
+            if(populate(argv[1], NB_BLOCKS, NB_INODES, write_files, &b)) {
+                fprintf(stderr, "write error\n");
+                return 1;
+            }
+            printf("%-8d %8d : %14.2f %14.2f\n", nb_writers, chunks[c], b.mixed, b.alone);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file bench-bitmap.c
+ * @brief measures allocations (bm_find_next() then bm_set()) per second on
+ *        bitmaps from 1K to 16M bits, from empty, nearly full and almost full
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "bench-core.h"
+#include "bmblock.h"
+
+#define FREE_ONE_IN 1024 // nearly full: one free element in FREE_ONE_IN
+#define FREE_ONE_IN_LARGE 65536 // almost full
+
+/**
+ * @brief allocate until the bitmap is full
+ * @return the number of allocations per second, <0 on error
+ */
+static double fill(struct bmblock_array *bm, uint64_t expected)
+{
+    uint64_t count = 0;
+    double start = now();
+    int x;
+    while((x = bm_find_next(bm)) >= 0) {
+        bm_set(bm, x);
+        count++;
+    }
+    double time = now() - start;
+    return (count == expected) ? count / time : -1;
+}
+
+/**
+ * @brief free one element in one_in of a full bitmap, at a random place,
+ *        and allocate them again: bm_clear() brings the cursor back
+ * @return the number of allocations per second, <0 on error
+ */
+static double refill(struct bmblock_array *bm, uint64_t bits, uint64_t one_in)
+{
+    srand(42);
+    uint64_t nb_free = 0;
+    for(uint64_t x = 0; x + one_in <= bits; x += one_in) {
+        bm_clear(bm, x + rand() % one_in);
+        nb_free++;
+    }
+    return (nb_free > 0) ? fill(bm, nb_free) : 0;
+}
+
+int main(void)
+{
+    printf("%-10s : %14s %14s %14s (allocations/s)\n", "bits", "empty", "1/1024 free", "1/65536 free");
+    for(uint64_t bits = 1024; bits <= (UINT64_C(16) << 20); bits *= 4) {
+        struct bmblock_array *bm = bm_alloc(0, bits - 1);
+        if(bm == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        double empty = fill(bm, bits);
+
+        double full = refill(bm, bits, FREE_ONE_IN);
+        double almost = refill(bm, bits, FREE_ONE_IN_LARGE);
+        free(bm);
+        if(empty < 0 || full < 0 || almost < 0) {
+            fprintf(stderr, "wrong number of allocations\n");
+            return 1;
+        }
+        printf("%-10lu : %14.0f %14.0f %14.0f\n", (unsigned long)bits, empty, full, almost);
+    }
+    return 0;
+}
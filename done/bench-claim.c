@@ -0,0 +1,112 @@
+/**
+ * @file bench-claim.c
+ * @brief measures allocations by 1 to MAX_THREADS threads at once, each
+ *        calling inode_alloc() and taking sectors from its own goal, until
+ *        the filesystem is full: with the atomic operations of the
+ *        bitmaps, through the allocation groups, then with every
+ *        allocation under a single lock
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "inode.h"
+#include "bdev.h"
+#include "error.h"
+
+#define NB_BLOCKS 65535 // largest unix v6 disk (s_fsize is 16 bits)
+#define NB_INODES 32768
+#define MAX_THREADS 64
+
+enum mode {
+    ATOMIC,                // bm_atomic_claim_near() on the whole disk
+    GROUPS,                // mountv6_alloc_sectors(), from the group of the thread
+    LOCKED                 // bm_atomic_claim_near() under a single lock
+};
+
+struct worker {
+    struct unix_filesystem *u;
+    enum mode mode;
+    uint32_t goal; // next sector of the "file" of the thread
+    uint64_t nb; // allocations
+    pthread_t thread;
+};
+
+static void *alloc_all(void *arg)
+{
+    struct worker *w = arg;
+    for(;;) {
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        if(w->mode == LOCKED) {
+            pthread_mutex_lock(&lock);
+        }
+        int inr = inode_alloc(w->u, 0);
+        int sector = (w->mode == GROUPS) ? mountv6_alloc_sectors(w->u, 1, w->goal)
+                     : bm_atomic_claim_near((w->u)->fbm, w->goal);
+        if(w->mode == LOCKED) {
+            pthread_mutex_unlock(&lock);
+        }
+        if(inr < 0 && sector < 0) { // full
+            return NULL;
+        }
+        w->nb += (inr >= 0) + (sector >= 0);
+        if(sector >= 0 && (uint64_t)sector < ((w->u)->fbm)->max) {
+            w->goal = sector + 1;
+        }
+    }
+}
+
+/**
+ * @brief fill a new filesystem with nb_threads threads
+ * @return the allocations per second, <0 on error
+ */
+static double bench(unsigned int nb_threads, enum mode mode)
+{
+    struct bdev *dev = bdev_open(NULL, BDEV_RAM, 1);
+    struct unix_filesystem u;
+    int error = (dev != NULL) ? mountv6_mkfs_dev(dev, NB_BLOCKS, NB_INODES) : ERR_IO;
+    error = error ? error : mountv6_dev(dev, &u, NULL);
+    if(error) {
+        return -1;
+    }
+    static struct worker workers[MAX_THREADS];
+    uint64_t span = (u.fbm)->max - (u.fbm)->min + 1;
+    double start = now();
+    for(unsigned int t = 0; t < nb_threads; t++) { // the goals spread over the disk
+        uint32_t goal = (mode == GROUPS) ? mountv6_group_goal(&u, t) : (u.fbm)->min + t * span / nb_threads;
+        workers[t] = (struct worker) { &u, mode, goal, 0, 0 };
+        pthread_create(&(workers[t].thread), NULL, alloc_all, &(workers[t]));
+    }
+    uint64_t nb = 0;
+    for(unsigned int t = 0; t < nb_threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        nb += workers[t].nb;
+    }
+    double time = now() - start;
+    uint64_t expected = ((u.ibm)->max - (u.ibm)->min + 1) + span;
+    if(umountv6(&u) || nb != expected) {
+        return -1;
+    }
+    return nb / time;
+}
+
+int main(void)
+{
+    printf("%d blocks, %d inodes, %ld CPUs\n", NB_BLOCKS, NB_INODES, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s : %14s %14s %14s (allocations/s)\n", "threads", "atomic", "groups", "locked");
+    for(unsigned int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double atomic = bench(threads, ATOMIC);
+        double groups = bench(threads, GROUPS);
+        double locked = bench(threads, LOCKED);
+        if(atomic < 0 || groups < 0 || locked < 0) {
+            fprintf(stderr, "allocation error\n");
+            return 1;
+        }
+        printf("%-8u : %14.0f %14.0f %14.0f\n", threads, atomic, groups, locked);
+    }
+    return 0;
+}
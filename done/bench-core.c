@@ -0,0 +1,43 @@
+/**
+ * @file bench-core.c
+ * @brief helpers shared by the benchmarks
+ */
+
+#include <time.h>
+#include "bench-core.h"
+#include "direntv6.h"
+#include "filev6.h"
+#include "error.h"
+
+double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int populate(const char *filename, uint16_t nb_blocks, uint16_t nb_inodes, populate_fn fill, void *ctx)
+{
+    M_REQUIRE_NON_NULL(filename);
+    struct unix_filesystem u;
+    int error = mountv6_mkfs(filename, nb_blocks, nb_inodes);
+    error = error ? error : mountv6(filename, &u);
+    if(error) {
+        return error;
+    }
+    error = (fill != NULL) ? fill(&u, ctx) : 0;
+    int umountError = umountv6(&u);
+    return error ? error : umountError;
+}
+
+int create_file(struct unix_filesystem *u, const char *name, const void *content, int size)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(name);
+    struct filev6 fv6;
+    int inr = direntv6_create(u, name, IALLOC);
+    inr = (inr < 0) ? inr : direntv6_dirlookup(u, ROOT_INUMBER, name);
+    int error = (inr < 0) ? inr : filev6_open(u, inr, &fv6);
+    error = (error || size == 0) ? error : filev6_writebytes(u, &fv6, content, size);
+    return error ? error : inr;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+/**
+ * @file bench-core.h
+ * @brief helpers shared by the benchmarks: timing and creation of the
+ *        filesystems they measure
+ */
+
+#include <stdint.h>
+#include "mount.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief callback of populate(): fill the new filesystem
+ * @param u the mounted filesystem
+ * @param ctx the context given to populate()
+ * @return 0 on success; <0 on error
+ */
+typedef int (*populate_fn)(struct unix_filesystem *u, void *ctx);
+
+/**
+ * @brief the time of a monotonic clock
+ * @return the time in seconds
+ */
+double now(void);
+
+/**
+ * @brief make a new filesystem, mount it, fill it and unmount it
+ * @param filename the disk image, overwritten
+ * @param nb_blocks the size of the filesystem, in sectors
+ * @param nb_inodes the number of inodes
+ * @param fill called on the mounted filesystem; NULL to leave it empty
+ * @param ctx passed to fill
+ * @return 0 on success; <0 on error, of mkfs, mount, fill or umount
+ */
+int populate(const char *filename, uint16_t nb_blocks, uint16_t nb_inodes, populate_fn fill, void *ctx);
+
+/**
+ * @brief create a file and write size bytes of content to it
+ * @param u the filesystem
+ * @param name the absolute path of the file
+ * @param content what is written
+ * @param size the number of bytes written
+ * @return its inode number; <0 on error
+ */
+int create_file(struct unix_filesystem *u, const char *name, const void *content, int size);
+
+#ifdef __cplusplus
+}
+#endif
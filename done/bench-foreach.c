@@ -0,0 +1,130 @@
+/**
+ * @file bench-foreach.c
+ * @brief measures inode_foreach() on a large synthetic inode table (half
+ *        of the inodes allocated, directories and files of random sizes):
+ *        inodes scanned per second for several filters, then the masks of
+ *        inode_filter_mask() against inode_filter_mask_sw() alone
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "inode.h"
+#include "bdev.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define NB_BLOCKS 65535 // the largest disk: mkfs wants a sector per inode
+#define NB_INODES 61440 // 3840 sectors of inodes
+#define SCANS 20
+#define MASK_ROUNDS 50
+#define USAGE "bench-foreach <scratch diskname>"
+
+/**
+ * @brief callback of inode_foreach(): counts the inodes
+ */
+static int count_inode(uint16_t inr, const struct inode *inode, void *ctx)
+{
+    (void) inr;
+    (void) inode;
+    (*(uint64_t *)ctx)++;
+    return 0;
+}
+
+/**
+ * @brief callback of populate(): fill the inode table with random inodes,
+ *        without addresses (no sector is used); the root stays a directory
+ * @param ctx the inode table written, NB_INODES inodes (OUT)
+ * @return 0 on success; <0 on error
+ */
+static int fill_table(struct unix_filesystem *u, void *ctx)
+{
+    struct inode *table = ctx;
+    srand(1);
+    memset(table, 0, NB_INODES * sizeof(struct inode));
+    for(uint32_t i = ROOT_INUMBER + 1; i < NB_INODES; i++) {
+        if(rand() % 2) {
+            table[i].i_mode = IALLOC | ((rand() % 8 == 0) ? IFDIR : 0);
+            inode_setsize(&(table[i]), (rand() % 4 == 0) ? rand() % INODE_MAX_SIZE : rand() % 8192);
+        }
+    }
+    table[ROOT_INUMBER].i_mode = IALLOC | IFDIR;
+    return bdev_write(u->dev, u->s.s_inode_start, NB_INODES / INODES_PER_SECTOR, table);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    const uint32_t nb_sectors = NB_INODES / INODES_PER_SECTOR;
+    struct inode *table = malloc(nb_sectors * SECTOR_SIZE);
+    if(table == NULL || populate(argv[1], NB_BLOCKS, NB_INODES, fill_table, table)) {
+        fprintf(stderr, "mkfs error\n");
+        free(table);
+        return 1;
+    }
+
+    // the scans, through the buffer cache (the table is read from the disk)
+    struct mount_options opts = { .bitmaps = MOUNT_BM_LAZY };
+    struct unix_filesystem u;
+    if(mountv6_opts(argv[1], &u, &opts)) {
+        fprintf(stderr, "mount error\n");
+        free(table);
+        return 1;
+    }
+    const char *names[] = { "all", "directories", "files", "4K-896K", "> 896K" };
+    const struct inode_filter filters[] = {
+        { INODE_ANY, 0, INODE_MAX_SIZE }, { INODE_DIR, 0, INODE_MAX_SIZE }, { INODE_FILE, 0, INODE_MAX_SIZE },
+        { INODE_ANY, ADDR_SMALL_LENGTH * SECTOR_SIZE + 1, ADDR_LARGE_SECTORS * SECTOR_SIZE },
+        { INODE_FILE, ADDR_LARGE_SECTORS * SECTOR_SIZE + 1, INODE_MAX_SIZE }
+    };
+    printf("inode_foreach() on %d inodes, best of %d scans\n", NB_INODES, SCANS);
+    printf("%-12s : %10s %14s\n", "filter", "matches", "inodes/s");
+    int error = 0;
+    for(size_t f = 0; !error && f < sizeof(filters) / sizeof(filters[0]); f++) {
+        double best = 0;
+        uint64_t matches = 0;
+        for(int s = 0; !error && s < SCANS; s++) {
+            matches = 0;
+            double start = now();
+            error = inode_foreach(&u, &(filters[f]), count_inode, &matches);
+            double time = now() - start;
+            best = (best == 0 || time < best) ? time : best;
+        }
+        printf("%-12s : %10lu %14.3e\n", names[f], (unsigned long)matches, NB_INODES / best);
+    }
+    umountv6(&u);
+
+    // the masks alone, on the table in memory
+    printf("masks of %u sectors, %d times\n", nb_sectors, MASK_ROUNDS);
+    printf("%-12s : %14s %14s %8s\n", "filter", "simd inodes/s", "sw inodes/s", "speedup");
+    for(size_t f = 0; !error && f < sizeof(filters) / sizeof(filters[0]); f++) {
+        double times[2];
+        uint32_t check[2] = { 0, 0 };
+        for(int sw = 0; sw < 2; sw++) {
+            double start = now();
+            for(int r = 0; r < MASK_ROUNDS; r++) {
+                for(uint32_t s = 0; s < nb_sectors; s++) {
+                    const struct inode *sector = &(table[s * INODES_PER_SECTOR]);
+                    check[sw] += __builtin_popcount(sw ? inode_filter_mask_sw(sector, &(filters[f]))
+                                                    : inode_filter_mask(sector, &(filters[f])));
+                }
+            }
+            times[sw] = now() - start;
+        }
+        double inodes = (double)MASK_ROUNDS * nb_sectors * INODES_PER_SECTOR;
+        printf("%-12s : %14.3e %14.3e %8.2f%s\n", names[f], inodes / times[0], inodes / times[1], times[1] / times[0],
+               (check[0] == check[1]) ? "" : " MISMATCH");
+    }
+    free(table);
+    if(error) {
+        fprintf(stderr, "scan error\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * @file bench-huge.c
+ * @brief measures sequential reads of large files (512 KB) and of a huge
+ *        file (16 MB, addressed through the double-indirect sector), one
+ *        sector per filev6_readblock() as fs_read() does: 16 MB are read
+ *        from the whole large file, from a set of large files, from 512 KB
+ *        and from 8 MB of the huge file beyond its first 896 KB, and from
+ *        the whole huge file. The set and the 8 MB of the huge file have
+ *        the same working set: only the double-indirect lookup differs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "bdev.h"
+#include "direntv6.h"
+#include "filev6.h"
+#include "icache.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define NB_BLOCKS 52000
+#define NB_INODES 64
+#define SMALL_SIZE (512 * 1024)
+#define HUGE_SIZE INODE_MAX_SIZE // 16 MB - 1 byte
+#define SET_FILES 16 // large files of the set: 8 MB
+#define SET_SIZE (SET_FILES * SMALL_SIZE)
+#define NB_FILES (2 + SET_FILES) // the large file, the huge one, the set
+#define TRIES 5 // the best of them is kept
+#define WINDOW_OFFSET (4 * 1024 * 1024) // of the windows read from the huge file
+#define NB_RUNS 5
+#define USAGE "bench-huge <scratch diskname>"
+
+/**
+ * @brief callback of populate(): a large file, a huge one and the set of
+ *        large files
+ * @param ctx the inode numbers of the files (OUT)
+ * @return 0 on success; <0 on error
+ */
+static int create_files(struct unix_filesystem *u, void *ctx)
+{
+    int *inrs = ctx;
+    char *content = malloc(HUGE_SIZE);
+    if(content == NULL) {
+        return ERR_NOMEM;
+    }
+    memset(content, 'x', HUGE_SIZE);
+    int error = 0;
+    for(int f = 0; !error && f < NB_FILES; f++) {
+        char name[16];
+        snprintf(name, sizeof(name), "/set%02d", f - 2);
+        inrs[f] = create_file(u, (f == 0) ? "/large" : (f == 1) ? "/huge" : name, content,
+                              (f == 1) ? HUGE_SIZE : SMALL_SIZE);
+        error = (inrs[f] < 0) ? inrs[f] : 0;
+    }
+    free(content);
+    return error;
+}
+
+/**
+ * @brief read size bytes of the file from offset on
+ * @param bytes the number of bytes read, added to (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+static int read_file(const struct unix_filesystem *u, uint16_t inr, int32_t offset, int size, uint64_t *bytes)
+{
+    uint8_t data[SECTOR_SIZE];
+    struct filev6 fv6;
+    int error = filev6_open(u, inr, &fv6);
+    error = error ? error : filev6_lseek(&fv6, offset);
+    int read = 1;
+    for(int done = 0; !error && done < size && (read = filev6_readblock(&fv6, data)) > 0; done += read) {
+        *bytes += read;
+    }
+    return error ? error : ((read < 0) ? read : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+
+    int inrs[NB_FILES];
+    if(populate(argv[1], NB_BLOCKS, NB_INODES, create_files, inrs)) {
+        fprintf(stderr, "write error\n");
+        return 1;
+    }
+
+    struct unix_filesystem u;
+    int error = mountv6(argv[1], &u);
+    if(error) {
+        fprintf(stderr, "mount error\n");
+        return 1;
+    }
+    printf("sequential reads of %d MB, one sector per filev6_readblock(), best of %d\n", (HUGE_SIZE + 1) >> 20, TRIES);
+    printf("%-12s : %5s %10s %10s %8s %10s %10s %10s\n", "file", "files", "offset", "size", "passes", "MB/s",
+           "map loads", "map hits");
+    const char *names[NB_RUNS] = { "large", "large set", "huge window", "huge 8 MB", "huge" };
+    const int files[NB_RUNS] = { 0, 2, 1, 1, 1 };        // first file read
+    const int nbFiles[NB_RUNS] = { 1, SET_FILES, 1, 1, 1 }; // files read in turn
+    const int32_t offsets[NB_RUNS] = { 0, 0, WINDOW_OFFSET, WINDOW_OFFSET, 0 };
+    const int reads[NB_RUNS] = { SMALL_SIZE, SMALL_SIZE, SMALL_SIZE, SET_SIZE, HUGE_SIZE }; // of each file
+    double rates[NB_RUNS];
+    for(int r = 0; r < NB_RUNS; r++) {
+        int passes = (HUGE_SIZE + nbFiles[r] * reads[r] - 1) / (nbFiles[r] * reads[r]);
+        struct icache_stats before = u.icache->stats;
+        double best = 0;
+        uint64_t bytes = 0;
+        for(int t = 0; !error && t < TRIES; t++) {
+            bytes = 0;
+            double start = now();
+            for(int p = 0; !error && p < passes; p++) {
+                for(int f = 0; !error && f < nbFiles[r]; f++) {
+                    error = read_file(&u, inrs[files[r] + f], offsets[r], reads[r], &bytes);
+                }
+            }
+            double time = now() - start;
+            best = (best == 0 || time < best) ? time : best;
+        }
+        if(error) {
+            fprintf(stderr, "read error\n");
+            umountv6(&u);
+            return 1;
+        }
+        rates[r] = bytes / best / 1e6;
+        printf("%-12s : %5d %10d %10d %8d %10.1f %10lu %10lu\n", names[r], nbFiles[r], offsets[r], reads[r], passes,
+               rates[r], (unsigned long)(u.icache->stats.map_loads - before.map_loads),
+               (unsigned long)(u.icache->stats.map_hits - before.map_hits));
+    }
+    printf("huge window / large: %.1f %%, huge / large: %.1f %%\n", 100.0 * rates[2] / rates[0],
+           100.0 * rates[4] / rates[0]);
+    printf("working set (large set / large): %.1f %%, double-indirect lookup (huge 8 MB / large set): %.1f %%\n",
+           100.0 * rates[1] / rates[0], 100.0 * rates[3] / rates[1]);
+    return umountv6(&u) ? 1 : 0;
+}
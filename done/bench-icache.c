@@ -0,0 +1,133 @@
+/**
+ * @file bench-icache.c
+ * @brief measures the inode cache on the requests of "ls -lR" through
+ *        fs.c: a getattr (path lookup from the root, then inode_read())
+ *        of every file and directory and a readdir of every directory,
+ *        with inode caches of several sizes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "inode.h"
+#include "direntv6.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define NB_BLOCKS 8192
+#define NB_INODES 2048
+#define NB_DIRS 8 // directories of the root
+#define NB_SUBDIRS 4 // directories of each of them
+#define NB_FILES 30 // files of each subdirectory
+#define MAX_NAMES 64 // entries of a directory
+#define WALKS 10
+#define USAGE "bench-icache <scratch diskname>"
+
+/**
+ * @brief callback of populate(): the tree of directories and empty files
+ * @return 0 on success; <0 on error
+ */
+static int create_tree(struct unix_filesystem *u, void *ctx)
+{
+    (void) ctx;
+    int error = 0;
+    for(int d = 0; !error && d < NB_DIRS; d++) {
+        char name[64];
+        snprintf(name, sizeof(name), "/d%d", d);
+        int inr = direntv6_create(u, name, IALLOC | IFDIR);
+        for(int s = 0; inr >= 0 && s < NB_SUBDIRS; s++) {
+            snprintf(name, sizeof(name), "/d%d/s%d", d, s);
+            inr = direntv6_create(u, name, IALLOC | IFDIR);
+            for(int f = 0; inr >= 0 && f < NB_FILES; f++) {
+                snprintf(name, sizeof(name), "/d%d/s%d/f%d", d, s, f);
+                inr = direntv6_create(u, name, IALLOC);
+            }
+        }
+        error = (inr < 0) ? inr : 0;
+    }
+    return error;
+}
+
+/**
+ * @brief what fs_getattr() and fs_readdir() do for a path, recursively
+ * @return 0 on success; <0 on error
+ */
+static int walk(const struct unix_filesystem *u, const char *path)
+{
+    // getattr
+    int inr = direntv6_dirlookup(u, ROOT_INUMBER, path);
+    struct inode i;
+    int error = (inr < 0) ? inr : inode_read(u, inr, &i);
+    if(error || !(i.i_mode & IFDIR)) {
+        return error;
+    }
+
+    // readdir
+    inr = direntv6_dirlookup(u, ROOT_INUMBER, path);
+    struct directory_reader d;
+    error = (inr < 0) ? inr : direntv6_opendir(u, inr, &d);
+    char children[MAX_NAMES][DIRENT_MAXLEN + 1];
+    int nb = 0;
+    uint16_t child;
+    int read = 1;
+    while(!error && nb < MAX_NAMES && (read = direntv6_readdir(&d, children[nb], &child)) == 1) {
+        nb++;
+    }
+    error = error ? error : ((read < 0) ? read : 0);
+
+    // then the children
+    for(int c = 0; !error && c < nb; c++) {
+        char childPath[256];
+        snprintf(childPath, sizeof(childPath), "%s/%s", strcmp(path, "/") ? path : "", children[c]);
+        error = walk(u, childPath);
+    }
+    return error;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    if(populate(argv[1], NB_BLOCKS, NB_INODES, create_tree, NULL)) {
+        fprintf(stderr, "write error\n");
+        return 1;
+    }
+
+    printf("ls -lR of %d files in %d directories, %d times\n", NB_DIRS * NB_SUBDIRS * NB_FILES,
+           1 + NB_DIRS + NB_DIRS * NB_SUBDIRS, WALKS);
+    printf("%-8s : %12s %10s %8s %10s %14s %14s %10s\n", "inodes", "inode reads", "hits", "hit %", "prefills",
+           "sector reads", "reads saved", "walk us");
+    const size_t sizes[] = { 1, 16, 64, 256, 2048 };
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        struct mount_options opts = { .backend = BDEV_PREAD, .icache_size = sizes[s], .bitmaps = MOUNT_BM_LAZY };
+        struct unix_filesystem u;
+        if(mountv6_opts(argv[1], &u, &opts)) {
+            fprintf(stderr, "mount error\n");
+            return 1;
+        }
+        struct bcache_stats before = u.cache->stats; // the superblock
+        int error = 0;
+        double start = now();
+        for(int w = 0; !error && w < WALKS; w++) {
+            error = walk(&u, "/");
+        }
+        double time = (now() - start) / WALKS;
+        struct icache_stats is = u.icache->stats;
+        uint64_t sectors = u.cache->stats.hits + u.cache->stats.misses - before.hits - before.misses;
+        if(umountv6(&u) || error) {
+            fprintf(stderr, "walk error\n");
+            return 1;
+        }
+        uint64_t lookups = is.hits + is.misses;
+        // every hit is an inode-table sector that inode_read() did not read
+        printf("%-8zu : %12lu %10lu %8.1f %10lu %14lu %14lu %10.1f\n", sizes[s], (unsigned long)lookups,
+               (unsigned long)is.hits, 100.0 * is.hits / lookups, (unsigned long)is.prefills,
+               (unsigned long)sectors, (unsigned long)is.hits, time * 1e6);
+    }
+    return 0;
+}
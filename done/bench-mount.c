@@ -0,0 +1,139 @@
+/**
+ * @file bench-mount.c
+ * @brief measures mountv6() of a filesystem full of files, with the
+ *        bitmaps read from the disk, rebuilt from the inodes by 1 to
+ *        MAX_THREADS threads, or left to the first allocation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "bdev.h"
+#include "direntv6.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define NB_BLOCKS 65535 // largest unix v6 disk (s_fsize is 16 bits)
+#define NB_INODES 32768
+#define NB_FILES 2000
+#define FILE_SIZE 12000 // large files: indirect sectors to walk
+#define MOUNTS 10
+#define MAX_THREADS 8
+#define USAGE "bench-mount <scratch diskname>"
+
+/**
+ * @brief callback of populate(): NB_FILES files in a directory
+ * @return 0 on success; <0 on error
+ */
+static int create_files(struct unix_filesystem *u, void *ctx)
+{
+    (void) ctx;
+    static char content[FILE_SIZE];
+    memset(content, 'x', sizeof(content));
+    int error = direntv6_create(u, "/d", IALLOC | IFDIR);
+    error = (error < 0) ? error : 0;
+    for(int f = 0; !error && f < NB_FILES; f++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/d/%d", f);
+        int inr = create_file(u, name, content, sizeof(content));
+        error = (inr < 0) ? inr : 0;
+    }
+    return error;
+}
+
+/**
+ * @brief set or clear the flag of valid on-disk bitmaps, behind the filesystem
+ * @return 0 on success; <0 on error
+ */
+static int set_clean(const char *filename, int clean)
+{
+    struct bdev *dev = bdev_open(filename, BDEV_PREAD, 0);
+    struct superblock s;
+    int error = (dev != NULL) ? bdev_read(dev, SUPERBLOCK_SECTOR, 1, &s) : ERR_IO;
+    s.s_fmod = clean ? MOUNT_BM_CLEAN : 0;
+    error = error ? error : bdev_write(dev, SUPERBLOCK_SECTOR, 1, &s);
+    if(dev != NULL && bdev_close(dev)) {
+        error = ERR_IO;
+    }
+    return error;
+}
+
+/**
+ * @brief mount and umount MOUNTS times; the bitmaps of the last mount are
+ *        stored in words (built after the mount if it left them to the
+ *        first allocation), what its scan read in scan
+ * @return the mean time of a mount in seconds, <0 on error
+ */
+static double bench(const char *filename, unsigned int threads, enum mount_bitmaps when, uint64_t *reads,
+                    struct mount_scan *scan, uint64_t *words, size_t nb_words)
+{
+    // synchronous reads: every read reaches the disk through bdev_read() and is counted
+    struct mount_options opts = { .backend = BDEV_PREAD, .aio_depth = 1, .scan_threads = threads, .bitmaps = when };
+    double time = 0;
+    for(int m = 0; m < MOUNTS; m++) {
+        struct unix_filesystem u;
+        double start = now();
+        if(mountv6_opts(filename, &u, &opts)) {
+            return -1;
+        }
+        time += now() - start;
+        *reads = u.dev->stats.sectors_read;
+        int error = mountv6_bitmaps(&u);
+        *scan = u.scan;
+        error = error ? error : bm_store(u.fbm, words, nb_words);
+        error = error ? error : bm_store(u.ibm, &(words[nb_words / 2]), nb_words / 2);
+        if(umountv6(&u) || error) {
+            return -1;
+        }
+    }
+    return time / MOUNTS;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    if(populate(argv[1], NB_BLOCKS, NB_INODES, create_files, NULL)) {
+        fprintf(stderr, "write error\n");
+        return 1;
+    }
+
+    static uint64_t loaded[2 * NB_BLOCKS / 64 + 2]; // fbm then ibm, as on the disk
+    static uint64_t rebuilt[2 * NB_BLOCKS / 64 + 2];
+    const size_t nb_words = sizeof(loaded) / sizeof(loaded[0]);
+    uint64_t reads = 0;
+    struct mount_scan scan;
+    double t = set_clean(argv[1], 1) ? -1 : bench(argv[1], 1, MOUNT_BM_EAGER, &reads, &scan, loaded, nb_words);
+    if(t < 0 || set_clean(argv[1], 0)) {
+        fprintf(stderr, "mount error\n");
+        return 1;
+    }
+
+    printf("%d files of %d bytes, %d blocks, %d inodes\n", NB_FILES, FILE_SIZE, NB_BLOCKS, NB_INODES);
+    printf("%-10s : %8s %10s %14s %10s %10s\n", "bitmaps", "threads", "mount ms", "sectors read", "scan ms", "same");
+    printf("%-10s : %8s %10.2f %14lu %10s %10s\n", "on disk", "-", t * 1e3, (unsigned long)reads, "-", "-");
+    for(unsigned int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        t = bench(argv[1], threads, MOUNT_BM_EAGER, &reads, &scan, rebuilt, nb_words);
+        if(t < 0) {
+            fprintf(stderr, "mount error\n");
+            return 1;
+        }
+        printf("%-10s : %8u %10.2f %14lu %10.2f %10d\n", "rebuilt", scan.threads, t * 1e3, (unsigned long)reads,
+               scan.seconds * 1e3, memcmp(loaded, rebuilt, sizeof(loaded)) == 0);
+    }
+    t = bench(argv[1], 1, MOUNT_BM_LAZY, &reads, &scan, rebuilt, nb_words);
+    if(t < 0) {
+        fprintf(stderr, "mount error\n");
+        return 1;
+    }
+    printf("%-10s : %8s %10.2f %14lu %10s %10d\n", "lazy", "-", t * 1e3, (unsigned long)reads, "-",
+           memcmp(loaded, rebuilt, sizeof(loaded)) == 0);
+    printf("scan: %u inode sectors, %u indirect sectors in %u reads\n", scan.inode_sectors, scan.indirect_sectors,
+           scan.indirect_reads);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file bench-sector.c
+ * @brief measures the cost of reading one sector of a disk with each
+ *        block device backend, with and without CRC32C verification
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench-core.h"
+#include "bdev.h"
+#include "csum.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define PASSES 200
+#define USAGE "bench-sector <diskname>"
+
+/**
+ * @brief read every sector of the disk PASSES times, in the given order
+ * @return the mean time per sector in nanoseconds, <0 on error
+ */
+static double bench(struct bdev *dev, const uint32_t *order, uint32_t nb_sectors)
+{
+    uint8_t data[SECTOR_SIZE];
+    double start = now();
+    for(int p = 0; p < PASSES; p++) {
+        for(uint32_t s = 0; s < nb_sectors; s++) {
+            if(bdev_read(dev, order[s], 1, data)) {
+                return -1;
+            }
+        }
+    }
+    return (now() - start) * 1e9 / ((double)PASSES * nb_sectors);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    struct bdev *probe = bdev_open(argv[1], BDEV_PREAD, 0);
+    if(probe == NULL) {
+        fprintf(stderr, "cannot open %s\n", argv[1]);
+        return 1;
+    }
+    uint32_t nb_sectors = bdev_size(probe);
+    bdev_close(probe);
+
+    uint32_t sequential[nb_sectors]; // sectors in disk order
+    uint32_t shuffled[nb_sectors]; // same sectors, random order
+    for(uint32_t s = 0; s < nb_sectors; s++) {
+        sequential[s] = s;
+        shuffled[s] = s;
+    }
+    srand(42);
+    for(uint32_t s = nb_sectors - 1; s > 0; s--) { // Fisher-Yates shuffle
+        uint32_t r = rand() % (s + 1);
+        uint32_t tmp = shuffled[s];
+        shuffled[s] = shuffled[r];
+        shuffled[r] = tmp;
+    }
+
+    uint8_t sector[SECTOR_SIZE];
+    memset(sector, 0xa5, sizeof(sector));
+    uint32_t crc = 0;
+    double start = now();
+    for(int i = 0; i < PASSES * 1000; i++) {
+        crc = csum_crc32c(crc, sector, sizeof(sector));
+    }
+    double crc_time = (now() - start) * 1e9 / (PASSES * 1000.0);
+    printf("crc32c (%s): %.1f ns/sector (%08x)\n", csum_impl(), crc_time, crc);
+
+    char sidecar[FILENAME_MAX]; // checksums of the disk, removed at the end
+    snprintf(sidecar, sizeof(sidecar), "%s.bench.crc", argv[1]);
+    const struct {
+        enum bdev_type type;
+        int checksums;
+    } devs[] = {
+        { BDEV_STDIO, 0 }, { BDEV_PREAD, 0 }, { BDEV_PREAD, 1 },
+        { BDEV_MMAP, 0 }, { BDEV_MMAP, 1 }, { BDEV_RAM, 0 }
+    };
+    printf("%u sectors x %d passes\n", nb_sectors, PASSES);
+    printf("%-22s : %8s %8s (ns/sector)\n", "", "seq", "random");
+    for(size_t t = 0; t < sizeof(devs) / sizeof(devs[0]); t++) {
+        struct bdev *dev = bdev_open(argv[1], devs[t].type, 0);
+        char name[32];
+        snprintf(name, sizeof(name), devs[t].checksums ? "%s + crc32c" : "%s", bdev_name(dev));
+        if(dev != NULL && devs[t].checksums) {
+            struct bdev *csum = csum_open(dev, sidecar, 1);
+            if(csum == NULL) {
+                bdev_close(dev);
+            }
+            dev = csum;
+        }
+        if(dev == NULL) {
+            fprintf(stderr, "cannot open %s\n", argv[1]);
+            return 1;
+        }
+        double seq = bench(dev, sequential, nb_sectors);
+        double rnd = bench(dev, shuffled, nb_sectors);
+        printf("%-22s : %8.1f %8.1f\n", name, seq, rnd);
+        bdev_close(dev);
+        unlink(sidecar);
+        if(seq < 0 || rnd < 0) {
+            fprintf(stderr, "read error\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+/**
+ * @file bench-writeback.c
+ * @brief measures the write amplification of small appends to many files,
+ *        with write-back on every call, by the background flusher or only
+ *        at umount
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "bdev.h"
+#include "bcache.h"
+#include "direntv6.h"
+#include "filev6.h"
+#include "inode.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define NB_FILES 40
+#define NB_APPENDS 50 // appends per file, round robin over the files
+#define APPEND_SIZE 100
+#define USAGE "bench-writeback <scratch diskname>"
+
+/**
+ * @brief create NB_FILES files and append to them; if sync is set, the
+ *        caches are written back after every call, as a write-through
+ *        layer would do
+ * @return the elapsed time in seconds, <0 on error
+ */
+static double bench(const char *filename, const struct mount_options *opts, int sync,
+                    struct bdev_stats *stats)
+{
+    int error = mountv6_mkfs(filename, 4000, 64);
+    struct unix_filesystem u;
+    error = error ? error : mountv6_opts(filename, &u, opts);
+    if(error) {
+        return -1;
+    }
+    u.dev->stats = (struct bdev_stats) { 0, 0, 0, 0 };
+
+    static char content[APPEND_SIZE];
+    for(size_t i = 0; i < sizeof(content); i++) {
+        content[i] = 'a' + i % 26;
+    }
+    double start = now();
+    error = direntv6_create(&u, "/dir", IALLOC | IFDIR);
+    error = (error < 0) ? error : 0;
+    struct filev6 files[NB_FILES];
+    for(int f = 0; !error && f < NB_FILES; f++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/dir/f%d", f);
+        int inr = direntv6_create(&u, name, IALLOC);
+        inr = (inr < 0) ? inr : direntv6_dirlookup(&u, ROOT_INUMBER, name);
+        error = (inr < 0) ? inr : filev6_open(&u, inr, &files[f]);
+        if(!error && sync) {
+            error = mountv6_sync(&u);
+        }
+    }
+    for(int a = 0; !error && a < NB_APPENDS; a++) {
+        for(int f = 0; !error && f < NB_FILES; f++) {
+            error = filev6_writebytes(&u, &files[f], content, sizeof(content));
+            if(!error && sync) {
+                error = mountv6_sync(&u);
+            }
+        }
+    }
+    error = error ? error : mountv6_sync(&u);
+    double time = now() - start;
+    *stats = u.dev->stats;
+    error = umountv6(&u) ? ERR_IO : error;
+    return error ? -1 : time;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    const double user = (double)NB_FILES * NB_APPENDS * APPEND_SIZE;
+    const struct {
+        const char *name;
+        int sync;
+        int flush_age_ms;
+    } modes[] = {
+        { "every call", 1, -1 },
+        { "flusher 1ms", 0, 1 },
+        { "flusher 1s", 0, 0 },
+        { "umount", 0, -1 },
+    };
+
+    printf("%d files, %d appends of %d bytes each, %.0f user bytes\n",
+           NB_FILES, NB_APPENDS, APPEND_SIZE, user);
+    printf("%-12s : %10s %10s %12s %12s\n", "write-back", "ms", "write I/Os", "sectors", "bytes/byte");
+    for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        struct mount_options opts = { .backend = BDEV_PREAD, .flush_age_ms = modes[m].flush_age_ms };
+        struct bdev_stats stats;
+        double t = bench(argv[1], &opts, modes[m].sync, &stats);
+        if(t < 0) {
+            fprintf(stderr, "write error\n");
+            return 1;
+        }
+        printf("%-12s : %10.1f %10lu %12lu %12.2f\n", modes[m].name, t * 1e3,
+               (unsigned long)stats.writes, (unsigned long)stats.sectors_written,
+               stats.sectors_written * SECTOR_SIZE / user);
+    }
+    return 0;
+}
@@ -1,10 +1,28 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "inode.h"
 #include "error.h"
 #include "bmblock.h"
 
+#define BM_FULL UINT64_C(-1) // a 64 bits bloc with all elements used
+
+/**
+ * @brief set the first n bits of the n/64 rounded up blocs of level,
+ *        clear the others
+ */
+static void bm_fill_level(uint64_t *level, size_t n)
+{
+    size_t nb = n/BITS_PER_VECTOR + (n % BITS_PER_VECTOR == 0 ? 0 : 1);
+    for(size_t i = 0; i < nb; i++) {
+        level[i] = BM_FULL;
+    }
+    if(n % BITS_PER_VECTOR != 0) {
+        level[nb-1] = ~(BM_FULL << (n % BITS_PER_VECTOR)); // blocs beyond the level below
+    }
+}
+
 struct bmblock_array *bm_alloc(uint64_t min, uint64_t max)
 {
     if(min > max) {
@@ -14,13 +32,35 @@ struct bmblock_array *bm_alloc(uint64_t min, uint64_t max)
     size_t nb = length/BITS_PER_VECTOR + (length % BITS_PER_VECTOR == 0 ? 0 : 1); // number of uint64_t to allocate to cover all elements
     const size_t N_MAX = (SIZE_MAX - sizeof(struct bmblock_array)) / sizeof(uint64_t) +1; // max number of uint64_t to allocate
 
-    if(nb <= N_MAX) {
-        struct bmblock_array *a = malloc(sizeof(struct bmblock_array) + (nb-1)*sizeof(uint64_t) );
+    // summary levels, until one holds in a single bloc
+    size_t summary_length[BM_MAX_LEVELS];
+    size_t nb_levels = 0;
+    size_t total = nb;
+    size_t below = nb; // blocs of the level below
+    do {
+        summary_length[nb_levels] = below/BITS_PER_VECTOR + (below % BITS_PER_VECTOR == 0 ? 0 : 1);
+        below = summary_length[nb_levels++];
+        total += below;
+    } while(below > 1);
+
+    if(total <= N_MAX) {
+        struct bmblock_array *a = malloc(sizeof(struct bmblock_array) + (total-1)*sizeof(uint64_t) );
         if(a != NULL) {
             a->length = nb;
             a->cursor = UINT64_C(0);
             a->min = min;
             a->max = max;
+            a->nb_levels = nb_levels;
+            memset(a->bm, 0, nb*sizeof(uint64_t)); // all elements unused
+            below = nb;
+            uint64_t *level = &(a->bm[nb]);
+            for(size_t k = 0; k < nb_levels; k++) {
+                a->summary_length[k] = summary_length[k];
+                a->summary[k] = level;
+                bm_fill_level(level, below); // every bloc below has a free element
+                below = summary_length[k];
+                level += below;
+            }
             return a;
         }
     }
@@ -28,6 +68,147 @@ struct bmblock_array *bm_alloc(uint64_t min, uint64_t max)
     return NULL;
 }
 
+/**
+ * @brief read a 64 bits bloc of the elements or of a summary level; the
+ *        searches may run while bm_atomic_*() change the blocs
+ */
+static uint64_t bm_word(const uint64_t *word)
+{
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief the bits of bloc index beyond max (only the last bloc has some)
+ */
+static uint64_t bm_tail(const struct bmblock_array *bmblock_array, size_t index)
+{
+    if(index == bmblock_array->length - 1) { // last bloc
+        uint64_t used = (bmblock_array->max - bmblock_array->min + 1) % BITS_PER_VECTOR; // elements in the last bloc
+        if(used != 0) {
+            return BM_FULL << used; // elements beyond max
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief the 64 bits bloc index of bmblock_array, with the bits beyond
+ *        max set so that they are never found free
+ */
+static uint64_t bm_bloc(const struct bmblock_array *bmblock_array, size_t index)
+{
+    return bm_word(&(bmblock_array->bm[index])) | bm_tail(bmblock_array, index);
+}
+
+/**
+ * @brief bloc index of bm became full: clear its bit in the summary, and
+ *        in the levels above as long as a summary bloc becomes 0
+ */
+static void bm_summary_clear(struct bmblock_array *bmblock_array, size_t index)
+{
+    for(size_t k = 0; k < bmblock_array->nb_levels; k++) {
+        uint64_t *bits = &(bmblock_array->summary[k][index / BITS_PER_VECTOR]);
+        *bits &= ~(UINT64_C(1) << (index % BITS_PER_VECTOR));
+        if(*bits != 0) { // the levels above do not change
+            return;
+        }
+        index /= BITS_PER_VECTOR;
+    }
+}
+
+/**
+ * @brief bloc index has a free element: set its bit in the summary, and
+ *        in the levels above until one is already set
+ */
+static void bm_summary_set(struct bmblock_array *bmblock_array, size_t index)
+{
+    for(size_t k = 0; k < bmblock_array->nb_levels; k++) {
+        uint64_t *bits = &(bmblock_array->summary[k][index / BITS_PER_VECTOR]);
+        uint64_t bit = UINT64_C(1) << (index % BITS_PER_VECTOR);
+        if(*bits & bit) { // the levels above are already set
+            return;
+        }
+        *bits |= bit;
+        index /= BITS_PER_VECTOR;
+    }
+}
+
+/**
+ * @brief index of the first 64 bits bloc with a free element, from bloc
+ *        first: up the summary levels until a set bit is found at or
+ *        after the position of first, then down to the bloc
+ * @return the index of the bloc, length if all are full
+ */
+static size_t bm_next_bloc(const struct bmblock_array *bmblock_array, size_t first)
+{
+    size_t i = first; // bit index in the current level
+    size_t k = 0;
+search:
+    for(;;) {
+        if(k == bmblock_array->nb_levels || i / BITS_PER_VECTOR >= bmblock_array->summary_length[k]) {
+            return bmblock_array->length; // nothing after first
+        }
+        size_t w = i / BITS_PER_VECTOR;
+        uint64_t bits = bm_word(&(bmblock_array->summary[k][w])) & (BM_FULL << (i % BITS_PER_VECTOR)); // from i on
+        if(bits != 0) {
+            i = w * BITS_PER_VECTOR + __builtin_ctzll(bits);
+            break;
+        }
+        i = w + 1; // the next bloc of level k is the next bit of level k+1
+        k++;
+    }
+    while(k > 0) { // the first set bit of each bloc, down to level 0
+        k--;
+        uint64_t bits = bm_word(&(bmblock_array->summary[k][i]));
+        if(bits == 0) { // emptied by bm_atomic_*() since the level above was read
+            i = first;
+            k = 0;
+            goto search;
+        }
+        i = i * BITS_PER_VECTOR + __builtin_ctzll(bits);
+    }
+    return i;
+}
+
+/**
+ * @brief index of the last bloc at or before last with a free element,
+ *        walking up the summary levels, then down the last set bits
+ * @return the index of the bloc, length if there is none
+ */
+static size_t bm_prev_bloc(const struct bmblock_array *bmblock_array, size_t last)
+{
+    size_t i = last; // bit index in the current level
+    size_t k = 0;
+search:
+    for(;;) {
+        if(k == bmblock_array->nb_levels) {
+            return bmblock_array->length; // nothing before last
+        }
+        size_t w = i / BITS_PER_VECTOR;
+        uint64_t bits = bm_word(&(bmblock_array->summary[k][w])) & (BM_FULL >> (BITS_PER_VECTOR - 1 - i % BITS_PER_VECTOR)); // up to i
+        if(bits != 0) {
+            i = w * BITS_PER_VECTOR + BITS_PER_VECTOR - 1 - __builtin_clzll(bits);
+            break;
+        }
+        if(w == 0) {
+            return bmblock_array->length; // nothing before last
+        }
+        i = w - 1; // the previous bloc of level k is the previous bit of level k+1
+        k++;
+    }
+    while(k > 0) { // the last set bit of each bloc, down to level 0
+        k--;
+        uint64_t bits = bm_word(&(bmblock_array->summary[k][i]));
+        if(bits == 0) { // emptied by bm_atomic_*() since the level above was read
+            i = last;
+            k = 0;
+            goto search;
+        }
+        i = i * BITS_PER_VECTOR + BITS_PER_VECTOR - 1 - __builtin_clzll(bits);
+    }
+    return i;
+}
+
 int bm_get(struct bmblock_array *bmblock_array, uint64_t x)
 {
     M_REQUIRE_NON_NULL(bmblock_array);
@@ -37,7 +218,7 @@ int bm_get(struct bmblock_array *bmblock_array, uint64_t x)
     }
 
     size_t index = (x - bmblock_array->min) / BITS_PER_VECTOR; // index of uint64_t of x whithin bm
-    uint64_t bits = bmblock_array->bm[index]; // bits where bit x is contained
+    uint64_t bits = bm_word(&(bmblock_array->bm[index])); // bits where bit x is contained
     size_t position = (x - bmblock_array->min) % BITS_PER_VECTOR; // position of x whitin bits
     int bit = ((UINT64_C(1) << position) & bits) >> position; // extract the bit
 
@@ -53,6 +234,9 @@ void bm_set(struct bmblock_array *bmblock_array, uint64_t x)
             size_t position = (x - bmblock_array->min) % BITS_PER_VECTOR; // position of x whitin bits
             bits |= (UINT64_C(1) << position); // set the bit with an OR
             bmblock_array->bm[index] = bits; // save
+            if(bm_bloc(bmblock_array, index) == BM_FULL) { // last free element of the bloc
+                bm_summary_clear(bmblock_array, index);
+            }
         }
     }
 }
@@ -66,36 +250,571 @@ void bm_clear(struct bmblock_array *bmblock_array, uint64_t x)
             size_t position = (x - bmblock_array->min) % BITS_PER_VECTOR; // position of x whitin bits
             bits &= ~(UINT64_C(1) << position); // clear the bit with an AND
             bmblock_array->bm[index] = bits; // save
+            bm_summary_set(bmblock_array, index);
+            if(index < bmblock_array->cursor) { // free element behind the cursor
+                bmblock_array->cursor = index;
+            }
         }
     }
 }
 
-int bm_find_next(struct bmblock_array *bmblock_array)
+/**
+ * @brief mask of the count bits from position in a 64 bits bloc
+ */
+static uint64_t bm_mask(uint64_t position, uint64_t count)
 {
-    M_REQUIRE_NON_NULL(bmblock_array);
+    return ((count == BITS_PER_VECTOR) ? BM_FULL : (UINT64_C(1) << count) - 1) << position;
+}
 
-    uint64_t bits = UINT64_C(-1);
+void bm_set_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n)
+{
+    if(bmblock_array != NULL && n > 0) {
+        if(x >= bmblock_array->min && x <= bmblock_array->max && n - 1 <= bmblock_array->max - x) { // values are in range
+            uint64_t first = x - bmblock_array->min; // offset of x
+            uint64_t end = first + n;
+            while(first < end) { // one 64 bits bloc at a time
+                size_t index = first / BITS_PER_VECTOR;
+                uint64_t position = first % BITS_PER_VECTOR;
+                uint64_t count = (end - first < BITS_PER_VECTOR - position) ? end - first : BITS_PER_VECTOR - position;
+                bmblock_array->bm[index] |= bm_mask(position, count); // set the bits with an OR
+                if(bm_bloc(bmblock_array, index) == BM_FULL) { // last free elements of the bloc
+                    bm_summary_clear(bmblock_array, index);
+                }
+                first += count;
+            }
+        }
+    }
+}
 
-    while(bits == UINT64_C(-1) && bmblock_array->cursor < bmblock_array->length) { // loop while 64 bits bloc not found
-        bits = bmblock_array->bm[bmblock_array->cursor]; // read bits pointed by cursor
-        if(bits == UINT64_C(-1)) { // bits are all ones
-            bmblock_array->cursor += 1; // next 64 bits bloc
+void bm_clear_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n)
+{
+    if(bmblock_array != NULL && n > 0) {
+        if(x >= bmblock_array->min && x <= bmblock_array->max && n - 1 <= bmblock_array->max - x) { // values are in range
+            uint64_t first = x - bmblock_array->min; // offset of x
+            uint64_t end = first + n;
+            if(first / BITS_PER_VECTOR < bmblock_array->cursor) { // free elements behind the cursor
+                bmblock_array->cursor = first / BITS_PER_VECTOR;
+            }
+            while(first < end) { // one 64 bits bloc at a time
+                size_t index = first / BITS_PER_VECTOR;
+                uint64_t position = first % BITS_PER_VECTOR;
+                uint64_t count = (end - first < BITS_PER_VECTOR - position) ? end - first : BITS_PER_VECTOR - position;
+                bmblock_array->bm[index] &= ~bm_mask(position, count); // clear the bits with an AND
+                bm_summary_set(bmblock_array, index);
+                first += count;
+            }
         }
     }
+}
 
+/**
+ * @brief offset (from min) of the first unused element at or after offset
+ * @return the offset of the element, the number of elements if there is none
+ */
+static uint64_t bm_free_from(const struct bmblock_array *bmblock_array, uint64_t offset)
+{
+    uint64_t nb = bmblock_array->max - bmblock_array->min + 1; // number of elements
+    size_t index = offset / BITS_PER_VECTOR;
+    if(offset >= nb) {
+        return nb;
+    }
+    uint64_t bits = bm_bloc(bmblock_array, index) | ~bm_mask(offset % BITS_PER_VECTOR, BITS_PER_VECTOR - offset % BITS_PER_VECTOR); // elements before offset seen as used
+    while(bits == BM_FULL) { // nothing free in the rest of the bloc (or filled since the summary was read)
+        index = bm_next_bloc(bmblock_array, index + 1);
+        if(index == bmblock_array->length) {
+            return nb;
+        }
+        bits = bm_bloc(bmblock_array, index);
+    }
+    return index * BITS_PER_VECTOR + __builtin_ctzll(~bits);
+}
+
+/**
+ * @brief offset (from min) of the last free element at or before offset
+ * @return the offset of the element, the number of elements if there is none
+ */
+static uint64_t bm_free_before(const struct bmblock_array *bmblock_array, uint64_t offset)
+{
+    uint64_t nb = bmblock_array->max - bmblock_array->min + 1; // number of elements
+    size_t index = offset / BITS_PER_VECTOR;
+    uint64_t bits = bm_bloc(bmblock_array, index) | ~bm_mask(0, offset % BITS_PER_VECTOR + 1); // elements after offset seen as used
+    while(bits == BM_FULL) { // nothing free in the start of the bloc (or filled since the summary was read)
+        index = (index == 0) ? bmblock_array->length : bm_prev_bloc(bmblock_array, index - 1);
+        if(index == bmblock_array->length) {
+            return nb;
+        }
+        bits = bm_bloc(bmblock_array, index);
+    }
+    return index * BITS_PER_VECTOR + BITS_PER_VECTOR - 1 - __builtin_clzll(~bits);
+}
+
+/**
+ * @brief offset (from min) of the first used element at or after offset,
+ *        looking no further than end
+ * @return the offset of the element, end if there is none before it
+ */
+static uint64_t bm_used_from(const struct bmblock_array *bmblock_array, uint64_t offset, uint64_t end)
+{
+    size_t index = offset / BITS_PER_VECTOR;
+    uint64_t bits = bm_bloc(bmblock_array, index) & bm_mask(offset % BITS_PER_VECTOR, BITS_PER_VECTOR - offset % BITS_PER_VECTOR);
+    while(bits == 0 && (index + 1) * BITS_PER_VECTOR < end) { // whole free blocs
+        index++;
+        bits = bm_bloc(bmblock_array, index);
+    }
+    uint64_t used = (bits == 0) ? end : index * BITS_PER_VECTOR + __builtin_ctzll(bits);
+    return (used < end) ? used : end;
+}
+
+/**
+ * @brief offset (from min) of the first run of n free elements from
+ *        offset start, that ends before offset end
+ * @return the offset of the run, end if there is none
+ */
+static uint64_t bm_run_between(const struct bmblock_array *bmblock_array, uint64_t n, uint64_t start, uint64_t end)
+{
+    for(;;) {
+        start = bm_free_from(bmblock_array, start); // candidate start of the run
+        if(start >= end || n > end - start) { // no room for the run after start
+            return end;
+        }
+        uint64_t used = bm_used_from(bmblock_array, start, start + n); // end of the free run, up to n
+        if(used == start + n) {
+            return start;
+        }
+        start = used; // used element: the run starts after it
+    }
+}
+
+int bm_find_next(struct bmblock_array *bmblock_array)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    bmblock_array->cursor = bm_next_bloc(bmblock_array, bmblock_array->cursor); // first 64 bits bloc with a zero
     if(bmblock_array->cursor == bmblock_array->length) { // no free element (all ones)
         return ERR_BITMAP_FULL;
     }
-    uint64_t x = bmblock_array->cursor * BITS_PER_VECTOR + bmblock_array->min; // first element in the found bloc of 64 bits
-    int bit = bm_get(bmblock_array, x); // get corresponding bit
-    while(bit != 0) { // if not unallocated
-        if(bit < 0) { // if not in range [min;max]
-            return ERR_BITMAP_FULL; // then bitmap is full
+    return bmblock_array->cursor * BITS_PER_VECTOR + bmblock_array->min
+           + __builtin_ctzll(~bm_bloc(bmblock_array, bmblock_array->cursor)); // first zero of the bloc
+}
+
+int bm_find_next_from(struct bmblock_array *bmblock_array, uint64_t hint)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    if(hint > bmblock_array->max || hint < bmblock_array->min) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    uint64_t nb = bmblock_array->max - bmblock_array->min + 1; // number of elements
+    uint64_t offset = bm_free_from(bmblock_array, hint - bmblock_array->min);
+    if(offset == nb) { // wrap to the first free element
+        offset = bm_free_from(bmblock_array, bm_word(&(bmblock_array->cursor)) * BITS_PER_VECTOR);
+    }
+    return (offset == nb) ? ERR_BITMAP_FULL : (int)(offset + bmblock_array->min);
+}
+
+int bm_find_near(struct bmblock_array *bmblock_array, uint64_t goal)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    if(goal > bmblock_array->max || goal < bmblock_array->min) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    uint64_t nb = bmblock_array->max - bmblock_array->min + 1; // number of elements
+    uint64_t offset = goal - bmblock_array->min;
+    uint64_t after = bm_free_from(bmblock_array, offset);
+    uint64_t before = bm_free_before(bmblock_array, offset);
+    if(after == nb && before == nb) {
+        return ERR_BITMAP_FULL;
+    }
+    if(after == nb || (before != nb && offset - before < after - offset)) { // strictly closer before goal
+        return (int)(before + bmblock_array->min);
+    }
+    return (int)(after + bmblock_array->min);
+}
+
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t n, uint64_t hint)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    if(n == 0 || hint > bmblock_array->max || hint < bmblock_array->min) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    uint64_t nb = bmblock_array->max - bmblock_array->min + 1; // number of elements
+    uint64_t start = bm_run_between(bmblock_array, n, hint - bmblock_array->min, nb);
+    if(start == nb) { // wrap to the first free element
+        start = bm_run_between(bmblock_array, n, bm_word(&(bmblock_array->cursor)) * BITS_PER_VECTOR, nb);
+    }
+    return (start == nb) ? ERR_BITMAP_FULL : (int)(start + bmblock_array->min);
+}
+
+/**
+ * @brief compute all the summary levels from the blocs, level by level
+ */
+static void bm_summary_rebuild(struct bmblock_array *bmblock_array)
+{
+    size_t below = bmblock_array->length;
+    for(size_t k = 0; k < bmblock_array->nb_levels; k++) {
+        uint64_t *level = bmblock_array->summary[k];
+        memset(level, 0, bmblock_array->summary_length[k] * sizeof(uint64_t));
+        for(size_t i = 0; i < below; i++) {
+            int free = (k == 0) ? bm_bloc(bmblock_array, i) != BM_FULL : bmblock_array->summary[k-1][i] != 0;
+            level[i / BITS_PER_VECTOR] |= (uint64_t)free << (i % BITS_PER_VECTOR);
+        }
+        below = bmblock_array->summary_length[k];
+    }
+}
+
+int bm_load(struct bmblock_array *bmblock_array, const uint64_t *words, size_t nb_words)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+    M_REQUIRE_NON_NULL(words);
+
+    if(bmblock_array->max / BITS_PER_VECTOR >= nb_words) { // max is not in words
+        return ERR_BAD_PARAMETER;
+    }
+
+    uint64_t shift = bmblock_array->min % BITS_PER_VECTOR; // position of min within its word
+    size_t first = bmblock_array->min / BITS_PER_VECTOR; // word of min
+    for(size_t i = 0; i < bmblock_array->length; i++) { // one 64 bits bloc at a time
+        size_t w = first + i; // word of the first element of bloc i
+        uint64_t bits = words[w] >> shift;
+        if(shift != 0 && w + 1 < nb_words) {
+            bits |= words[w + 1] << (BITS_PER_VECTOR - shift); // the rest of the bloc is in the next word
+        }
+        bmblock_array->bm[i] = bits;
+    }
+    uint64_t used = (bmblock_array->max - bmblock_array->min + 1) % BITS_PER_VECTOR; // elements in the last bloc
+    if(used != 0) {
+        bmblock_array->bm[bmblock_array->length - 1] &= ~(BM_FULL << used); // nothing beyond max
+    }
+
+    bm_summary_rebuild(bmblock_array);
+    bmblock_array->cursor = 0;
+    return 0;
+}
+
+int bm_store(const struct bmblock_array *bmblock_array, uint64_t *words, size_t nb_words)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+    M_REQUIRE_NON_NULL(words);
+
+    if(bmblock_array->max / BITS_PER_VECTOR >= nb_words) { // max is not in words
+        return ERR_BAD_PARAMETER;
+    }
+
+    memset(words, 0xff, nb_words * sizeof(uint64_t)); // elements out of range are used
+    uint64_t shift = bmblock_array->min % BITS_PER_VECTOR; // position of min within its word
+    size_t first = bmblock_array->min / BITS_PER_VECTOR; // word of min
+    for(size_t i = 0; i < bmblock_array->length; i++) { // one 64 bits bloc at a time
+        size_t w = first + i; // word of the first element of bloc i
+        uint64_t bits = bm_bloc(bmblock_array, i); // elements beyond max are used
+        words[w] = (words[w] & ~(BM_FULL << shift)) | (bits << shift);
+        if(shift != 0 && w + 1 < nb_words) {
+            words[w + 1] = (words[w + 1] & (BM_FULL << shift)) | (bits >> (BITS_PER_VECTOR - shift)); // the rest of the bloc
+        }
+    }
+    return 0;
+}
+
+int bm_or(struct bmblock_array *bmblock_array, const struct bmblock_array *other)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+    M_REQUIRE_NON_NULL(other);
+
+    if(other->min != bmblock_array->min || other->max != bmblock_array->max) { // not the same elements
+        return ERR_BAD_PARAMETER;
+    }
+    for(size_t i = 0; i < bmblock_array->length; i++) { // one 64 bits bloc at a time
+        bmblock_array->bm[i] |= other->bm[i];
+    }
+    bm_summary_rebuild(bmblock_array); // elements are only set: the cursor stays valid
+    return 0;
+}
+
+/*
+ * Concurrent use. Each bloc is changed by a single atomic operation. A
+ * summary bit is cleared once its bloc is seen full; the bloc is then
+ * read again and the bit set back if an element was freed meanwhile (the
+ * thread that freed it may have seen the bit still set and stopped).
+ * All these operations are sequentially consistent, so one of the two
+ * threads always sees the other one.
+ */
+
+/**
+ * @brief set bit index of summary level k, and in the levels above until
+ *        one is already set
+ */
+static void bm_atomic_summary_set(struct bmblock_array *bmblock_array, size_t index, size_t k)
+{
+    for(; k < bmblock_array->nb_levels; k++) {
+        uint64_t bit = UINT64_C(1) << (index % BITS_PER_VECTOR);
+        uint64_t old = __atomic_fetch_or(&(bmblock_array->summary[k][index / BITS_PER_VECTOR]), bit, __ATOMIC_SEQ_CST);
+        if(old & bit) { // the levels above are already set
+            return;
+        }
+        index /= BITS_PER_VECTOR;
+    }
+}
+
+/**
+ * @brief tell whether the bloc below bit index of summary level k (a
+ *        bloc of elements for level 0) has a free element
+ */
+static int bm_atomic_has_free(const struct bmblock_array *bmblock_array, size_t k, size_t index)
+{
+    if(k == 0) {
+        return (__atomic_load_n(&(bmblock_array->bm[index]), __ATOMIC_SEQ_CST) | bm_tail(bmblock_array, index)) != BM_FULL;
+    }
+    return __atomic_load_n(&(bmblock_array->summary[k - 1][index]), __ATOMIC_SEQ_CST) != 0;
+}
+
+/**
+ * @brief bloc index was seen full: clear its bit in the summary, and in
+ *        the levels above as long as a summary bloc becomes 0
+ */
+static void bm_atomic_summary_clear(struct bmblock_array *bmblock_array, size_t index)
+{
+    for(size_t k = 0; k < bmblock_array->nb_levels; k++) {
+        uint64_t bit = UINT64_C(1) << (index % BITS_PER_VECTOR);
+        uint64_t old = __atomic_fetch_and(&(bmblock_array->summary[k][index / BITS_PER_VECTOR]), ~bit, __ATOMIC_SEQ_CST);
+        if(bm_atomic_has_free(bmblock_array, k, index)) { // freed meanwhile: the bit is needed
+            bm_atomic_summary_set(bmblock_array, index, k);
+            return;
+        }
+        if((old & ~bit) != 0) { // the levels above do not change
+            return;
+        }
+        index /= BITS_PER_VECTOR;
+    }
+}
+
+/**
+ * @brief the bits of mask were set in bloc index: update the summary if
+ *        the bloc became full
+ */
+static void bm_atomic_filled(struct bmblock_array *bmblock_array, size_t index, uint64_t bits)
+{
+    if((bits | bm_tail(bmblock_array, index)) == BM_FULL) {
+        bm_atomic_summary_clear(bmblock_array, index);
+    }
+}
+
+/**
+ * @brief elements were freed in bloc index: update the summary and the
+ *        cursor, which only moves back
+ */
+static void bm_atomic_freed(struct bmblock_array *bmblock_array, size_t index)
+{
+    bm_atomic_summary_set(bmblock_array, index, 0);
+    uint64_t cursor = bm_word(&(bmblock_array->cursor));
+    while(index < cursor
+          && !__atomic_compare_exchange_n(&(bmblock_array->cursor), &cursor, index, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // cursor reloaded by the failed exchange
+    }
+}
+
+/**
+ * @brief claim the lowest free element of bloc index among those of mask,
+ *        with a compare-and-swap of the bloc
+ * @return the offset (from min) of the element, UINT64_MAX if none was free
+ */
+static uint64_t bm_atomic_claim_bloc(struct bmblock_array *bmblock_array, size_t index, uint64_t mask)
+{
+    uint64_t *word = &(bmblock_array->bm[index]);
+    uint64_t old = bm_word(word);
+    for(;;) {
+        uint64_t free = ~(old | bm_tail(bmblock_array, index)) & mask;
+        if(free == 0) {
+            return UINT64_MAX;
+        }
+        uint64_t bit = free & -free; // lowest free element
+        if(__atomic_compare_exchange_n(word, &old, old | bit, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            bm_atomic_filled(bmblock_array, index, old | bit);
+            return index * BITS_PER_VECTOR + __builtin_ctzll(bit);
+        } // old reloaded by the failed exchange
+    }
+}
+
+/**
+ * @brief claim the n elements from offset x (from min) bloc by bloc, as
+ *        long as none of them is used
+ * @return the number of elements claimed, from x
+ */
+static uint64_t bm_atomic_claim_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n)
+{
+    uint64_t first = x;
+    uint64_t end = x + n;
+    while(first < end) { // one 64 bits bloc at a time
+        size_t index = first / BITS_PER_VECTOR;
+        uint64_t position = first % BITS_PER_VECTOR;
+        uint64_t count = (end - first < BITS_PER_VECTOR - position) ? end - first : BITS_PER_VECTOR - position;
+        uint64_t mask = bm_mask(position, count);
+        uint64_t *word = &(bmblock_array->bm[index]);
+        uint64_t old = bm_word(word);
+        do {
+            if(old & mask) { // taken by another thread
+                return first - x;
+            }
+        } while(!__atomic_compare_exchange_n(word, &old, old | mask, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        bm_atomic_filled(bmblock_array, index, old | mask);
+        first += count;
+    }
+    return n;
+}
+
+/**
+ * @brief where the searches of bm_atomic_claim() start for the calling
+ *        thread: 0 for the first thread, as bm_find_next(), and places
+ *        scattered over the array by a hash of their number for the
+ *        others, so that threads do not fight for the same blocs
+ * @param nb the number of elements
+ */
+static uint64_t bm_thread_start(uint64_t nb)
+{
+    static unsigned int nb_threads = 0; // threads that called bm_thread_start()
+    static __thread unsigned int thread = 0; // number of the calling thread, from 1
+    if(thread == 0) {
+        thread = __atomic_add_fetch(&nb_threads, 1, __ATOMIC_RELAXED);
+    }
+    return ((thread - 1) * UINT64_C(0x9e3779b97f4a7c15)) % nb; // golden ratio hash
+}
+
+void bm_atomic_set(struct bmblock_array *bmblock_array, uint64_t x)
+{
+    if(bmblock_array != NULL && x >= bmblock_array->min && x <= bmblock_array->max) { // value is in range
+        size_t index = (x - bmblock_array->min) / BITS_PER_VECTOR;
+        uint64_t bit = UINT64_C(1) << ((x - bmblock_array->min) % BITS_PER_VECTOR);
+        uint64_t old = __atomic_fetch_or(&(bmblock_array->bm[index]), bit, __ATOMIC_SEQ_CST);
+        if(!(old & bit)) {
+            bm_atomic_filled(bmblock_array, index, old | bit);
+        }
+    }
+}
+
+void bm_atomic_clear(struct bmblock_array *bmblock_array, uint64_t x)
+{
+    bm_atomic_clear_range(bmblock_array, x, 1);
+}
+
+void bm_atomic_clear_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n)
+{
+    if(bmblock_array != NULL && n > 0) {
+        if(x >= bmblock_array->min && x <= bmblock_array->max && n - 1 <= bmblock_array->max - x) { // values are in range
+            uint64_t first = x - bmblock_array->min; // offset of x
+            uint64_t end = first + n;
+            while(first < end) { // one 64 bits bloc at a time
+                size_t index = first / BITS_PER_VECTOR;
+                uint64_t position = first % BITS_PER_VECTOR;
+                uint64_t count = (end - first < BITS_PER_VECTOR - position) ? end - first : BITS_PER_VECTOR - position;
+                __atomic_fetch_and(&(bmblock_array->bm[index]), ~bm_mask(position, count), __ATOMIC_SEQ_CST);
+                bm_atomic_freed(bmblock_array, index);
+                first += count;
+            }
+        }
+    }
+}
+
+int bm_atomic_claim(struct bmblock_array *bmblock_array)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    uint64_t nb = bmblock_array->max - bmblock_array->min + 1; // number of elements
+    uint64_t offset = bm_thread_start(nb);
+    int wrapped = 0; // searching from the start of the array
+    for(;;) {
+        offset = bm_free_from(bmblock_array, offset);
+        if(offset == nb) {
+            if(wrapped) {
+                return ERR_BITMAP_FULL;
+            }
+            wrapped = 1;
+            offset = 0;
+            continue;
+        }
+        uint64_t position = offset % BITS_PER_VECTOR;
+        uint64_t claimed = bm_atomic_claim_bloc(bmblock_array, offset / BITS_PER_VECTOR,
+                                                bm_mask(position, BITS_PER_VECTOR - position));
+        if(claimed != UINT64_MAX) {
+            return (int)(claimed + bmblock_array->min);
+        }
+        offset = (offset / BITS_PER_VECTOR + 1) * BITS_PER_VECTOR; // bloc filled by other threads: the next one
+    }
+}
+
+int bm_atomic_claim_near(struct bmblock_array *bmblock_array, uint64_t goal)
+{
+    for(;;) {
+        int x = bm_find_near(bmblock_array, goal);
+        if(x < 0) { // full, or bad parameter
+            return x;
+        }
+        uint64_t offset = x - bmblock_array->min;
+        if(bm_atomic_claim_bloc(bmblock_array, offset / BITS_PER_VECTOR, UINT64_C(1) << (offset % BITS_PER_VECTOR)) != UINT64_MAX) {
+            return x;
+        } // taken by another thread: the next nearest
+    }
+}
+
+int bm_atomic_claim_run(struct bmblock_array *bmblock_array, uint64_t n, uint64_t hint)
+{
+    for(;;) {
+        int first = bm_find_run(bmblock_array, n, hint);
+        if(first < 0) { // no run, or bad parameter
+            return first;
+        }
+        uint64_t claimed = bm_atomic_claim_range(bmblock_array, first - bmblock_array->min, n);
+        if(claimed == n) {
+            return first;
+        }
+        bm_atomic_clear_range(bmblock_array, first, claimed); // part of the run taken by another thread: give back ours
+    }
+}
+
+int bm_atomic_claim_within(struct bmblock_array *bmblock_array, uint64_t n, uint64_t hint, uint64_t first, uint64_t last)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    if(n == 0 || first < bmblock_array->min || last > bmblock_array->max || hint < first || hint > last) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    uint64_t end = last - bmblock_array->min + 1; // offset after the range
+    for(;;) {
+        uint64_t start = bm_run_between(bmblock_array, n, hint - bmblock_array->min, end);
+        if(start == end) { // from the start of the range
+            start = bm_run_between(bmblock_array, n, first - bmblock_array->min, end);
+        }
+        if(start == end) {
+            return ERR_BITMAP_FULL;
+        }
+        uint64_t claimed = bm_atomic_claim_range(bmblock_array, start, n);
+        if(claimed == n) {
+            return (int)(start + bmblock_array->min);
+        }
+        bm_atomic_clear_range(bmblock_array, start + bmblock_array->min, claimed); // part of the run taken by another thread: give back ours
+    }
+}
+
+uint64_t bm_count(const struct bmblock_array *bmblock_array, uint64_t x, uint64_t n)
+{
+    uint64_t count = 0;
+    if(bmblock_array != NULL && n > 0) {
+        if(x >= bmblock_array->min && x <= bmblock_array->max && n - 1 <= bmblock_array->max - x) { // values are in range
+            uint64_t first = x - bmblock_array->min; // offset of x
+            uint64_t end = first + n;
+            while(first < end) { // one 64 bits bloc at a time
+                size_t index = first / BITS_PER_VECTOR;
+                uint64_t position = first % BITS_PER_VECTOR;
+                uint64_t len = (end - first < BITS_PER_VECTOR - position) ? end - first : BITS_PER_VECTOR - position;
+                count += __builtin_popcountll(bm_word(&(bmblock_array->bm[index])) & bm_mask(position, len));
+                first += len;
+            }
         }
-        x++; // otherwise next element
-        bit = bm_get(bmblock_array, x); // get corresponding bit
     }
-    return x; // return first x with bit = 0
+    return count;
 }
 
 void bm_print(struct bmblock_array *bmblock_array)
@@ -15,11 +15,21 @@
 extern "C" {
 #endif
 
+#define BM_MAX_LEVELS 11 // summary levels, enough for 64^11 blocs
+
+/*
+ * Above the bits array, the summary levels: bit i of summary[0] is set
+ * when the 64 bits bloc bm[i] has a free element, bit i of summary[k] is
+ * set when summary[k-1][i] is not 0. The last level has a single bloc.
+ */
 struct bmblock_array {
     size_t length; // length of bm array
-    uint64_t cursor; // current 64 bits block
+    uint64_t cursor; // current 64 bits block, the blocs before it are full
     uint64_t min; // min element
     uint64_t max; // max element
+    size_t nb_levels; // number of summary levels
+    size_t summary_length[BM_MAX_LEVELS]; // number of blocs of each summary level
+    uint64_t *summary[BM_MAX_LEVELS]; // summary levels, stored after bm
     uint64_t bm[1]; // bits array
 };
 
@@ -27,7 +37,7 @@ struct bmblock_array {
 
 /**
  * @brief allocate a new bmblock_array to handle elements indexed
- * between min and max (included, thus (max-min+1) elements).
+ * between min and max (included, thus (max-min+1) elements), all unused.
  * @param min the mininum value supported by our bmblock_array
  * @param max the maxinum value supported by our bmblock_array
  * @return a pointer of the newly created bmblock_array or NULL on failure
@@ -50,19 +60,176 @@ int bm_get(struct bmblock_array *bmblock_array, uint64_t x);
 void bm_set(struct bmblock_array *bmblock_array, uint64_t x);
 
 /**
- * @brief set to false (or 0) the bit associated to the given value
+ * @brief set to false (or 0) the bit associated to the given value; the
+ *        cursor goes back to its bloc if needed
  * @param bmblock_array the array containing the value we want to clear
  * @param x an integer corresponding to the number of the value we are looking for
  */
 void bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
 
 /**
- * @brief return the next unused bit
+ * @brief set to true (or 1) the bits of the n values from x, a 64 bits
+ *        bloc at a time; nothing is done if they are not all in range
+ * @param bmblock_array the array containing the values we want to set
+ * @param x the first value
+ * @param n the number of values
+ */
+void bm_set_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n);
+
+/**
+ * @brief set to false (or 0) the bits of the n values from x, a 64 bits
+ *        bloc at a time; nothing is done if they are not all in range
+ * @param bmblock_array the array containing the values we want to clear
+ * @param x the first value
+ * @param n the number of values
+ */
+void bm_clear_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n);
+
+/**
+ * @brief return the next unused bit, from the 64 bits bloc of the cursor;
+ *        the summary levels are walked up and down, in O(log n)
  * @param bmblock_array the array we want to search for place
  * @return <0 on failure, the value of the next unused value otherwise
  */
 int bm_find_next(struct bmblock_array *bmblock_array);
 
+/**
+ * @brief return the unused bit nearest to goal, searching both ways from
+ *        it (after goal on a tie); the cursor is left untouched
+ * @param bmblock_array the array we want to search for place
+ * @param goal the value the search starts from
+ * @return <0 on failure, the value of the unused value otherwise
+ */
+int bm_find_near(struct bmblock_array *bmblock_array, uint64_t goal);
+
+/**
+ * @brief return the first unused bit from hint, or the first one of the
+ *        array if there is none after hint; the cursor is left untouched
+ * @param bmblock_array the array we want to search for place
+ * @param hint the value where the search starts
+ * @return <0 on failure, the value of the unused value otherwise
+ */
+int bm_find_next_from(struct bmblock_array *bmblock_array, uint64_t hint);
+
+/**
+ * @brief return the first of n consecutive unused bits from hint, or from
+ *        the start of the array if there are none after hint; the bits
+ *        are not set
+ * @param bmblock_array the array we want to search for place
+ * @param n the number of values
+ * @param hint the value where the search starts
+ * @return <0 on failure, the first value of the run otherwise
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t n, uint64_t hint);
+
+/**
+ * @brief set the bits of the array from words, which hold the bit of
+ *        every element x at bit x % 64 of words[x / 64] (from element 0);
+ *        the cursor goes back to the first bloc
+ * @param bmblock_array the array we want to fill
+ * @param words the bits of the elements 0 to at least max
+ * @param nb_words the number of 64 bits words of words
+ * @return 0 on success; <0 on failure (words too short)
+ */
+int bm_load(struct bmblock_array *bmblock_array, const uint64_t *words, size_t nb_words);
+
+/**
+ * @brief write the bits of the array to words, with the layout of
+ *        bm_load(); the elements below min and beyond max are set to 1
+ * @param bmblock_array the array we want to save
+ * @param words room for the bits of the elements 0 to at least max (OUT)
+ * @param nb_words the number of 64 bits words of words
+ * @return 0 on success; <0 on failure (words too short)
+ */
+int bm_store(const struct bmblock_array *bmblock_array, uint64_t *words, size_t nb_words);
+
+/**
+ * @brief set the elements set in other, e.g. to merge partial bitmaps
+ *        built by several threads
+ * @param bmblock_array the array we want to update
+ * @param other an array of the same elements (same min and max)
+ * @return 0 on success; <0 on failure
+ */
+int bm_or(struct bmblock_array *bmblock_array, const struct bmblock_array *other);
+
+/*
+ * Concurrent use: bm_atomic_*() may be called by several threads at once,
+ * together with bm_get() and the bm_find_*() searches (whose results may
+ * then be stale). The other functions that change the array need it for
+ * themselves.
+ */
+
+/**
+ * @brief bm_set() with an atomic operation
+ * @param bmblock_array the array containing the value we want to set
+ * @param x the value
+ */
+void bm_atomic_set(struct bmblock_array *bmblock_array, uint64_t x);
+
+/**
+ * @brief bm_clear() with an atomic operation
+ * @param bmblock_array the array containing the value we want to clear
+ * @param x the value
+ */
+void bm_atomic_clear(struct bmblock_array *bmblock_array, uint64_t x);
+
+/**
+ * @brief bm_clear_range() with one atomic operation per 64 bits bloc
+ * @param bmblock_array the array containing the values we want to clear
+ * @param x the first value
+ * @param n the number of values
+ */
+void bm_atomic_clear_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t n);
+
+/**
+ * @brief find an unused bit and set it, with a compare-and-swap; the
+ *        first thread searches from the start of the array, the others
+ *        from places scattered over the array
+ * @param bmblock_array the array we want to search for place
+ * @return <0 on failure, the value now used otherwise
+ */
+int bm_atomic_claim(struct bmblock_array *bmblock_array);
+
+/**
+ * @brief bm_find_near() and set the bit found, with a compare-and-swap
+ * @param bmblock_array the array we want to search for place
+ * @param goal the value the search starts from
+ * @return <0 on failure, the value now used otherwise
+ */
+int bm_atomic_claim_near(struct bmblock_array *bmblock_array, uint64_t goal);
+
+/**
+ * @brief bm_find_run() and set the n bits found, with a compare-and-swap
+ *        per 64 bits bloc; if another thread takes one of them first, the
+ *        others are cleared and the search goes on
+ * @param bmblock_array the array we want to search for place
+ * @param n the number of consecutive values, >0
+ * @param hint the value where the search starts
+ * @return <0 on failure, the first value now used otherwise
+ */
+int bm_atomic_claim_run(struct bmblock_array *bmblock_array, uint64_t n, uint64_t hint);
+
+/**
+ * @brief bm_atomic_claim_run() limited to the values from first to last:
+ *        the run is searched from hint to last, then from first
+ * @param bmblock_array the array we want to search for place
+ * @param n the number of consecutive values, >0
+ * @param hint the value where the search starts, from first to last
+ * @param first the first value of the range
+ * @param last the last value of the range
+ * @return <0 on failure, the first value now used otherwise
+ */
+int bm_atomic_claim_within(struct bmblock_array *bmblock_array, uint64_t n, uint64_t hint, uint64_t first, uint64_t last);
+
+/**
+ * @brief count the used values among n values from x
+ * @param bmblock_array the array
+ * @param x the first value
+ * @param n the number of values
+ * @return the number of used values, 0 if the values are not all in range
+ */
+uint64_t bm_count(const struct bmblock_array *bmblock_array, uint64_t x, uint64_t n);
+
 /**
  * @brief usefull to see (and debug) content of a bmblock_array
  * @param bmblock_array the array we want to see
@@ -0,0 +1,663 @@
+/**
+ * @file csum.c
+ * @brief per-sector CRC32C checksums kept in a sidecar file
+ */
+
+#define _XOPEN_SOURCE 700 // for pread(), pwrite() and fdatasync()
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "csum.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h> // SSE4.2, enabled per function
+#define CSUM_HAVE_SSE42 1
+#endif
+
+#define CSUM_POLY 0x82F63B78      // CRC32C polynomial, reflected
+#define CSUM_SCRUB_CHUNK 64       // sectors read at once by csum_scrub()
+#define CSUM_MAX_THREADS 16
+#define CSUM_STREAM 168           // bytes of each of the 3 interleaved streams of csum_sse42()
+#define CSUM_SEQ_DONE 256         // seq of a sector: writes in progress below, completed writes above
+#define CSUM_READ_TRIES 1000      // reads of sectors overlapping writes before a mismatch is reported
+
+/*
+ * CRC32C
+ */
+
+static uint32_t csum_table[8][256]; // slicing-by-8 tables
+static uint32_t (*csum_fn)(uint32_t crc, const uint8_t *p, size_t len); // best implementation
+static pthread_once_t csum_once = PTHREAD_ONCE_INIT;
+
+static uint32_t csum_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while(len >= 8) {
+        uint32_t a = crc ^ (p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = csum_table[7][a & 0xff] ^ csum_table[6][(a >> 8) & 0xff]
+              ^ csum_table[5][(a >> 16) & 0xff] ^ csum_table[4][a >> 24]
+              ^ csum_table[3][p[4]] ^ csum_table[2][p[5]]
+              ^ csum_table[1][p[6]] ^ csum_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while(len-- > 0) {
+        crc = (crc >> 8) ^ csum_table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CSUM_HAVE_SSE42
+static uint32_t csum_shift1[4][256]; // state after CSUM_STREAM zero bytes, by byte of the state
+static uint32_t csum_shift2[4][256]; // state after 2 * CSUM_STREAM zero bytes
+
+/**
+ * @brief state of the CRC after zero bytes, with the tables of one length;
+ *        the CRC is linear, so the state is the xor of the states of its bytes
+ */
+static uint32_t csum_shift(uint32_t (*shift)[256], uint32_t crc)
+{
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff]
+           ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t csum_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t c = crc;
+    // crc32 has a latency of 3 cycles but a throughput of 1 per cycle: 3
+    // independent streams, merged by shifting the first two
+    for(; len >= 3 * CSUM_STREAM; p += 3 * CSUM_STREAM, len -= 3 * CSUM_STREAM) {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for(size_t i = 0; i < CSUM_STREAM; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, &p[i], sizeof(v0));
+            memcpy(&v1, &p[i + CSUM_STREAM], sizeof(v1));
+            memcpy(&v2, &p[i + 2 * CSUM_STREAM], sizeof(v2));
+            c = _mm_crc32_u64(c, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c = csum_shift(csum_shift2, c) ^ csum_shift(csum_shift1, c1) ^ c2;
+    }
+    for(; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+#endif
+    for(; len >= 4; p += 4, len -= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+    }
+    while(len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void csum_init(void)
+{
+    for(uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for(int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CSUM_POLY : crc >> 1;
+        }
+        csum_table[0][n] = crc;
+    }
+    for(uint32_t n = 0; n < 256; n++) {
+        for(int t = 1; t < 8; t++) {
+            uint32_t prev = csum_table[t - 1][n];
+            csum_table[t][n] = (prev >> 8) ^ csum_table[0][prev & 0xff];
+        }
+    }
+    csum_fn = csum_slice8;
+#ifdef CSUM_HAVE_SSE42
+    static const uint8_t zeros[2 * CSUM_STREAM];
+    for(int b = 0; b < 4; b++) {
+        for(uint32_t n = 0; n < 256; n++) {
+            csum_shift1[b][n] = csum_slice8(n << (8 * b), zeros, CSUM_STREAM);
+            csum_shift2[b][n] = csum_slice8(n << (8 * b), zeros, 2 * CSUM_STREAM);
+        }
+    }
+    if(__builtin_cpu_supports("sse4.2")) {
+        csum_fn = csum_sse42;
+    }
+#endif
+}
+
+uint32_t csum_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&csum_once, csum_init);
+    return ~csum_fn(~crc, data, len);
+}
+
+uint32_t csum_crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&csum_once, csum_init);
+    return ~csum_slice8(~crc, data, len);
+}
+
+const char *csum_impl(void)
+{
+    pthread_once(&csum_once, csum_init);
+    return (csum_fn == csum_slice8) ? "slicing-by-8" : "sse4.2";
+}
+
+/*
+ * checksummed device
+ */
+
+struct csum_dev {
+    struct bdev *inner;           // the disk
+    int fd;                       // the sidecar file
+    uint32_t *crc;                // CSUM_MAX_SECTORS checksums, accessed atomically
+    uint32_t *seq;                // CSUM_MAX_SECTORS write sequences (see csum_seq()), accessed atomically
+    uint32_t nb_sectors;          // sectors covered by crc, accessed atomically
+    uint32_t dirty_first;         // checksums [dirty_first, dirty_end[ to write back,
+    uint32_t dirty_end;           // under the lock of the device
+    int open;                     // the sidecar says CSUM_MAGIC_OPEN, under the lock
+    uint32_t writers;             // writes in progress, under the lock
+    uint64_t writes;              // writes completed, under the lock
+};
+
+/*
+ * Write ordering: a sector is written to the disk before its checksum is
+ * updated, so for a moment the two do not match.
+ *  - concurrent reads: every sector has a sequence, incremented when a
+ *    write of it begins and again when its checksum is updated; a read
+ *    that does not match is only reported if no write of its sectors
+ *    overlapped it, otherwise it is read again;
+ *  - crashes: the first write after a flush marks the sidecar open
+ *    (synced before the data is written) and the flush that leaves no
+ *    write behind marks it clean again once the checksums are synced;
+ *    an open sidecar is not trusted, its checksums are computed again.
+ */
+
+static uint32_t csum_sector(const void *data)
+{
+    return csum_crc32c(0, data, SECTOR_SIZE);
+}
+
+/**
+ * @brief check count sectors read from the disk
+ * @return 0 if they match their checksum (or have none); ERR_CHECKSUM otherwise
+ */
+static int csum_verify(struct csum_dev *c, uint32_t first, uint32_t count, const uint8_t *data)
+{
+    uint32_t known = __atomic_load_n(&(c->nb_sectors), __ATOMIC_ACQUIRE);
+    for(uint32_t i = 0; i < count && first + i < known; i++) {
+        uint32_t crc = __atomic_load_n(&(c->crc[first + i]), __ATOMIC_RELAXED);
+        if(csum_sector(&data[(size_t)i * SECTOR_SIZE]) != crc) { // corrupted sector
+            return ERR_CHECKSUM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief record the checksum of one written sector; if the write extends
+ *        the disk, the sectors skipped before it read as zeros and get
+ *        the checksum of a sector of zeros
+ */
+static void csum_update(struct bdev *dev, uint32_t sector, const void *data)
+{
+    static const uint8_t zeros[SECTOR_SIZE];
+    struct csum_dev *c = dev->priv;
+    uint32_t crc = csum_sector(data);
+    pthread_mutex_lock(&(dev->lock)); // the checksums beyond the disk are only written under the lock
+    uint32_t first = sector; // first checksum to write back
+    if(sector >= c->nb_sectors) { // the disk grows
+        first = c->nb_sectors;
+        uint32_t zero = csum_sector(zeros);
+        for(uint32_t s = first; s < sector; s++) {
+            __atomic_store_n(&(c->crc[s]), zero, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&(c->crc[sector]), crc, __ATOMIC_RELAXED);
+    if(c->dirty_first >= c->dirty_end) { // nothing to write back yet
+        c->dirty_first = first;
+        c->dirty_end = sector + 1;
+    } else {
+        c->dirty_first = (first < c->dirty_first) ? first : c->dirty_first;
+        c->dirty_end = (sector >= c->dirty_end) ? sector + 1 : c->dirty_end;
+    }
+    if(sector >= c->nb_sectors) { // the new sectors are checked from now on
+        __atomic_store_n(&(c->nb_sectors), sector + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(dev->lock));
+}
+
+/**
+ * @brief write the whole buffer at offset of the sidecar file
+ * @return 0 on success; <0 on error
+ */
+static int csum_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    const uint8_t *p = buf;
+    while(len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if(n <= 0) { // write error
+            return ERR_IO;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief state of count sectors against the writes
+ * @param busy set if one of them is being written (OUT)
+ * @return a value that changes whenever a write of one of them completes
+ */
+static uint64_t csum_seq(const struct csum_dev *c, uint32_t first, uint32_t count, int *busy)
+{
+    uint64_t sum = 0;
+    for(uint32_t i = 0; i < count && first + i < CSUM_MAX_SECTORS; i++) {
+        uint32_t seq = __atomic_load_n(&(c->seq[first + i]), __ATOMIC_ACQUIRE);
+        *busy |= (seq % CSUM_SEQ_DONE) != 0;
+        sum += seq;
+    }
+    return sum;
+}
+
+/**
+ * @brief read count sectors from the disk and check them; a mismatch
+ *        caused by a write overlapping the read is read again
+ * @return 0 on success; ERR_CHECKSUM if they do not match; <0 on error
+ */
+static int csum_read_verified(struct csum_dev *c, uint32_t first, uint32_t count, void *data)
+{
+    int error = 0;
+    for(int tries = 0; tries < CSUM_READ_TRIES; tries++) {
+        int busy = 0;
+        uint64_t before = csum_seq(c, first, count, &busy);
+        error = bdev_read(c->inner, first, count, data);
+        error = error ? error : csum_verify(c, first, count, data);
+        if(error != ERR_CHECKSUM || (csum_seq(c, first, count, &busy) == before && !busy)) {
+            return error; // no write overlapped the read
+        }
+        sched_yield(); // let the write complete
+    }
+    return error;
+}
+
+/**
+ * @brief begin a write: the sidecar is marked open first if needed
+ * @return 0 on success; <0 on error
+ */
+static int csum_begin(struct bdev *dev)
+{
+    struct csum_dev *c = dev->priv;
+    int error = 0;
+    pthread_mutex_lock(&(dev->lock));
+    if(!c->open) { // first write since the sidecar was marked clean
+        struct csum_header h = { CSUM_MAGIC_OPEN, c->nb_sectors };
+        error = csum_pwrite(c->fd, &h, sizeof(h), 0);
+        error = error ? error : (fdatasync(c->fd) ? ERR_IO : 0); // before the data
+        c->open = !error;
+    }
+    c->writers += !error;
+    pthread_mutex_unlock(&(dev->lock));
+    return error;
+}
+
+static void csum_end(struct bdev *dev)
+{
+    struct csum_dev *c = dev->priv;
+    pthread_mutex_lock(&(dev->lock));
+    c->writers--;
+    c->writes++;
+    pthread_mutex_unlock(&(dev->lock));
+}
+
+static void csum_seq_begin(struct csum_dev *c, uint32_t sector)
+{
+    __atomic_fetch_add(&(c->seq[sector]), 1, __ATOMIC_ACQ_REL);
+}
+
+static void csum_seq_end(struct csum_dev *c, uint32_t sector)
+{
+    __atomic_fetch_add(&(c->seq[sector]), CSUM_SEQ_DONE - 1, __ATOMIC_ACQ_REL);
+}
+
+static int csum_read(struct bdev *dev, uint32_t first, uint32_t count, void *data)
+{
+    return csum_read_verified(dev->priv, first, count, data);
+}
+
+static int csum_write(struct bdev *dev, uint32_t first, uint32_t count, const void *data)
+{
+    struct csum_dev *c = dev->priv;
+    if((size_t)first + count > CSUM_MAX_SECTORS) { // beyond the largest disk
+        return ERR_IO;
+    }
+    int error = csum_begin(dev);
+    if(error) { // error occured
+        return error; // propagate error
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        csum_seq_begin(c, first + i);
+    }
+    error = bdev_write(c->inner, first, count, data);
+    for(uint32_t i = 0; i < count; i++) {
+        if(!error) {
+            csum_update(dev, first + i, (const uint8_t*)data + (size_t)i * SECTOR_SIZE);
+        }
+        csum_seq_end(c, first + i);
+    }
+    csum_end(dev);
+    return error;
+}
+
+static int csum_readv(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    struct csum_dev *c = dev->priv;
+    int error = bdev_readv(c->inner, vec, count);
+    for(size_t i = 0; !error && i < count; i++) {
+        error = csum_verify(c, vec[i].sector, 1, vec[i].data);
+        if(error == ERR_CHECKSUM) { // maybe written meanwhile: read it again alone
+            error = csum_read_verified(c, vec[i].sector, 1, vec[i].data);
+        }
+    }
+    return error;
+}
+
+static int csum_writev(struct bdev *dev, const struct sector_iovec *vec, size_t count)
+{
+    struct csum_dev *c = dev->priv;
+    for(size_t i = 0; i < count; i++) {
+        if(vec[i].sector >= CSUM_MAX_SECTORS) { // beyond the largest disk
+            return ERR_IO;
+        }
+    }
+    int error = csum_begin(dev);
+    if(error) { // error occured
+        return error; // propagate error
+    }
+    for(size_t i = 0; i < count; i++) {
+        csum_seq_begin(c, vec[i].sector);
+    }
+    error = bdev_writev(c->inner, vec, count);
+    for(size_t i = 0; i < count; i++) {
+        if(!error) {
+            csum_update(dev, vec[i].sector, vec[i].data);
+        }
+        csum_seq_end(c, vec[i].sector);
+    }
+    csum_end(dev);
+    return error;
+}
+
+static int csum_flush(struct bdev *dev)
+{
+    struct csum_dev *c = dev->priv;
+    pthread_mutex_lock(&(dev->lock));
+    uint64_t writes = c->writes; // the writes whose data the flush below covers
+    pthread_mutex_unlock(&(dev->lock));
+    int error = bdev_flush(c->inner); // data first, then the checksums describing it
+    pthread_mutex_lock(&(dev->lock));
+    int written = 0; // checksums written back
+    if(!error && c->dirty_first < c->dirty_end) {
+        uint32_t first = c->dirty_first;
+        error = csum_pwrite(c->fd, &(c->crc[first]), (size_t)(c->dirty_end - first) * sizeof(uint32_t),
+                            sizeof(struct csum_header) + (off_t)first * sizeof(uint32_t));
+        if(!error) { // written back
+            c->dirty_first = c->dirty_end = 0;
+            written = 1;
+        }
+    }
+    int clean = !error && c->writers == 0 && c->writes == writes; // every write is on the disk
+    if(clean && (written || c->open)) {
+        error = fdatasync(c->fd) ? ERR_IO : 0; // the checksums before the header trusting them
+    }
+    if(!error && (written || (clean && c->open))) {
+        struct csum_header h = { clean ? CSUM_MAGIC : CSUM_MAGIC_OPEN, c->nb_sectors };
+        error = csum_pwrite(c->fd, &h, sizeof(h), 0);
+        c->open = !error && !clean; // unknown header after an error: marked open again by the next write
+    }
+    pthread_mutex_unlock(&(dev->lock));
+    return error;
+}
+
+static uint32_t csum_size(struct bdev *dev)
+{
+    return bdev_size(((struct csum_dev*)dev->priv)->inner);
+}
+
+static int csum_close(struct bdev *dev)
+{
+    struct csum_dev *c = dev->priv;
+    int error = close(c->fd) ? ERR_IO : 0;
+    int innerError = bdev_close(c->inner);
+    free(c->crc);
+    free(c->seq);
+    free(c);
+    return error ? error : innerError;
+}
+
+static const struct bdev_ops csum_ops = {
+    "crc32c", csum_read, csum_write, csum_readv, csum_writev,
+    csum_flush, csum_size, csum_close, NULL
+};
+
+/**
+ * @brief compute the checksums of every sector of the disk; they are all
+ *        marked to be written back
+ * @return 0 on success; <0 on error
+ */
+static int csum_build(struct csum_dev *c)
+{
+    uint32_t size = bdev_size(c->inner);
+    if(size > CSUM_MAX_SECTORS) {
+        return ERR_IO;
+    }
+    uint8_t data[CSUM_SCRUB_CHUNK * SECTOR_SIZE];
+    for(uint32_t s = 0; s < size; s += CSUM_SCRUB_CHUNK) {
+        uint32_t nb = (size - s < CSUM_SCRUB_CHUNK) ? size - s : CSUM_SCRUB_CHUNK;
+        int error = bdev_read(c->inner, s, nb, data);
+        if(error) { // error occured
+            return error; // propagate error
+        }
+        for(uint32_t i = 0; i < nb; i++) {
+            c->crc[s + i] = csum_sector(&data[(size_t)i * SECTOR_SIZE]);
+        }
+    }
+    c->nb_sectors = size;
+    c->dirty_first = 0;
+    c->dirty_end = size;
+    return 0;
+}
+
+/**
+ * @brief load the checksums of the sidecar file
+ * @return 0 on success; <0 on error
+ */
+static int csum_load(struct csum_dev *c)
+{
+    struct csum_header h;
+    if(pread(c->fd, &h, sizeof(h), 0) != sizeof(h) || h.nb_sectors > CSUM_MAX_SECTORS) {
+        return ERR_IO;
+    }
+    if(h.magic == CSUM_MAGIC_OPEN) { // not closed cleanly: the disk may not match the checksums
+        return csum_build(c);
+    }
+    if(h.magic != CSUM_MAGIC) {
+        return ERR_IO;
+    }
+    size_t len = (size_t)h.nb_sectors * sizeof(uint32_t);
+    if(pread(c->fd, c->crc, len, sizeof(h)) != (ssize_t)len) { // truncated sidecar
+        return ERR_IO;
+    }
+    c->nb_sectors = h.nb_sectors;
+    return 0;
+}
+
+struct bdev *csum_open(struct bdev *inner, const char *sidecar, int create)
+{
+    if(inner == NULL || sidecar == NULL) {
+        return NULL;
+    }
+    struct bdev *dev = calloc(1, sizeof(struct bdev));
+    struct csum_dev *c = calloc(1, sizeof(struct csum_dev));
+    uint32_t *crc = calloc(CSUM_MAX_SECTORS, sizeof(uint32_t));
+    uint32_t *seq = calloc(CSUM_MAX_SECTORS, sizeof(uint32_t));
+    if(dev == NULL || c == NULL || crc == NULL || seq == NULL) {
+        free(dev);
+        free(c);
+        free(crc);
+        free(seq);
+        return NULL;
+    }
+    c->inner = inner;
+    c->crc = crc;
+    c->seq = seq;
+    int error = 0;
+    c->fd = open(sidecar, O_RDWR);
+    if(c->fd >= 0) { // existing sidecar
+        error = csum_load(c);
+    } else if(create) {
+        c->fd = open(sidecar, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        error = (c->fd < 0) ? ERR_IO : csum_build(c);
+    } else {
+        error = ERR_IO;
+    }
+
+    dev->ops = &csum_ops;
+    dev->fd = -1; // no io_uring: the reads must be verified
+    dev->priv = c;
+    if(!error && pthread_mutex_init(&(dev->lock), NULL)) {
+        error = ERR_NOMEM;
+    }
+    error = error ? error : csum_flush(dev); // a new sidecar is complete on disk
+    if(error) {
+        if(c->fd >= 0) {
+            close(c->fd);
+        }
+        free(crc);
+        free(seq);
+        free(c);
+        free(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+int csum_is_csum(const struct bdev *dev)
+{
+    return dev != NULL && dev->ops == &csum_ops;
+}
+
+/*
+ * scrub: the threads share the sectors by chunks
+ */
+
+struct csum_scrub {
+    struct csum_dev *c;
+    uint32_t nb_sectors;          // sectors to verify
+    uint32_t next;                // next chunk, accessed atomically
+    pthread_mutex_t lock;         // protects report and error
+    struct csum_report *report;
+    int error;
+};
+
+/**
+ * @brief count one bad sector in the report, which keeps the lowest ones sorted
+ */
+static void csum_scrub_bad(struct csum_scrub *s, uint32_t sector)
+{
+    pthread_mutex_lock(&(s->lock));
+    struct csum_report *r = s->report;
+    uint32_t listed = (r->bad < CSUM_SCRUB_MAX_BAD) ? r->bad : CSUM_SCRUB_MAX_BAD;
+    uint32_t i = listed;
+    for(; i > 0 && r->bad_sectors[i - 1] > sector; i--) { // insertion sort
+        if(i < CSUM_SCRUB_MAX_BAD) {
+            r->bad_sectors[i] = r->bad_sectors[i - 1];
+        }
+    }
+    if(i < CSUM_SCRUB_MAX_BAD) {
+        r->bad_sectors[i] = sector;
+    }
+    r->bad++;
+    pthread_mutex_unlock(&(s->lock));
+}
+
+static void *csum_scrub_worker(void *arg)
+{
+    struct csum_scrub *s = arg;
+    uint8_t data[CSUM_SCRUB_CHUNK * SECTOR_SIZE];
+    uint32_t first;
+    while((first = __atomic_fetch_add(&(s->next), CSUM_SCRUB_CHUNK, __ATOMIC_RELAXED)) < s->nb_sectors) {
+        uint32_t nb = (s->nb_sectors - first < CSUM_SCRUB_CHUNK) ? s->nb_sectors - first : CSUM_SCRUB_CHUNK;
+        int error = bdev_read(s->c->inner, first, nb, data);
+        for(uint32_t i = 0; i < nb; i++) {
+            uint32_t sector = first + i;
+            uint8_t *sdata = &data[(size_t)i * SECTOR_SIZE];
+            if(error) { // one sector at a time: find the unreadable ones
+                int readError = bdev_read(s->c->inner, sector, 1, sdata);
+                if(readError && readError != ERR_IO) { // not a missing sector
+                    pthread_mutex_lock(&(s->lock));
+                    s->error = readError;
+                    pthread_mutex_unlock(&(s->lock));
+                    return NULL;
+                } else if(readError) { // missing sector, e.g. truncated image
+                    csum_scrub_bad(s, sector);
+                    continue;
+                }
+            }
+            if(csum_sector(sdata) != __atomic_load_n(&(s->c->crc[sector]), __ATOMIC_RELAXED)
+               && csum_read_verified(s->c, sector, 1, sdata) == ERR_CHECKSUM) { // not a write in progress
+                csum_scrub_bad(s, sector);
+            }
+        }
+    }
+    return NULL;
+}
+
+int csum_scrub(struct bdev *dev, unsigned int nb_threads, struct csum_report *report)
+{
+    M_REQUIRE_NON_NULL(dev);
+    M_REQUIRE_NON_NULL(report);
+    if(!csum_is_csum(dev)) { // no checksums
+        return ERR_BAD_PARAMETER;
+    }
+    if(nb_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = (cpus > 0) ? cpus : 1;
+    }
+    nb_threads = (nb_threads > CSUM_MAX_THREADS) ? CSUM_MAX_THREADS : nb_threads;
+
+    memset(report, 0, sizeof(*report));
+    struct csum_scrub s = { dev->priv, 0, 0, PTHREAD_MUTEX_INITIALIZER, report, 0 };
+    s.nb_sectors = __atomic_load_n(&(s.c->nb_sectors), __ATOMIC_ACQUIRE);
+
+    pthread_t threads[CSUM_MAX_THREADS];
+    unsigned int started = 0;
+    for(; started < nb_threads; started++) {
+        if(pthread_create(&threads[started], NULL, csum_scrub_worker, &s)) {
+            break; // the threads already started do the work
+        }
+    }
+    if(started == 0) { // no thread at all: scrub in the caller
+        csum_scrub_worker(&s);
+    }
+    for(unsigned int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&(s.lock));
+
+    report->checked = s.nb_sectors;
+    return s.error;
+}
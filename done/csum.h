@@ -0,0 +1,104 @@
+#pragma once
+
+/**
+ * @file csum.h
+ * @brief per-sector CRC32C checksums kept in a sidecar file
+ *
+ * A checksummed disk is a block device stacked on top of another one:
+ * every sector read through it is verified against its CRC32C, every
+ * sector written updates the CRC32C of that sector. The checksums of
+ * the whole disk are kept in memory and the modified ones are written
+ * back to the sidecar file by bdev_flush().
+ *
+ * A sector is written before its checksum: a read overlapping the write
+ * is read again rather than reported, and the sidecar is marked open
+ * from the first write until a flush leaves the disk and the checksums
+ * in agreement. The checksums of a sidecar left open by a crash are
+ * computed again from the disk when it is opened.
+ *
+ * Sidecar file: a struct csum_header followed by one 32-bit CRC32C per
+ * sector, in sector order.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include "bdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CSUM_MAGIC 0x43565655     // "UVVC", first bytes of a sidecar file
+#define CSUM_MAGIC_OPEN 0x4F565655 // "UVVO", same while the disk may be ahead of the checksums
+#define CSUM_MAX_SECTORS 65536    // largest unix v6 disk (s_fsize is 16 bits)
+#define CSUM_SCRUB_MAX_BAD 16     // bad sectors listed by csum_scrub()
+
+struct csum_header {
+    uint32_t magic;               // CSUM_MAGIC, or CSUM_MAGIC_OPEN if not closed cleanly
+    uint32_t nb_sectors;          // number of checksums that follow
+};
+
+/**
+ * @brief result of csum_scrub()
+ */
+struct csum_report {
+    uint32_t checked;                     // number of sectors verified
+    uint32_t bad;                         // number of sectors not matching their checksum
+    uint32_t bad_sectors[CSUM_SCRUB_MAX_BAD]; // the first bad sectors, sorted
+};
+
+/**
+ * @brief CRC32C (Castagnoli) of len bytes; SSE4.2 when the CPU has it,
+ *        slicing-by-8 otherwise
+ * @param crc the CRC32C of the preceding data, 0 to start
+ * @param data the data
+ * @param len the number of bytes
+ * @return the CRC32C of the preceding data followed by data
+ */
+uint32_t csum_crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @brief csum_crc32c() without SSE4.2 (portable slicing-by-8)
+ */
+uint32_t csum_crc32c_sw(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @brief name of the implementation used by csum_crc32c()
+ */
+const char *csum_impl(void);
+
+/**
+ * @brief stack a checksummed device on top of a disk
+ *
+ *        The checksums are loaded from the sidecar file; if it does not
+ *        exist and create is set, they are computed from the content of
+ *        the disk and the sidecar is created. The new device has no
+ *        memory views and no descriptor for io_uring: every sector goes
+ *        through the verification.
+ *
+ * @param inner the disk, owned by the new device on success (closed by bdev_close())
+ * @param sidecar the name of the sidecar file
+ * @param create 1 to create a missing sidecar file
+ * @return the new device or NULL on failure (inner is left open)
+ */
+struct bdev *csum_open(struct bdev *inner, const char *sidecar, int create);
+
+/**
+ * @brief tell whether the device was made by csum_open()
+ */
+int csum_is_csum(const struct bdev *dev);
+
+/**
+ * @brief verify every sector of a checksummed disk, with several threads;
+ *        it reads the disk itself: sectors still dirty in a cache above
+ *        are verified as they were last written (sync first to include them)
+ * @param dev the device made by csum_open()
+ * @param nb_threads the number of threads, 0 for one per CPU
+ * @param report the number of sectors verified and the bad sectors (OUT)
+ * @return 0 on success (even if bad sectors are found); <0 on error
+ */
+int csum_scrub(struct bdev *dev, unsigned int nb_threads, struct csum_report *report);
+
+#ifdef __cplusplus
+}
+#endif
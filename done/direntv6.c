@@ -261,7 +261,7 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
     } while(read > 0);
 
     // no child with the specified child name
-    int childInr = inode_alloc(u); // allocate a new inode for the child
+    int childInr = inode_alloc(u, parentInr); // allocate a new inode for the child, in the inode sectors of its parent if possible
     if(childInr < 0) { // couldn't allocate an inode
         return childInr; // propagate error
     }
@@ -271,12 +271,14 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
     childInode.i_mode = mode; // correctly set the i_mode
     error = inode_write(u, childInr, &childInode); // write child
     if(error) { // error occured
+        mountv6_bm_failed(u); // the inode stays allocated
         return error; // propagate error
     }
 
     struct filev6 fv6_parent;
     error = filev6_open(u, parentInr, &fv6_parent);
     if(error) { // error occured
+        mountv6_bm_failed(u);
         return error; // propagate error
     }
 
@@ -285,6 +287,7 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
     strncpy(childDir.d_name, child, DIRENT_MAXLEN); // copy child name
     error = filev6_writebytes(u, &(fv6_parent), &childDir, sizeof(struct direntv6)); // write child to directory
     if(error) { // error occured
+        mountv6_bm_failed(u);
         return error; // propagate error
     }
 
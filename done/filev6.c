@@ -1,12 +1,79 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "inode.h"
 #include "filev6.h"
 #include "sector.h"
+#include "bcache.h"
+#include "icache.h"
 #include "error.h"
 #include "bmblock.h"
 
-int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char *buf, int len, int offset);
+/**
+ * @brief data and indirect sectors reserved by filev6_writebytes(), taken
+ *        in order by filev6_writesector(); the data sectors come first so
+ *        that they are contiguous. The sectors found one at a time, when
+ *        the reservation is used up, are recorded so that all the sectors
+ *        of a failed write can be freed
+ */
+struct filev6_extent {
+    uint32_t data;      // next reserved data sector
+    uint32_t nb_data;   // number of data sectors left
+    uint32_t ind;       // next reserved indirect sector
+    uint32_t nb_ind;    // number of indirect sectors left
+    uint32_t goal;      // where a sector found one at a time is searched from
+    uint32_t first;     // first reserved sector
+    uint32_t nb;        // number of reserved sectors
+    uint32_t *found;    // sectors found one at a time (malloc'd)
+    uint32_t nb_found;  // number of them
+    uint32_t max_found; // room in found
+};
+
+int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char *buf, int len, int offset,
+                       struct filev6_extent *ext);
+
+/**
+ * @brief forget what the readahead buffers hold (after the file is modified)
+ */
+static void filev6_ra_invalidate(struct filev6 *fv6)
+{
+    (fv6->ra).count = 0;
+}
+
+/**
+ * @brief set up the readahead state of a file of the given filesystem
+ */
+static void filev6_ra_init(struct filev6 *fv6, const struct unix_filesystem *u)
+{
+    struct filev6_readahead *ra = &(fv6->ra);
+    ra->max = (u->readahead < 0) ? 0 : (uint32_t)u->readahead; // <0: disabled
+    if(ra->max == 0 && u->readahead == 0) { // default
+        ra->max = FILEV6_RA_MAX;
+    }
+    if(ra->max > FILEV6_RA_MAX) { // buf holds FILEV6_RA_MAX sectors
+        ra->max = FILEV6_RA_MAX;
+    }
+    ra->window = 0;
+    ra->next = 0; // a read from the start of the file is sequential
+    ra->hits = 0;
+    ra->misses = 0;
+    ra->prefetched = 0;
+    filev6_ra_invalidate(fv6);
+}
+
+int filev6_map_range(struct filev6 *fv6, int32_t first_off, uint32_t max_count, uint32_t *phys_start, uint32_t *run_len)
+{
+    M_REQUIRE_NON_NULL(fv6);
+    return icache_map_range(fv6->u, fv6->i_number, &(fv6->i_node), first_off, max_count, phys_start, run_len);
+}
+
+int filev6_findsector(struct filev6 *fv6, int32_t file_sec_off)
+{
+    uint32_t sector = 0;
+    uint32_t run = 0;
+    int error = filev6_map_range(fv6, file_sec_off, 1, &sector, &run);
+    return error ? error : (int)sector;
+}
 
 int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv6)
 {
@@ -24,45 +91,141 @@ int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv
     fv6->u = u;
     fv6->i_number = inr;
     fv6->offset = 0;
+    filev6_ra_init(fv6, u);
 
     return 0;
 }
 
 int filev6_readblock(struct filev6 *fv6, void *buf)
 {
-    M_REQUIRE_NON_NULL(fv6);
-    M_REQUIRE_NON_NULL(buf);
+    return filev6_readblocks(fv6, buf, 1);
+}
 
+/**
+ * @brief read count sectors of the file from the given offset, without
+ *        the readahead buffer; sectors which are contiguous on disk are
+ *        read with a single I/O and up to FILEV6_READ_RUNS such I/Os are
+ *        in flight together
+ * @param fv6 the file (its offset is not used nor changed)
+ * @param offset the offset of the first sector, in bytes
+ * @param data a pointer to count * 512-bytes of memory (OUT)
+ * @param count the maximal number of sectors to read
+ * @return the number of sectors read (0 at the end of the file); <0 on error
+ */
+static int filev6_fetch(struct filev6 *fv6, uint32_t offset, uint8_t *data, int count)
+{
     uint32_t size = inode_getsize(&(fv6->i_node));
+    int done = 0; // number of sectors read
+    struct aio_req runs[FILEV6_READ_RUNS]; // runs found but not yet read
+    size_t nb = 0;
+
+    while(done < count && offset < size) {
+        /* the sectors contiguous on disk from the offset on */
+        uint32_t first = 0;
+        uint32_t run = 0;
+        int error = filev6_map_range(fv6, offset / SECTOR_SIZE, count - done, &first, &run);
+        if(error) { // an error occured while finding the sectors
+            return error; // propagate error
+        }
+        uint32_t remainingBytes = size - offset;
 
-    if(fv6->offset >= size) {
-        return 0;
-    } else {
-        /* sector to read from */
-        int sector = inode_findsector(fv6->u, &(fv6->i_node), fv6->offset / SECTOR_SIZE);
+        const void *view = bcache_view(fv6->u->cache, first);
+        for(uint32_t r = 1; view != NULL && r < run; r++) { // the whole run must be mapped and clean
+            if(bcache_view(fv6->u->cache, first + r) == NULL) {
+                view = NULL;
+            }
+        }
+        if(view != NULL) {
+            memcpy(&(data[done * SECTOR_SIZE]), view, run * SECTOR_SIZE); // copy straight from the mapping
+        } else { // read later, together with the other runs
+            runs[nb] = (struct aio_req) { first, run, &(data[done * SECTOR_SIZE]), 0, 0 };
+            nb++;
+        }
 
-        /* an error occured while finding the sector */
-        if(sector < 0) {
-            return sector; // propagate error
-        } else {
-            int error = sector_read((fv6->u)->f, sector, buf);
+        uint32_t bytes = (remainingBytes < run * SECTOR_SIZE) ? remainingBytes : run * SECTOR_SIZE;
+        offset += bytes;
+        done += run;
 
-            /* an error occured while reading the sector */
+        /* read the pending runs when the batch is full or complete */
+        if(nb == FILEV6_READ_RUNS || (nb > 0 && !(done < count && offset < size))) {
+            error = bcache_read_runs((fv6->u)->cache, (fv6->u)->aio, runs, nb);
+            /* an error occured while reading the sectors */
             if(error) {
                 return error;
-            } else {
-
-                uint32_t remainingBytes = size - fv6->offset;
-                if(remainingBytes < SECTOR_SIZE) {
-                    fv6->offset += remainingBytes;
-                    return remainingBytes;
-                } else {
-                    fv6->offset += SECTOR_SIZE;
-                    return SECTOR_SIZE;
+            }
+            nb = 0;
+        }
+    }
+    return done;
+}
+
+int filev6_readblocks(struct filev6 *fv6, void *buf, int count)
+{
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(buf);
+    if(count < 0) { // negative number of sectors
+        return ERR_BAD_PARAMETER;
+    }
+
+    struct filev6_readahead *ra = &(fv6->ra);
+    uint32_t size = inode_getsize(&(fv6->i_node));
+    uint8_t *data = buf;
+    int total = 0; // number of bytes read
+    int done = 0; // number of sectors read
+    // readahead hides I/O: nothing to hide with a backend serving views
+    int readahead = ra->max > 0 && ((fv6->u)->dev == NULL || (fv6->u)->dev->ops->view == NULL);
+
+    while(done < count && (uint32_t)fv6->offset < size) { // the offset is never negative (filev6_lseek())
+        int32_t sector = fv6->offset / SECTOR_SIZE; // sector of the file at the cursor
+        uint32_t want = count - done; // sectors still requested
+        int n = 0; // sectors read at this step
+        uint32_t demanded = 0; // sectors of the buffer just read on demand (not hits)
+
+        if(!(readahead && ra->count > 0 && sector >= ra->first && (uint32_t)(sector - ra->first) < ra->count)) {
+            /* not in the buffer: adapt the window to the access pattern */
+            if(sector == ra->next) { // sequential: grow the window
+                ra->window = (ra->window == 0) ? FILEV6_RA_MIN : 2 * ra->window;
+                ra->window = (ra->window > ra->max) ? ra->max : ra->window;
+            } else { // random: no readahead until the next sequential read
+                ra->window = 0;
+            }
+
+            if(!readahead || ra->window <= want) { // no readahead, or the caller reads more: straight into buf
+                n = filev6_fetch(fv6, fv6->offset, &(data[done * SECTOR_SIZE]), want);
+                if(n <= 0) { // error or end of file
+                    return (n < 0) ? n : total;
                 }
+                ra->misses += n;
+            } else { // fill the buffer with the window
+                n = filev6_fetch(fv6, fv6->offset, ra->buf, ra->window);
+                if(n <= 0) { // error or end of file
+                    ra->count = 0;
+                    return (n < 0) ? n : total;
+                }
+                ra->first = sector;
+                ra->count = n;
+                demanded = ((uint32_t)n < want) ? (uint32_t)n : want;
+                ra->misses += demanded;
+                ra->prefetched += n - demanded;
+                n = 0; // served from the buffer below
             }
         }
+
+        if(n == 0) { // serve from the buffer
+            uint32_t index = sector - ra->first; // first sector of the buffer to copy
+            n = (ra->count - index < want) ? ra->count - index : want;
+            memcpy(&(data[done * SECTOR_SIZE]), &(ra->buf[index * SECTOR_SIZE]), n * SECTOR_SIZE);
+            ra->hits += n - ((demanded < (uint32_t)n) ? demanded : (uint32_t)n);
+        }
+
+        uint32_t remainingBytes = size - fv6->offset;
+        uint32_t bytes = (remainingBytes < (uint32_t)n * SECTOR_SIZE) ? remainingBytes : (uint32_t)n * SECTOR_SIZE;
+        fv6->offset += bytes;
+        total += bytes;
+        done += n;
+        ra->next = sector + n;
     }
+    return total;
 }
 
 int filev6_lseek(struct filev6 *fv6, int32_t offset)
@@ -71,7 +234,7 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset)
 
     uint32_t size = inode_getsize(&(fv6->i_node)); // size of file
 
-    if(offset > size) { // offset out of range
+    if(offset < 0 || (uint32_t)offset > size) { // offset out of range
         return ERR_OFFSET_OUT_OF_RANGE; // return error
     }
 
@@ -84,6 +247,10 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6)
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(fv6);
 
+    int error = mountv6_bitmaps(u); // not built yet by a lazy mount
+    if(error) { // error occured
+        return error; // propagate error
+    }
     int bit = bm_get(u->ibm, fv6->i_number); // get corresponding bit
     if(bit < 0) { // inode is not in the [min;max] range
         return bit; // propagate error
@@ -94,8 +261,9 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6)
 
     memset(&(fv6->i_node), 0, sizeof(struct inode)); // set all values to zero
     (fv6->i_node).i_mode = mode; // correctly set the i_mode
+    filev6_ra_init(fv6, u);
 
-    int error = inode_write(u, fv6->i_number, &(fv6->i_node)); // write the inode
+    error = inode_write(u, fv6->i_number, &(fv6->i_node)); // write the inode
     if(error) { // error occured
         return error; // propagate error
     }
@@ -103,6 +271,99 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6)
     return 0;
 }
 
+/**
+ * @brief number of indirect sectors of a file of nb data sectors, with the
+ *        double-indirect sector of a huge file
+ */
+static uint32_t filev6_nb_indirect(uint32_t nb)
+{
+    return (nb <= ADDR_SMALL_LENGTH) ? 0 : nb / ADDRESSES_PER_SECTOR + (nb % ADDRESSES_PER_SECTOR == 0 ? 0 : 1)
+           + (nb > ADDR_LARGE_SECTORS ? 1 : 0);
+}
+
+/**
+ * @brief the sector the new sectors of a file are searched from: the one
+ *        after its last sector or, for an empty file, the start of the
+ *        allocation group of its inode (mountv6_group_goal())
+ * @param used the number of data sectors of the file
+ */
+static uint32_t filev6_goal(const struct unix_filesystem *u, struct filev6 *fv6, uint32_t used)
+{
+    if(used > 0) { // after the last sector of the file
+        int last = filev6_findsector(fv6, used - 1);
+        if(last >= 0 && (uint64_t)last + 1 <= (u->fbm)->max) {
+            return last + 1;
+        }
+    }
+    return mountv6_group_goal(u, fv6->i_number);
+}
+
+/**
+ * @brief reserve in one run the data and indirect sectors needed to append
+ *        len bytes to the file, from its goal (filev6_goal()); nothing is
+ *        reserved if there is no such run (the sectors are then found one
+ *        at a time, from the goal)
+ * @param ext the reserved sectors and the goal (OUT)
+ */
+static void filev6_reserve(struct unix_filesystem *u, struct filev6 *fv6, int len, struct filev6_extent *ext)
+{
+    uint32_t size = inode_getsize(&(fv6->i_node)); // file size
+    uint32_t used = size / SECTOR_SIZE + ((size % SECTOR_SIZE == 0) ? 0 : 1); // data sectors of the file
+    *ext = (struct filev6_extent) { 0, 0, 0, 0, filev6_goal(u, fv6, used), 0, 0, NULL, 0, 0 };
+    if(len <= 0 || (uint32_t)len > INODE_MAX_SIZE - size) { // nothing to write, or the file becomes too large
+        return;
+    }
+
+    uint32_t needed = (size + len) / SECTOR_SIZE + (((size + len) % SECTOR_SIZE == 0) ? 0 : 1); // after the write
+    uint32_t nb_data = needed - used;
+    uint32_t nb_ind = filev6_nb_indirect(needed) - filev6_nb_indirect(used);
+    if(nb_data + nb_ind == 0) { // the last sector has room for len bytes
+        return;
+    }
+
+    int first = mountv6_alloc_sectors(u, nb_data + nb_ind, ext->goal); // found and set at once
+    if(first < 0) { // no run long enough
+        return;
+    }
+    *ext = (struct filev6_extent) { first, nb_data, first + nb_data, nb_ind, ext->goal, first, nb_data + nb_ind, NULL, 0, 0 };
+}
+
+/**
+ * @brief take the next reserved data or indirect sector, or find the next
+ *        free one from the goal (see mountv6_alloc_sectors()) if none is
+ *        left; the goal moves after the sector
+ * @param ext the reservation (IN-OUT)
+ * @param indirect 1 for an indirect sector, 0 for a data sector
+ * @return the sector, now allocated; <0 on error
+ */
+static int filev6_alloc(struct unix_filesystem *u, struct filev6_extent *ext, int indirect)
+{
+    uint32_t *next = indirect ? &(ext->ind) : &(ext->data);
+    uint32_t *left = indirect ? &(ext->nb_ind) : &(ext->nb_data);
+    int sector = 0;
+    if(*left > 0) {
+        (*left)--;
+        sector = (*next)++;
+    } else {
+        if(ext->nb_found == ext->max_found) { // room to record one more sector
+            uint32_t max = (ext->max_found == 0) ? 16 : 2 * ext->max_found;
+            uint32_t *found = realloc(ext->found, max * sizeof(uint32_t));
+            if(found == NULL) { // no memory
+                return ERR_NOMEM;
+            }
+            ext->found = found;
+            ext->max_found = max;
+        }
+        sector = mountv6_alloc_sectors(u, 1, ext->goal); // the next free sector from the goal, now allocated
+        if(sector < 0) { // no free sector
+            return sector; // propagate error
+        }
+        ext->found[ext->nb_found++] = sector;
+    }
+    ext->goal = ((uint64_t)sector < (u->fbm)->max) ? (uint32_t)sector + 1 : (uint32_t)sector; // the file goes on after it
+    return sector;
+}
+
 int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len)
 {
     M_REQUIRE_NON_NULL(u);
@@ -112,39 +373,99 @@ int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void
         return ERR_BAD_PARAMETER; // return error
     }
 
+    int error = mountv6_bitmaps(u); // not built yet by a lazy mount
+    if(error) { // error occured
+        return error; // propagate error
+    }
     int written = 0; // number of bytes written
     uint32_t size = inode_getsize(&(fv6->i_node)); // file size
+    struct inode before = fv6->i_node; // the file is left as it was if the write fails
+    struct filev6_extent ext;
+    filev6_reserve(u, fv6, len, &ext); // all the new sectors at once, if possible
+    filev6_ra_invalidate(fv6); // the content changes; the block map is dropped by inode_write()
 
-    while(written < len) { // keep writing sectors untill writing the full buffer
-        int nbWritten = filev6_writesector(u, fv6, buf, len, written);
+    while(!error && written < len) { // keep writing sectors untill writing the full buffer
+        int nbWritten = filev6_writesector(u, fv6, buf, len, written, &ext);
         if(nbWritten < 0) { // error occured
-            return nbWritten; // propagate error
+            error = nbWritten;
+            break;
         }
         written += nbWritten; // update total written bytes
         size += nbWritten; // update size
-        int error = inode_setsize(&(fv6->i_node), size); // update inode size
-        if(error) { // an error occured
-            return error; // propagate error
+        error = inode_setsize(&(fv6->i_node), size); // update inode size
+    }
+    if(error) { // nothing refers to the new sectors: all of them are freed
+        mountv6_bm_failed(u); // and the next mount checks the bitmaps anyway
+        fv6->i_node = before;
+        mountv6_free_sectors(u, ext.first, ext.nb);
+        for(uint32_t i = 0; i < ext.nb_found; i++) {
+            mountv6_free_sectors(u, ext.found[i], 1);
         }
+    } else { // reserved sectors not used
+        mountv6_free_sectors(u, ext.data, ext.nb_data);
+        mountv6_free_sectors(u, ext.ind, ext.nb_ind);
+    }
+    free(ext.found);
+    if(error) { // an error occured
+        return error; // propagate error
     }
     // finished writing file content
-    int error = inode_write(u, fv6->i_number, &(fv6->i_node)); // write inode to update size and addresses array
+    error = inode_write(u, fv6->i_number, &(fv6->i_node)); // write inode to update size and addresses array
     if(error) { // error occured
         return error; // propagate error
     }
     return 0;
 }
 
-int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char *buf, int len, int offset)
+/**
+ * @brief record the indirect sector of a new part of a large file: in
+ *        i_addr[0..6], or in the double-indirect sector i_addr[7], which
+ *        is allocated with the first part of a huge file
+ * @param part the index of the part, i.e. of its indirect sector
+ * @param ind the indirect sector
+ * @return 0 on success; <0 on error
+ */
+static int filev6_set_indirect(struct unix_filesystem *u, struct filev6 *fv6, uint32_t part, uint16_t ind,
+                               struct filev6_extent *ext)
+{
+    if(part < ADDR_SMALL_LENGTH - 1) { // in the inode
+        (fv6->i_node).i_addr[part] = ind;
+        return 0;
+    }
+
+    uint16_t indirect[ADDRESSES_PER_SECTOR]; // the double-indirect sector
+    memset(indirect, 0, sizeof(indirect));
+    int error = 0;
+    if(part == ADDR_SMALL_LENGTH - 1) { // the file becomes huge
+        int dind = filev6_alloc(u, ext, 1); // next indirect sector
+        if(dind < 0) { // no free sector
+            return dind; // propagate error
+        }
+        (fv6->i_node).i_addr[ADDR_SMALL_LENGTH - 1] = dind;
+    } else {
+        error = bcache_read(u->cache, (fv6->i_node).i_addr[ADDR_SMALL_LENGTH - 1], indirect);
+    }
+    if(!error) {
+        indirect[part - (ADDR_SMALL_LENGTH - 1)] = ind;
+        error = bcache_write(u->cache, (fv6->i_node).i_addr[ADDR_SMALL_LENGTH - 1], indirect);
+    }
+    return error;
+}
+
+int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char *buf, int len, int offset,
+                       struct filev6_extent *ext)
 {
     uint32_t size = inode_getsize(&(fv6->i_node)); // file size
     uint32_t smallFileMaxSize = ADDR_SMALL_LENGTH * SECTOR_SIZE; // small file is 8 * 512 bytes = 4 Kbytes
-    uint32_t largeFileMaxSize = (ADDR_SMALL_LENGTH - 1) * ADDRESSES_PER_SECTOR * SECTOR_SIZE; // large file is 7 * 256 * 512 bytes = 896 Kbytes
     uint32_t remaining = SECTOR_SIZE - (size % SECTOR_SIZE); // remaining bytes in last occupied sector
 
     // nb_bytes is the minimum between the remaining bytes and the number
     //of bytes to be written = len - offset
-    uint32_t nb_bytes = (remaining < (len - offset)) ? remaining : (len - offset); // number of bytes to be written
+    uint32_t left = len - offset; // offset < len
+    uint32_t nb_bytes = (remaining < left) ? remaining : left; // number of bytes to be written
+    if(size < INODE_MAX_SIZE && nb_bytes > INODE_MAX_SIZE - size) { // the size is on 24 bits
+        nb_bytes = INODE_MAX_SIZE - size;
+    }
 
     char block[SECTOR_SIZE]; // the block to be written
     memset(block, 0, SECTOR_SIZE); // initialize block
@@ -153,51 +474,49 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char
     if(size < smallFileMaxSize) {
         int sector = 0; //sector number
         if(size % SECTOR_SIZE == 0) { // file size is a multiple of SECTOR_SIZE
-            sector = bm_find_next(u->fbm); // find next free sector number
+            sector = filev6_alloc(u, ext, 0); // next data sector
             if(sector < 0) { // no free sector
                 return sector; // propagate error
             }
-            bm_set(u->fbm, sector); // set the data sector to be allocated
             memcpy(block, &(buf[offset]), nb_bytes); // copy bytes to be written (starting from offset)
             uint16_t addressIndex = size / SECTOR_SIZE; // index of the new sector number in inode's addresses
             (fv6->i_node).i_addr[addressIndex] = sector; // add the new sector number to the array
         } else { // file size is not a multiple of SECTOR_SIZE
             uint16_t addressIndex = size / SECTOR_SIZE; // index of the last sector number in inode's addresses
             sector = (fv6->i_node).i_addr[addressIndex]; // last sector in the file
-            error = sector_read(u->f, sector, block); // read sector
+            error = bcache_read(u->cache, sector, block); // read sector
             if(error) { // error occured
                 return error; // propagate error
             }
             uint32_t nextByteIndex = size % SECTOR_SIZE; // index inside the block of the next byte to be written to block
             memcpy(&(block[nextByteIndex]), &(buf[offset]), nb_bytes); // write subsequently nb_bytes to the block
         }
-        error = sector_write(u->f, sector, block); // write block
+        error = bcache_write(u->cache, sector, block); // write block
         if(error) { // an error occured
             return error; // propagate error
         }
         return nb_bytes; // return number of bytes written*/
-    } else if(size < largeFileMaxSize) { // file is a large File
+    } else if(size < INODE_MAX_SIZE) { // file is a large File, huge beyond ADDR_LARGE_SECTORS sectors
 
         uint16_t sector[ADDRESSES_PER_SECTOR]; // undirect sector
-        memset(sector, 0, ADDRESSES_PER_SECTOR); // initialize sector
+        memset(sector, 0, sizeof(sector)); // initialize sector
         int undirectSector = 0; //undirect sector number
         int directSector = 0; //direct sector number
 
         if(size == smallFileMaxSize) {
             memcpy(sector, (fv6->i_node).i_addr, ADDR_SMALL_LENGTH * ADDRESS_SIZE); // copy direct addresses to the undirect sector
 
-            undirectSector = bm_find_next(u->fbm); // find next free sector number
+            undirectSector = filev6_alloc(u, ext, 1); // next indirect sector
             if(undirectSector < 0) { // no free sector
                 return undirectSector; // propagate error
             }
-            bm_set(u->fbm, undirectSector); // set the undirect sector to be allocated
-            memset((fv6->i_node).i_addr, 0, ADDR_SMALL_LENGTH); // set array values to 0
+            memset((fv6->i_node).i_addr, 0, sizeof((fv6->i_node).i_addr)); // set array values to 0
             (fv6->i_node).i_addr[0] = undirectSector; // add the first undirect sector number to the array
-            error = sector_write(u->f, undirectSector, sector); // write undirect sector
+            error = bcache_write(u->cache, undirectSector, sector); // write undirect sector
             if(error) { // an error occured
                 return error; // propagate error
             }
-            memset(sector, 0, ADDRESSES_PER_SECTOR); // initialize sector
+            memset(sector, 0, sizeof(sector)); // initialize sector
         }
 
         uint16_t usedDataSectorsNb = size / SECTOR_SIZE + ((size % SECTOR_SIZE == 0) ? 0 : 1); // number of used sectors by file
@@ -209,38 +528,38 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char
         if(size % SECTOR_SIZE == 0) { // last direct sector full
 
             if(size % (ADDRESSES_PER_SECTOR * SECTOR_SIZE) == 0) { // last undirect sector full, create a new indirect sector
-                undirectSector = bm_find_next(u->fbm); // find next free undirect sector number
+                undirectSector = filev6_alloc(u, ext, 1); // next indirect sector
                 if(undirectSector < 0) { // no free sector
                     return undirectSector; // propagate error
                 }
-                bm_set(u->fbm, undirectSector); // set the undirect sector to be allocated
 
-                directSector = bm_find_next(u->fbm); // find next free direct sector number
+                directSector = filev6_alloc(u, ext, 0); // next data sector
                 if(directSector < 0) { // no free sector
                     return directSector; // propagate error
                 }
-                bm_set(u->fbm, directSector); // set the direct sector to be allocated
 
                 sector[0] = directSector; // add the new direct sector number to the indirect sector
 
-                (fv6->i_node).i_addr[lastUndirectSectorIndex+1] = undirectSector; // add the new undirect sector number to the array of addresses
+                error = filev6_set_indirect(u, fv6, lastUndirectSectorIndex+1, undirectSector, ext); // add the new undirect sector number to the addresses
+                if(error) { // an error occured
+                    return error; // propagate error
+                }
             } else { // last undirect sector still not full
-                undirectSector = (fv6->i_node).i_addr[lastUndirectSectorIndex]; // last undirect sector number
-                error = sector_read(u->f, undirectSector, sector); // read undirect sector
+                undirectSector = inode_indirect(u, &(fv6->i_node), lastSectorOffset); // last undirect sector number
+                error = (undirectSector < 0) ? undirectSector : bcache_read(u->cache, undirectSector, sector); // read undirect sector
                 if(error) { // error occured
                     return error; // propagate error
                 }
 
-                directSector = bm_find_next(u->fbm); // find next free direct sector number
+                directSector = filev6_alloc(u, ext, 0); // next data sector
                 if(directSector < 0) { // no free sector
                     return directSector; // propagate error
                 }
-                bm_set(u->fbm, directSector); // set the direct sector to be allocated
 
                 sector[lastDirectSectorIndex+1] = directSector; // add the new direct sector number to the indirect sector
             }
 
-            error = sector_write(u->f, undirectSector, sector); // write undirect sector
+            error = bcache_write(u->cache, undirectSector, sector); // write undirect sector
             if(error) { // an error occured
                 return error; // propagate error
             }
@@ -248,13 +567,13 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char
             memcpy(block, &(buf[offset]), nb_bytes); // copy bytes to be written (starting from offset)
 
         } else { // last direct sector not full
-            undirectSector = (fv6->i_node).i_addr[lastUndirectSectorIndex]; // last undirect sector number
-            error = sector_read(u->f, undirectSector, sector); // read undirect sector
+            undirectSector = inode_indirect(u, &(fv6->i_node), lastSectorOffset); // last undirect sector number
+            error = (undirectSector < 0) ? undirectSector : bcache_read(u->cache, undirectSector, sector); // read undirect sector
             if(error) { // error occured
                 return error; // propagate error
             }
             directSector = sector[lastDirectSectorIndex]; // last direct sector number
-            error = sector_read(u->f, directSector, block); // read direct sector
+            error = bcache_read(u->cache, directSector, block); // read direct sector
             if(error) { // error occured
                 return error; // propagate error
             }
@@ -262,7 +581,7 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const char
             memcpy(&(block[nextByteIndex]), &(buf[offset]), nb_bytes); // write subsequently nb_bytes to the block
         }
 
-        error = sector_write(u->f, directSector, block); // write direct sector
+        error = bcache_write(u->cache, directSector, block); // write direct sector
         if(error) { // an error occured
             return error; // propagate error
         }
@@ -15,15 +15,39 @@
 extern "C" {
 #endif
 
+#define FILEV6_READ_RUNS 32 // max. number of runs of contiguous sectors submitted together by filev6_readblocks()
+#define FILEV6_RA_MIN 4     // first readahead window, in sectors
+#define FILEV6_RA_MAX 32    // largest readahead window, in sectors (size of the buffer of a file)
+
+/**
+ * @brief readahead state of an open file: once sequential reads are seen,
+ *        the upcoming sectors are read ahead into buf, with a window
+ *        doubling from FILEV6_RA_MIN up to max
+ */
+struct filev6_readahead {
+    uint32_t max;                        // largest window of this file, in sectors; 0 disables readahead
+    uint32_t window;                     // current window, 0 until a sequential read is seen
+    int32_t next;                        // sector of the file expected by a sequential read
+    int32_t first;                       // first sector of the file held in buf
+    uint32_t count;                      // number of sectors held in buf
+    uint64_t hits;                       // sectors served from buf
+    uint64_t misses;                     // sectors read on demand
+    uint64_t prefetched;                 // sectors read ahead
+    uint8_t buf[FILEV6_RA_MAX * SECTOR_SIZE];
+};
+
 struct filev6 {
     const struct unix_filesystem *u;     // the filesystem
     uint16_t i_number;                   // the inode number (on disk)
     struct inode i_node;                 // the content of the inode
     int32_t offset;                      // the current cursor within the file (in bytes)
+    struct filev6_readahead ra;          // readahead state, set up by filev6_open()
 };
 
 /**
  * @brief open the file corresponding to a given inode; set offset to zero
+ *        and the largest readahead window to the one of the mount
+ *        (fv6->ra.max may then be changed for this file)
  * @param u the filesystem (IN)
  * @param inr the inode number (IN)
  * @param fv6 the complete filve6 data structure (OUT)
@@ -40,7 +64,31 @@ int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv
 int filev6_lseek(struct filev6 *fv6, int32_t offset);
 
 /**
- * @brief read at most SECTOR_SIZE from the file at the current cursor
+ * @brief longest run of consecutive sectors on disk of the file from the
+ *        given offset, as inode_map_range(), but the indirect sectors of
+ *        a large file are read once into the block map of its inode
+ *        (icache_map_range()), kept between opens
+ * @param fv6 the filev6 (IN)
+ * @param first_off the offset in the file, in sectors
+ * @param max_count the maximal length of the run, >0
+ * @param phys_start the first sector of the run (OUT)
+ * @param run_len the number of sectors of the run (OUT)
+ * @return 0 on success; <0 on error
+ */
+int filev6_map_range(struct filev6 *fv6, int32_t first_off, uint32_t max_count, uint32_t *phys_start, uint32_t *run_len);
+
+/**
+ * @brief sector of the file at the given offset, as inode_findsector(),
+ *        from the block map as filev6_map_range()
+ * @param fv6 the filev6 (IN)
+ * @param file_sec_off the offset in the file, in sectors
+ * @return the sector; <0 on error
+ */
+int filev6_findsector(struct filev6 *fv6, int32_t file_sec_off);
+
+/**
+ * @brief read at most SECTOR_SIZE from the file at the current cursor;
+ *        sequential reads are served from the readahead buffer
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
  * @param buf points to SECTOR_SIZE bytes of available memory (OUT)
  * @return >0: the number of bytes of the file read; 0: end of file;
@@ -48,6 +96,19 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset);
  */
 int filev6_readblock(struct filev6 *fv6, void *buf);
 
+/**
+ * @brief read at most count * SECTOR_SIZE from the file at the current cursor;
+ *        same as count successive calls to filev6_readblock(), except that
+ *        sectors which are contiguous on disk are read with a single I/O and
+ *        that up to FILEV6_READ_RUNS such I/Os are in flight together
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to count * SECTOR_SIZE bytes of available memory (OUT)
+ * @param count the maximal number of sectors to read
+ * @return >0: the number of bytes of the file read; 0: end of file;
+ *             the appropriate error code (<0) on error
+ */
+int filev6_readblocks(struct filev6 *fv6, void *buf, int count);
+
 /**
  * @brief create a new filev6
  * @param u the filesystem (IN)
@@ -63,7 +124,8 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6);
  * @param fv6 the filev6 (IN)
  * @param buf the data we want to write (IN)
  * @param len the length of the bytes we want to write
- * @return 0 on success; <0 on errror
+ * @return 0 on success; <0 on errror, in which case the file is left as it
+ *         was and the sectors allocated for the write are freed
  */
 int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len);
 
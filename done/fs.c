@@ -20,6 +20,8 @@
 #include "direntv6.h"
 #include "inode.h"
 #include "filev6.h"
+#include "sector.h"
+#include "bcache.h"
 
 
 /* From https://github.com/libfuse/libfuse/wiki/Option-Parsing.
@@ -123,6 +125,51 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     return 0;
 }
 
+/**
+ * @brief copy at most size bytes of the file, from its current offset, to buf
+ *        using bcache_view() only
+ * @param fv6 the opened file (IN-OUT; offset will be changed)
+ * @param buf the buffer of data (OUT)
+ * @param size the max size to be read
+ * @return the number of bytes copied; <0 if a sector is not mapped or on error
+ */
+static int fs_read_views(struct filev6 *fv6, char *buf, size_t size)
+{
+    int32_t fileSize = inode_getsize(&(fv6->i_node)); // size of the file
+    size_t copied = 0; // number of bytes copied to buf
+
+    while(copied < size && fv6->offset < fileSize) { // loop while can still read and didn't read max size
+        size_t inSector = fv6->offset % SECTOR_SIZE; // position of the offset within the sector
+        uint32_t wanted = (inSector + size - copied + SECTOR_SIZE - 1) / SECTOR_SIZE; // sectors left to copy
+        uint32_t first = 0;
+        uint32_t run = 0;
+        int error = filev6_map_range(fv6, fv6->offset / SECTOR_SIZE, wanted, &first, &run); // contiguous sectors, indirect sectors read once
+        if(error) { // error occured
+            return error; // propagate error
+        }
+        const char *view = bcache_view(fv6->u->cache, first);
+        if(view == NULL) { // sector not mapped
+            return ERR_IO; // let the caller read it
+        }
+        for(uint32_t r = 1; r < run; r++) { // the run is copied at once while its views follow each other
+            if(bcache_view(fv6->u->cache, first + r) != view + r * SECTOR_SIZE) {
+                run = r;
+            }
+        }
+        size_t bytes = run * SECTOR_SIZE - inSector; // bytes left in the run
+        if(bytes > (size_t)(fileSize - fv6->offset)) { // last sector of the file
+            bytes = fileSize - fv6->offset;
+        }
+        if(bytes > size - copied) { // buf is full
+            bytes = size - copied;
+        }
+        memcpy(&(buf[copied]), &(view[inSector]), bytes);
+        copied += bytes;
+        fv6->offset += bytes;
+    }
+    return copied;
+}
+
 /**
  * @brief fills the given buffer with the data from the file in the given path
  * @param path path of a file in the unix filesystem
@@ -157,6 +204,14 @@ static int fs_read(const char *path, char *buf, size_t size, off_t offset,
         return 0; // return 0 to signal error (no byte read to buf)
     }
 
+    if(fs.dev->ops->view != NULL) { // disk in memory: copy straight from the sector views to buf
+        int copied = fs_read_views(&fv6, buf, size);
+        if(copied >= 0) { // all sectors were mapped
+            return copied;
+        }
+        fv6.offset = offset; // some sector beyond the mapping: read with copies below
+    }
+
     size_t blocksToRead = size / SECTOR_SIZE + (size < SECTOR_SIZE ? 0 : 1); // to always read block by block, 1 if have to read less than one block
     size_t bytesToRead = blocksToRead * SECTOR_SIZE; // number of bytes to read
     unsigned char data[bytesToRead]; // data of the file
@@ -165,7 +220,7 @@ static int fs_read(const char *path, char *buf, size_t size, off_t offset,
     int read = 1; // number of read bytes in one read
 
     while(read > 0 && dataOffset < bytesToRead) { // loop while can still read and didn't read max size
-        read = filev6_readblock(&fv6, &(data[dataOffset])); // read block and put it in data at dataOffset
+        read = filev6_readblocks(&fv6, &(data[dataOffset]), (bytesToRead - dataOffset) / SECTOR_SIZE); // read remaining blocks and put them in data at dataOffset
         if(read < 0) { // error occured while reading block
             return 0; // return 0 to signal error (no byte read to buf)
         }
@@ -184,12 +239,15 @@ static int arg_parse(void *data, const char *filename, int key, struct fuse_args
 {
     (void) data;
     (void) outargs;
-    if (key == FUSE_OPT_KEY_NONOPT && fs.f == NULL && filename != NULL) {
-        int error = mountv6(filename,&fs);
+    if (key == FUSE_OPT_KEY_NONOPT && fs.dev == NULL && filename != NULL) {
+        struct mount_options opts = { .backend = BDEV_MMAP, // read-only workload: serve reads from the mapping
+                                      .checksums = MOUNT_CSUM_USE, // unless they must be verified
+                                      .bitmaps = MOUNT_BM_LAZY }; // nothing is allocated: never built
+        int error = mountv6_opts(filename, &fs, &opts);
         if(error) {
             printf("ERROR FS: %s\n", ERR_MESSAGES[error - ERR_FIRST]);
             fflush(stdout);
-            fs.f = NULL;
+            fs.dev = NULL;
             exit(1);
         }
         return 0;
@@ -205,7 +263,7 @@ static struct fuse_operations available_ops = {
 
 int main(int argc, char *argv[])
 {
-    fs.f = NULL; // initial value of f
+    fs.dev = NULL; // initial value of dev
     // main
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv); // extract arguments
     int ret = fuse_opt_parse(&args, NULL, NULL, arg_parse); // mount the file system
@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "icache.h"
+#include "mount.h"
+#include "inode.h"
+#include "bcache.h"
+#include "sector.h"
+#include "error.h"
+
+/**
+ * @brief hash bucket of the given inode
+ */
+static size_t icache_bucket(const struct icache *c, uint16_t inr)
+{
+    return inr % c->nb_buckets;
+}
+
+/**
+ * @brief find the valid entry holding inr; lock must be held
+ * @return the entry or NULL if inr is not cached
+ */
+static struct icache_entry *icache_lookup(struct icache *c, uint16_t inr)
+{
+    struct icache_entry *e = c->buckets[icache_bucket(c, inr)];
+    while(e != NULL && e->inr != inr) { // walk the chain
+        e = e->hash_next;
+    }
+    return e;
+}
+
+/**
+ * @brief add e, which holds e->inr, to its hash chain; lock must be held
+ */
+static void icache_hash(struct icache *c, struct icache_entry *e)
+{
+    size_t bucket = icache_bucket(c, e->inr);
+    e->hash_next = c->buckets[bucket];
+    c->buckets[bucket] = e;
+}
+
+/**
+ * @brief remove e from its hash chain; lock must be held
+ */
+static void icache_unhash(struct icache *c, struct icache_entry *e)
+{
+    struct icache_entry **p = &(c->buckets[icache_bucket(c, e->inr)]);
+    while(*p != NULL && *p != e) { // find the link pointing to e
+        p = &((*p)->hash_next);
+    }
+    if(*p == e) {
+        *p = e->hash_next;
+    }
+    e->hash_next = NULL;
+}
+
+/**
+ * @brief drop the content of a block map, if any; the parts of a huge file
+ *        (beyond i_addr[0..6]) are freed too if release is set, the others
+ *        are kept for the next large file
+ */
+static void icache_map_clear(struct icache_map *map, int release)
+{
+    if(map != NULL) {
+        map->dind_sector = 0;
+        memset(map->ind, 0, sizeof(map->ind));
+        for(size_t p = ADDR_SMALL_LENGTH - 1; release && p < ADDR_MAX_INDIRECT; p++) {
+            free(map->part[p]);
+            map->part[p] = NULL;
+        }
+    }
+}
+
+/**
+ * @brief the indirect sector of a part of the block map of a file, from
+ *        its inode or from the double-indirect sector, read into the map
+ *        the first time it is used; lock must be held
+ * @return the sector; <0 on error
+ */
+static int icache_map_indirect(struct icache *c, const struct unix_filesystem *u, struct icache_map *map,
+                               const struct inode *i, uint32_t part)
+{
+    if(part < ADDR_SMALL_LENGTH - 1) { // in the inode
+        return i->i_addr[part];
+    }
+    uint16_t dind = i->i_addr[ADDR_SMALL_LENGTH - 1]; // huge file: in the double-indirect sector
+    if(map->dind_sector == 0 || map->dind_sector != dind) { // not read yet, or another sector
+        int error = bcache_read(u->cache, dind, map->dind);
+        map->dind_sector = error ? 0 : dind;
+        if(error) {
+            return error;
+        }
+        c->stats.map_loads++;
+    }
+    return map->dind[part - (ADDR_SMALL_LENGTH - 1)];
+}
+
+/**
+ * @brief move e to the head of the LRU list (most recently used); lock must be held
+ */
+static void icache_touch(struct icache *c, struct icache_entry *e)
+{
+    if(c->lru_head == e) { // already most recently used
+        return;
+    }
+    // unlink
+    e->lru_prev->lru_next = e->lru_next; // e is not the head: it has a predecessor
+    if(e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        c->lru_tail = e->lru_prev;
+    }
+    // insert at head
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    c->lru_head->lru_prev = e;
+    c->lru_head = e;
+}
+
+/**
+ * @brief write back the dirty unpinned inodes of one inode-table sector,
+ *        with one update of that sector in the buffer cache; lock must be held
+ * @param sector the sector, relative to s_inode_start
+ * @return 0 on success; <0 on error (the inodes stay dirty)
+ */
+static int icache_writeback(struct icache *c, const struct unix_filesystem *u, uint32_t sector)
+{
+    struct bcache_buf *buf = NULL;
+    int error = bcache_get(u->cache, (u->s).s_inode_start + sector, &buf);
+    if(error) { // error occured
+        return error; // propagate error
+    }
+    struct inode *inodes = (struct inode*)buf->data; // inodes of the sector
+    for(uint32_t i = 0; i < INODES_PER_SECTOR; i++) {
+        struct icache_entry *e = icache_lookup(c, sector * INODES_PER_SECTOR + i);
+        if(e != NULL && e->dirty && e->refs == 0) { // a pinned entry may be being modified
+            inodes[i] = e->inode;
+            e->dirty = 0;
+            c->nb_dirty--;
+            c->stats.writebacks++;
+        }
+    }
+    bcache_put(u->cache, buf, 1); // written back later, by the buffer cache
+    c->stats.write_sectors++;
+    return 0;
+}
+
+/**
+ * @brief find the least recently used unpinned entry and make it free;
+ *        lock must be held
+ * @param clean 1 to only take an entry that is not dirty (no write back)
+ * @param e the free entry, not in the hash chains (OUT)
+ * @return 0 on success; ERR_NOMEM if no entry can be taken; <0 on error
+ */
+static int icache_victim(struct icache *c, const struct unix_filesystem *u, int clean, struct icache_entry **e)
+{
+    struct icache_entry *v = c->lru_tail;
+    while(v != NULL && (v->refs > 0 || (clean && v->dirty))) {
+        v = v->lru_prev;
+    }
+    if(v == NULL) { // all entries pinned
+        return ERR_NOMEM;
+    }
+    if(v->valid) { // entry holds another inode
+        if(v->dirty) { // write back its sector, with the other dirty inodes of that sector
+            int error = icache_writeback(c, u, v->inr / INODES_PER_SECTOR);
+            if(error) { // error occured
+                return error; // propagate error
+            }
+        }
+        icache_unhash(c, v);
+        v->valid = 0;
+        c->stats.evictions++;
+    }
+    icache_map_clear(v->map, 1); // the map buffer and its first parts, if any, are kept for the next large file
+    *e = v;
+    return 0;
+}
+
+/**
+ * @brief get the entry of inr, pinned; lock must be held
+ * @return 0 on success; <0 on error
+ */
+static int icache_getent(struct icache *c, const struct unix_filesystem *u, uint16_t inr, int read,
+                         struct icache_entry **entry)
+{
+    struct icache_entry *e = icache_lookup(c, inr);
+    if(e != NULL) { // hit
+        c->stats.hits++;
+        e->refs++;
+        icache_touch(c, e);
+        *entry = e;
+        return 0;
+    }
+
+    // miss
+    int error = icache_victim(c, u, 0, &e);
+    if(error) { // error occured
+        return error; // propagate error
+    }
+    const struct inode *inodes = NULL; // inodes of the sector of inr
+    struct inode copy[INODES_PER_SECTOR];
+    if(read) {
+        uint32_t sector = (u->s).s_inode_start + inr / INODES_PER_SECTOR;
+        inodes = bcache_view(u->cache, sector); // sector straight from the mapping, if any
+        if(inodes == NULL) { // disk not mapped: read sector
+            error = bcache_read(u->cache, sector, copy);
+            if(error) { // error occured, e stays free
+                return error; // propagate error
+            }
+            inodes = copy;
+        }
+        e->inode = inodes[inr % INODES_PER_SECTOR];
+    }
+    e->inr = inr;
+    e->valid = 1;
+    e->dirty = 0;
+    e->refs = 1; // pinned: not taken by the prefill below
+    icache_hash(c, e);
+    c->stats.misses++;
+
+    // the other allocated inodes of the sector come for free; small caches keep their entries
+    for(uint32_t i = 0; inodes != NULL && c->size >= 2 * INODES_PER_SECTOR && i < INODES_PER_SECTOR; i++) {
+        uint16_t other = (inr / INODES_PER_SECTOR) * INODES_PER_SECTOR + i;
+        struct icache_entry *o = NULL;
+        if(!(inodes[i].i_mode & IALLOC) || icache_lookup(c, other) != NULL) { // nothing to load
+            continue;
+        }
+        if(icache_victim(c, u, 1, &o)) { // nothing but pinned or dirty entries
+            break;
+        }
+        o->inr = other;
+        o->inode = inodes[i];
+        o->valid = 1;
+        o->dirty = 0;
+        icache_hash(c, o);
+        icache_touch(c, o);
+        c->stats.prefills++;
+    }
+    icache_touch(c, e);
+    *entry = e;
+    return 0;
+}
+
+struct icache *icache_alloc(size_t size)
+{
+    if(size == 0) { // default size
+        size = ICACHE_DEFAULT_SIZE;
+    }
+    struct icache *c = calloc(1, sizeof(struct icache));
+    if(c == NULL) {
+        return NULL;
+    }
+    c->size = size;
+    c->nb_buckets = size;
+    c->entries = calloc(size, sizeof(struct icache_entry));
+    c->buckets = calloc(c->nb_buckets, sizeof(struct icache_entry*));
+    if(c->entries == NULL || c->buckets == NULL || pthread_mutex_init(&(c->lock), NULL)) {
+        free(c->entries);
+        free(c->buckets);
+        free(c);
+        return NULL;
+    }
+    for(size_t i = 0; i < size; i++) { // chain all entries in the LRU list
+        c->entries[i].lru_prev = (i > 0) ? &(c->entries[i - 1]) : NULL;
+        c->entries[i].lru_next = (i + 1 < size) ? &(c->entries[i + 1]) : NULL;
+    }
+    c->lru_head = &(c->entries[0]);
+    c->lru_tail = &(c->entries[size - 1]);
+    return c;
+}
+
+void icache_free(struct icache *c)
+{
+    if(c != NULL) {
+        pthread_mutex_destroy(&(c->lock));
+        for(size_t i = 0; i < c->size; i++) {
+            struct icache_map *map = c->entries[i].map;
+            for(size_t p = 0; map != NULL && p < ADDR_MAX_INDIRECT; p++) {
+                free(map->part[p]);
+            }
+            free(map);
+        }
+        free(c->entries);
+        free(c->buckets);
+        free(c);
+    }
+}
+
+int icache_get(const struct unix_filesystem *u, uint16_t inr, int read, struct icache_entry **e)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->icache);
+    M_REQUIRE_NON_NULL(e);
+
+    struct icache *c = u->icache;
+    pthread_mutex_lock(&(c->lock));
+    int error = icache_getent(c, u, inr, read, e);
+    pthread_mutex_unlock(&(c->lock));
+    return error;
+}
+
+void icache_put(const struct unix_filesystem *u, struct icache_entry *e, int dirty)
+{
+    if(u != NULL && u->icache != NULL && e != NULL) {
+        struct icache *c = u->icache;
+        pthread_mutex_lock(&(c->lock));
+        if(dirty && !e->dirty) {
+            e->dirty = 1;
+            c->nb_dirty++;
+        }
+        if(dirty) { // the addresses, or what the indirect sectors hold, may have changed
+            icache_map_clear(e->map, 0);
+        }
+        if(e->refs > 0) {
+            e->refs--;
+        }
+        pthread_mutex_unlock(&(c->lock));
+    }
+}
+
+int icache_map_range(const struct unix_filesystem *u, uint16_t inr, const struct inode *i, int32_t first_off,
+                     uint32_t max_count, uint32_t *phys_start, uint32_t *run_len)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->icache);
+    M_REQUIRE_NON_NULL(i);
+    M_REQUIRE_NON_NULL(phys_start);
+    M_REQUIRE_NON_NULL(run_len);
+
+    uint32_t size = inode_getsize(i); // file size
+    uint32_t smallFileMaxSize = ADDR_SMALL_LENGTH * SECTOR_SIZE; // small file is 8 * 512 bytes = 4 Kbytes
+    if(!(i->i_mode & IALLOC) || size <= smallFileMaxSize || size > INODE_MAX_SIZE || max_count == 0
+       || first_off < 0 || (uint32_t)first_off * SECTOR_SIZE >= size) { // no indirect sector involved, or error
+        return inode_map_range(u, i, first_off, max_count, phys_start, run_len);
+    }
+    uint32_t nbSectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE; // data sectors of the file
+    if(max_count > nbSectors - first_off) { // not beyond the end of the file
+        max_count = nbSectors - first_off;
+    }
+
+    struct icache *c = u->icache;
+    pthread_mutex_lock(&(c->lock));
+    struct icache_entry *e = icache_lookup(c, inr);
+    int error = 0;
+    if(e != NULL) {
+        icache_touch(c, e);
+    } else if((error = icache_getent(c, u, inr, 1, &e)) == 0) { // the map goes with the entry
+        e->refs--;
+    }
+    if(!error && e->map == NULL) {
+        e->map = calloc(1, sizeof(struct icache_map));
+        error = (e->map == NULL) ? ERR_NOMEM : 0;
+    }
+
+    // one part of the map (indirect sector) at a time, while the run goes on
+    uint32_t start = 0;
+    uint32_t run = 0;
+    while(!error && run < max_count) {
+        uint32_t off = first_off + run;
+        uint32_t part = off / ADDRESSES_PER_SECTOR;
+        struct icache_map *map = e->map;
+        int ind = icache_map_indirect(c, u, map, i, part); // number of the sector containing the direct sectors numbers
+        if(ind >= 0 && map->part[part] == NULL) {
+            map->part[part] = malloc(SECTOR_SIZE);
+            ind = (map->part[part] == NULL) ? ERR_NOMEM : ind;
+        }
+        if(ind < 0) { // error occured
+            error = ind;
+            break;
+        }
+        uint16_t *addresses = map->part[part];
+        if(map->ind[part] == 0 || map->ind[part] != ind) { // not read yet, or another indirect sector
+            error = bcache_read(u->cache, ind, addresses);
+            map->ind[part] = error ? 0 : ind;
+            c->stats.map_loads += !error;
+        } else {
+            c->stats.map_hits++;
+        }
+        uint32_t inPart = off % ADDRESSES_PER_SECTOR;
+        start = (run == 0) ? addresses[inPart] : start;
+        uint32_t n = (ADDRESSES_PER_SECTOR - inPart < max_count - run) ? ADDRESSES_PER_SECTOR - inPart : max_count - run;
+        uint32_t k = error ? 0 : inode_addr_run(&(addresses[inPart]), n, start + run);
+        run += k;
+        if(k < n) { // not contiguous: the run ends here
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(c->lock));
+    if(error) {
+        return error;
+    }
+
+    *phys_start = start;
+    *run_len = run;
+    return 0;
+}
+
+int icache_sync(const struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->icache);
+
+    struct icache *c = u->icache;
+    int error = 0;
+    pthread_mutex_lock(&(c->lock));
+    for(size_t i = 0; !error && c->nb_dirty > 0 && i < c->size; i++) {
+        struct icache_entry *e = &(c->entries[i]);
+        if(e->valid && e->dirty && e->refs == 0) { // cleans the other dirty inodes of its sector too
+            error = icache_writeback(c, u, e->inr / INODES_PER_SECTOR);
+        }
+    }
+    pthread_mutex_unlock(&(c->lock));
+    return error;
+}
+
+void icache_print_stats(struct icache *c)
+{
+    printf("**********INODE CACHE START**********\n");
+    if(c == NULL) {
+        printf("NULL ptr\n");
+    } else {
+        pthread_mutex_lock(&(c->lock));
+        struct icache_stats s = c->stats;
+        size_t dirty = c->nb_dirty;
+        pthread_mutex_unlock(&(c->lock));
+
+        uint64_t lookups = s.hits + s.misses;
+        printf("%-19s : %zu\n", "entries", c->size);
+        printf("%-19s : %zu\n", "dirty", dirty);
+        printf("%-19s : %" PRIu64 "\n", "hits", s.hits);
+        printf("%-19s : %" PRIu64 "\n", "misses", s.misses);
+        printf("%-19s : %.1f%%\n", "hit rate", lookups ? 100.0 * s.hits / lookups : 0.0);
+        printf("%-19s : %" PRIu64 "\n", "prefills", s.prefills);
+        printf("%-19s : %" PRIu64 "\n", "writebacks", s.writebacks);
+        printf("%-19s : %" PRIu64 "\n", "sector updates", s.write_sectors);
+        printf("%-19s : %" PRIu64 "\n", "evictions", s.evictions);
+        printf("%-19s : %" PRIu64 "\n", "block map hits", s.map_hits);
+        printf("%-19s : %" PRIu64 "\n", "block map loads", s.map_loads);
+    }
+    printf("**********INODE CACHE END************\n");
+    fflush(stdout);
+}
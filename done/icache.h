@@ -0,0 +1,147 @@
+#pragma once
+
+/**
+ * @file icache.h
+ * @brief write-back cache of the inodes (iget/iput style)
+ *
+ * Entries are indexed by a hash on the inode number and kept in LRU
+ * order. An entry is pinned (referenced) between icache_get() and
+ * icache_put() and is never evicted while pinned. A miss reads the
+ * inode-table sector of the inode once (through the buffer cache or
+ * bcache_view()) and also loads the other allocated inodes of that
+ * sector. Writes only mark entries dirty; dirty inodes reach the buffer
+ * cache when a dirty entry is evicted, on icache_sync(), mountv6_sync()
+ * and umountv6(): all the dirty inodes of one sector are then copied
+ * with one update of that sector.
+ * The entry of a large file also holds its block map, filled by
+ * icache_map_range() one indirect sector at a time (with the
+ * double-indirect sector of a huge file) and dropped when the inode is
+ * written.
+ * All functions are thread-safe.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "unixv6fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ICACHE_DEFAULT_SIZE 256 // number of entries (inodes) of a cache
+
+struct unix_filesystem;
+
+/**
+ * @brief block map of a large file: the content of its indirect sectors,
+ *        each part allocated when first read
+ */
+struct icache_map {
+    uint16_t dind_sector;             // double-indirect sector held by dind, 0 if none
+    uint16_t dind[ADDRESSES_PER_SECTOR]; // indirect sectors beyond i_addr[0..6]
+    uint16_t ind[ADDR_MAX_INDIRECT];  // indirect sector held by each part, 0 if none
+    uint16_t *part[ADDR_MAX_INDIRECT]; // addresses held by each indirect sector, NULL until used
+};
+
+struct icache_entry {
+    uint16_t inr;                     // inode held by the entry
+    int valid;                        // 1 if inode holds the content of inr
+    int dirty;                        // 1 if inode must be written back to the inode table
+    unsigned int refs;                // number of icache_get() without icache_put()
+    struct icache_entry *hash_next;   // next entry in the same hash bucket
+    struct icache_entry *lru_prev;    // more recently used entry
+    struct icache_entry *lru_next;    // less recently used entry
+    struct inode inode;               // content of the inode
+    struct icache_map *map;           // block map of a large file, NULL until used
+};
+
+struct icache_stats {
+    uint64_t hits;                    // inodes found in the cache: inode-table sectors not read
+    uint64_t misses;                  // inodes not in the cache, read from their sector unless overwritten
+    uint64_t prefills;                // other inodes loaded with the sector of a miss
+    uint64_t writebacks;              // dirty inodes written back
+    uint64_t write_sectors;           // updates of inode-table sectors by the writebacks
+    uint64_t evictions;               // entries reused for another inode
+    uint64_t map_hits;                // sectors of large files found in a block map
+    uint64_t map_loads;               // indirect and double-indirect sectors read into a block map
+};
+
+struct icache {
+    size_t size;                      // number of entries
+    struct icache_entry *entries;     // the entries
+    size_t nb_buckets;                // number of hash buckets
+    struct icache_entry **buckets;    // hash buckets (chains of entries)
+    struct icache_entry *lru_head;    // most recently used entry
+    struct icache_entry *lru_tail;    // least recently used entry
+    struct icache_stats stats;        // counters
+    size_t nb_dirty;                  // number of dirty entries
+    pthread_mutex_t lock;             // protects all the above
+};
+
+/**
+ * @brief allocate a new, empty inode cache
+ * @param size the number of entries, 0 for ICACHE_DEFAULT_SIZE
+ * @return the new cache or NULL on failure
+ */
+struct icache *icache_alloc(size_t size);
+
+/**
+ * @brief free the cache, without writing back dirty inodes
+ * @param c the cache (may be NULL)
+ */
+void icache_free(struct icache *c);
+
+/**
+ * @brief get the entry of the given inode, pinned (iget)
+ * @param u the mounted filesystem, with its cache u->icache
+ * @param inr the inode number, in the inode table
+ * @param read 1 to read the inode on a miss, 0 if the caller overwrites
+ *        the whole inode
+ * @param e the entry, valid until icache_put() (OUT)
+ * @return 0 on success; <0 on error
+ */
+int icache_get(const struct unix_filesystem *u, uint16_t inr, int read, struct icache_entry **e);
+
+/**
+ * @brief unpin an entry obtained from icache_get() (iput)
+ * @param u the mounted filesystem
+ * @param e the entry
+ * @param dirty 1 if the inode of the entry was modified
+ */
+void icache_put(const struct unix_filesystem *u, struct icache_entry *e, int dirty);
+
+/**
+ * @brief longest run of consecutive sectors of a file from the given
+ *        offset, as inode_map_range(); for a large file, each indirect
+ *        sector is read only the first time it is used, into the block
+ *        map of the entry of inr
+ * @param u the mounted filesystem
+ * @param inr the inode number of the file
+ * @param i the content of the inode, as known by the caller
+ * @param first_off the offset in the file, in sectors
+ * @param max_count the maximal length of the run, >0
+ * @param phys_start the first sector of the run (OUT)
+ * @param run_len the number of sectors of the run (OUT)
+ * @return 0 on success; <0 on error
+ */
+int icache_map_range(const struct unix_filesystem *u, uint16_t inr, const struct inode *i, int32_t first_off,
+                     uint32_t max_count, uint32_t *phys_start, uint32_t *run_len);
+
+/**
+ * @brief write back all dirty (unpinned) inodes to the buffer cache, one
+ *        update per inode-table sector; the buffer cache is not synced
+ * @param u the mounted filesystem
+ * @return 0 on success; <0 on error
+ */
+int icache_sync(const struct unix_filesystem *u);
+
+/**
+ * @brief print the counters of the cache to stdout
+ * @param c the cache
+ */
+void icache_print_stats(struct icache *c);
+
+#ifdef __cplusplus
+}
+#endif
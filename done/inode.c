@@ -1,49 +1,144 @@
 #include "inode.h"
 #include "sector.h"
+#include "bcache.h"
+#include "icache.h"
 #include "error.h"
 #include "unixv6fs.h"
+#include <stdlib.h>
 #include <inttypes.h>
 
-int inode_scan_print(const struct unix_filesystem *u)
-{
-    M_REQUIRE_NON_NULL(u);
-    uint16_t sector = (u->s).s_inode_start; // first sector containing an inode
-    uint16_t size = (u->s).s_isize; // number of sectors containing inodes
-
-    /* iteration on the sectors */
-    for(uint32_t s = 0; s < size; ++s) { // s the sector number is uint32_t to get correct value passed to sector_read
-        struct inode inodes[INODES_PER_SECTOR];
-        int error = sector_read(u->f, sector + s, inodes);
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // AVX2, enabled per function
+#define INODE_HAVE_AVX2 1
+#endif
 
-        /* an error occured while trying to read sector */
-        if(error) {
-            return error;
-        }
+static const struct inode_filter inode_all = { INODE_ANY, 0, INODE_MAX_SIZE }; // the NULL filter
+static uint32_t (*inode_mask_fn)(const struct inode *inodes, const struct inode_filter *filter); // best implementation
+static pthread_once_t inode_mask_once = PTHREAD_ONCE_INIT;
 
-        /* iteration on the sector's inodes */
-        for(int i = 0; i < INODES_PER_SECTOR; ++i) {
+uint32_t inode_filter_mask_sw(const struct inode *inodes, const struct inode_filter *filter)
+{
+    const struct inode_filter *f = (filter != NULL) ? filter : &inode_all;
+    uint32_t mask = 0;
+    for(uint32_t i = 0; inodes != NULL && i < INODES_PER_SECTOR; i++) {
+        uint16_t mode = inodes[i].i_mode;
+        uint32_t size = inode_getsize(&(inodes[i]));
+        int type = (f->type == INODE_ANY) || ((f->type == INODE_DIR) == ((mode & IFDIR) != 0));
+        mask |= (uint32_t)((mode & IALLOC) && type && size >= f->min_size && size <= f->max_size) << i;
+    }
+    return mask;
+}
 
-            /* print only if inode is valid */
-            if(inodes[i].i_mode & IALLOC) {
-                uint16_t currentInode = INODES_PER_SECTOR * s + i; // number of the inode in current sector
+#ifdef INODE_HAVE_AVX2
+__attribute__((target("avx2")))
+static uint32_t inode_filter_mask_avx2(const struct inode *inodes, const struct inode_filter *filter)
+{
+    const struct inode_filter *f = (filter != NULL) ? filter : &inode_all;
+    // sizes are on 24 bits: the bounds, clamped, compare as signed
+    const __m256i min = _mm256_set1_epi32((f->min_size > INODE_MAX_SIZE) ? INODE_MAX_SIZE + 1 : f->min_size);
+    const __m256i max = _mm256_set1_epi32((f->max_size > INODE_MAX_SIZE) ? INODE_MAX_SIZE : f->max_size);
+    const __m256i index = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56); // 32-bit words: one inode every 32 bytes
+    const int *words = (const int *)inodes;
+    uint32_t mask = 0;
+    for(uint32_t h = 0; h < INODES_PER_SECTOR; h += 8) {
+        // i_mode, i_nlink, i_uid then i_gid, i_size0, i_size1 of 8 inodes
+        __m256i head = _mm256_i32gather_epi32(&(words[h * 8]), index, 4);
+        __m256i tail = _mm256_i32gather_epi32(&(words[h * 8 + 1]), index, 4);
+        __m256i keep = _mm256_slli_epi32(head, 16); // IALLOC as the sign bit
+        if(f->type != INODE_ANY) {
+            __m256i dir = _mm256_slli_epi32(head, 17); // IFDIR as the sign bit
+            keep = (f->type == INODE_DIR) ? _mm256_and_si256(keep, dir) : _mm256_andnot_si256(dir, keep);
+        }
+        __m256i size = _mm256_or_si256(_mm256_srli_epi32(tail, 16), // i_size1
+                                       _mm256_and_si256(_mm256_slli_epi32(tail, 8), _mm256_set1_epi32(0xff0000))); // i_size0
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(min, size), _mm256_cmpgt_epi32(size, max));
+        keep = _mm256_andnot_si256(out, keep);
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(keep)) << h;
+    }
+    return mask;
+}
+#endif
 
-                printf("inode %3u ", currentInode);
+static void inode_mask_init(void)
+{
+    inode_mask_fn = inode_filter_mask_sw;
+#ifdef INODE_HAVE_AVX2
+    if(__builtin_cpu_supports("avx2") && INODES_PER_SECTOR == 16 && sizeof(struct inode) == 32) {
+        inode_mask_fn = inode_filter_mask_avx2;
+    }
+#endif
+}
 
-                /* check wether inode is a directory or a file */
-                if (inodes[i].i_mode & IFDIR) {
-                    printf("(%s) ", SHORT_DIR_NAME);
-                } else {
-                    printf("(%s) ", SHORT_FIL_NAME);
-                }
+uint32_t inode_filter_mask(const struct inode *inodes, const struct inode_filter *filter)
+{
+    pthread_once(&inode_mask_once, inode_mask_init);
+    return (inodes != NULL) ? inode_mask_fn(inodes, filter) : 0;
+}
 
-                printf("len %4" PRIu32 "\n", inode_getsize(&inodes[i])); // call inode_getsize with pointer to current inode
-                fflush(stdout);
+int inode_foreach(const struct unix_filesystem *u, const struct inode_filter *filter, inode_callback callback,
+                  void *ctx)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(callback);
+    uint32_t first = (u->s).s_inode_start; // first sector containing an inode
+    uint32_t size = (u->s).s_isize; // number of sectors containing inodes
+
+    int error = icache_sync(u); // the table is read directly: the cached inodes must be in it
+    struct inode *inodes = malloc(INODE_SCAN_BATCH * INODE_SCAN_SECTORS * SECTOR_SIZE);
+    error = error ? error : ((inodes == NULL) ? ERR_NOMEM : 0);
+    pthread_once(&inode_mask_once, inode_mask_init);
+
+    /* iteration on the sectors, INODE_SCAN_BATCH chunks of INODE_SCAN_SECTORS at a time */
+    for(uint32_t b = 0; !error && b < size; b += INODE_SCAN_BATCH * INODE_SCAN_SECTORS) {
+        struct aio_req reqs[INODE_SCAN_BATCH];
+        size_t nb = 0;
+        for(uint32_t s = b; nb < INODE_SCAN_BATCH && s < size; nb++, s += INODE_SCAN_SECTORS) {
+            uint32_t count = (size - s < INODE_SCAN_SECTORS) ? size - s : INODE_SCAN_SECTORS; // number of sectors to read
+            reqs[nb] = (struct aio_req) { first + s, count, &(inodes[(s - b) * INODES_PER_SECTOR]), 0, 0 };
+        }
+        error = bcache_read_runs(u->cache, u->aio, reqs, nb);
+        uint32_t nbSectors = (size - b < INODE_SCAN_BATCH * INODE_SCAN_SECTORS) ? size - b : INODE_SCAN_BATCH * INODE_SCAN_SECTORS;
+
+        /* iteration on the sectors, then on their matching inodes */
+        for(uint32_t s = 0; !error && s < nbSectors; s++) {
+            const struct inode *sector = &(inodes[s * INODES_PER_SECTOR]);
+            uint32_t mask = inode_mask_fn(sector, filter);
+            while(!error && mask != 0) {
+                uint32_t i = __builtin_ctz(mask);
+                mask &= mask - 1;
+                error = callback((b + s) * INODES_PER_SECTOR + i, &(sector[i]), ctx);
             }
         }
     }
+    free(inodes);
+    return error;
+}
+
+/**
+ * @brief callback of inode_scan_print(): print an inode
+ */
+static int inode_print_line(uint16_t inr, const struct inode *inode, void *ctx)
+{
+    (void) ctx;
+    printf("inode %3u ", inr);
+
+    /* check wether inode is a directory or a file */
+    if (inode->i_mode & IFDIR) {
+        printf("(%s) ", SHORT_DIR_NAME);
+    } else {
+        printf("(%s) ", SHORT_FIL_NAME);
+    }
+
+    printf("len %4" PRIu32 "\n", inode_getsize(inode));
+    fflush(stdout);
     return 0;
 }
 
+int inode_scan_print(const struct unix_filesystem *u)
+{
+    return inode_foreach(u, NULL, inode_print_line, NULL);
+}
+
 void inode_print(const struct inode *inode)
 {
     printf("**********FS INODE START**********\n");
@@ -68,7 +163,6 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(inode);
 
-    uint16_t start = (u->s).s_inode_start;	// first sector containing an inode
     uint16_t size = (u->s).s_isize; // number of sectors containing inodes
 
     uint32_t maxInodeNb = INODES_PER_SECTOR * size - 1; // last valid inode number
@@ -77,25 +171,22 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
         return ERR_INODE_OUTOF_RANGE; // return approriate error code
     }
 
-    // read sector
-    struct inode inodes[INODES_PER_SECTOR];
-    uint32_t sectorNb = inr / INODES_PER_SECTOR; // sector number for inode inr
+    // get inode, its sector is read on a miss only
+    struct icache_entry *e = NULL;
+    int error = icache_get(u, inr, 1, &e);
 
-    int error = sector_read(u->f, start + sectorNb, inodes);
     /* an error occured while trying to read sector */
     if(error) {
         return error; // return approriate error code
     }
 
-    int i = inr % INODES_PER_SECTOR; // index of inode inr in inodes array
-
-    if(!(inodes[i].i_mode & IALLOC)) { // IALLOC flag is 0
-        return ERR_UNALLOCATED_INODE; // return approriate error code
+    int allocated = e->inode.i_mode & IALLOC;
+    if(allocated) {
+        *inode = e->inode; // copy inode content to memory location pointed by inode pointer
     }
+    icache_put(u, e, 0);
 
-    // no error
-    *inode = inodes[i]; // copy inode content to memory location pointed by inode pointer
-    return 0;
+    return allocated ? 0 : ERR_UNALLOCATED_INODE; // IALLOC flag is 0: return approriate error code
 }
 
 // returns the sector number of the (file_sec_off)th sector containing file content
@@ -116,22 +207,24 @@ int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int
 
     uint32_t size = inode_getsize(i); // file size
     uint32_t smallFileMaxSize = ADDR_SMALL_LENGTH * SECTOR_SIZE; // small file is 8 * 512 bytes = 4 Kbytes
-    uint32_t largeFileMaxSize = (ADDR_SMALL_LENGTH - 1) * ADDRESSES_PER_SECTOR * SECTOR_SIZE; // large file is 7 * 256 * 512 bytes = 896 Kbytes
 
     if(size <= smallFileMaxSize) { // small file
         if(file_sec_off * SECTOR_SIZE >= size) { // invalid offset
             return ERR_OFFSET_OUT_OF_RANGE; // return approriate error code
         }
         return i->i_addr[file_sec_off];
-    } else if(size <= largeFileMaxSize) { // large file
-        if(file_sec_off * SECTOR_SIZE >= size) { // invalid offset
+    } else if(size <= INODE_MAX_SIZE) { // large file, huge beyond ADDR_LARGE_SECTORS sectors
+        if((uint32_t)file_sec_off * SECTOR_SIZE >= size) { // invalid offset
             return ERR_OFFSET_OUT_OF_RANGE; // return approriate error code
         }
 
-        uint16_t sectorOfSectorsNb = i->i_addr[file_sec_off / ADDRESSES_PER_SECTOR]; // number of the sector containing the direct sectors numbers
+        int sectorOfSectorsNb = inode_indirect(u, i, file_sec_off); // number of the sector containing the direct sectors numbers
+        if(sectorOfSectorsNb < 0) { // error occured
+            return sectorOfSectorsNb;
+        }
 
         uint16_t sectors[ADDRESSES_PER_SECTOR];
-        int error = sector_read(u->f,sectorOfSectorsNb,sectors);
+        int error = bcache_read(u->cache,sectorOfSectorsNb,sectors);
 
         if(error) { // error occured
             return error;
@@ -144,12 +237,87 @@ int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int
     }
 }
 
+int inode_indirect(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(i);
+    if(file_sec_off < 0 || file_sec_off >= ADDR_MAX_INDIRECT * ADDRESSES_PER_SECTOR) { // invalid offset
+        return ERR_OFFSET_OUT_OF_RANGE;
+    }
+
+    if(file_sec_off < ADDR_LARGE_SECTORS) { // one of the first 7 indirect sectors
+        return i->i_addr[file_sec_off / ADDRESSES_PER_SECTOR];
+    }
+    uint16_t indirect[ADDRESSES_PER_SECTOR]; // the double-indirect sector: the next indirect sectors
+    int error = bcache_read(u->cache, i->i_addr[ADDR_SMALL_LENGTH - 1], indirect);
+    return error ? error : indirect[(file_sec_off - ADDR_LARGE_SECTORS) / ADDRESSES_PER_SECTOR];
+}
+
+uint32_t inode_addr_run(const uint16_t *addr, uint32_t n, uint32_t first)
+{
+    uint32_t k = 0;
+    while(k < n && addr[k] == first + k) {
+        k++;
+    }
+    return k;
+}
+
+int inode_map_range(const struct unix_filesystem *u, const struct inode *inode, int32_t first_off,
+                    uint32_t max_count, uint32_t *phys_start, uint32_t *run_len)
+{
+    M_REQUIRE_NON_NULL(phys_start);
+    M_REQUIRE_NON_NULL(run_len);
+    if(max_count == 0) { // empty run
+        return ERR_BAD_PARAMETER;
+    }
+
+    int sector = inode_findsector(u, inode, first_off); // checks the inode and the offset
+    if(sector < 0) { // error occured
+        return sector; // propagate error
+    }
+
+    uint32_t size = inode_getsize(inode); // file size
+    uint32_t nbSectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE; // data sectors of the file
+    if(max_count > nbSectors - first_off) { // not beyond the end of the file
+        max_count = nbSectors - first_off;
+    }
+
+    uint32_t run = 1; // the first sector, found above
+    int error = 0;
+    while(!error && run < max_count) {
+        uint32_t off = first_off + run;
+        uint16_t sectors[ADDRESSES_PER_SECTOR];
+        const uint16_t *addresses = inode->i_addr; // small file: the direct addresses
+        uint32_t inPart = off; // position of off within addresses
+        uint32_t partLength = ADDR_SMALL_LENGTH;
+        if(size > ADDR_SMALL_LENGTH * SECTOR_SIZE) { // large file: the indirect sector of off
+            int ind = inode_indirect(u, inode, off);
+            error = (ind < 0) ? ind : bcache_read(u->cache, ind, sectors);
+            addresses = sectors;
+            inPart = off % ADDRESSES_PER_SECTOR;
+            partLength = ADDRESSES_PER_SECTOR;
+        }
+        uint32_t n = (partLength - inPart < max_count - run) ? partLength - inPart : max_count - run;
+        uint32_t k = error ? 0 : inode_addr_run(&(addresses[inPart]), n, sector + run);
+        run += k;
+        if(k < n) { // not contiguous: the run ends here
+            break;
+        }
+    }
+    if(error) {
+        return error;
+    }
+
+    *phys_start = sector;
+    *run_len = run;
+    return 0;
+}
+
 int inode_write(struct unix_filesystem *u, uint16_t inr, const struct inode *inode)
 {
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(inode);
 
-    uint16_t start = (u->s).s_inode_start;	// first sector containing an inode
     uint16_t size = (u->s).s_isize; // number of sectors containing inodes
 
     uint32_t maxInodeNb = INODES_PER_SECTOR * size - 1; // last valid inode number
@@ -158,33 +326,35 @@ int inode_write(struct unix_filesystem *u, uint16_t inr, const struct inode *ino
         return ERR_INODE_OUTOF_RANGE; // return approriate error code
     }
 
-    // read sector
-    struct inode inodes[INODES_PER_SECTOR];
-    uint32_t sectorNb = inr / INODES_PER_SECTOR; // sector number for inode inr
+    // get inode, pinned in the inode cache; overwritten: no need to read it
+    struct icache_entry *e = NULL;
+    int error = icache_get(u, inr, 0, &e);
 
-    int readError = sector_read(u->f, start + sectorNb, inodes);
-
-    if(readError) {// an error occured while trying to read sector
-        return readError; // return approriate error code
+    if(error) {// an error occured while trying to write back an evicted inode
+        return error; // return approriate error code
     }
 
-    int i = inr % INODES_PER_SECTOR; // index of inode inr in inodes array
+    e->inode = *inode; //write the inode in the cache
 
-    inodes[i] = *inode; //write the inode in the array
+    icache_put(u, e, 1); // release the modified inode, written back later with the others of its sector
 
-    int writeError = sector_write(u->f, start + sectorNb, inodes); //write the modified array to appropriate sector
-
-    return writeError;
+    return 0;
 }
 
-int inode_alloc(struct unix_filesystem *u)
+int inode_alloc(struct unix_filesystem *u, uint16_t goal)
 {
-    int freeInode = bm_find_next(u->ibm); // find next unallocated inode number
+    int error = mountv6_bitmaps(u); // not built yet by a lazy mount
+    error = error ? error : mountv6_bm_modified(u); // the on-disk bitmaps become stale
+    if(error) { // error occured
+        return error; // propagate error
+    }
+    // found and set at once: several threads may allocate together
+    int freeInode = (goal >= (u->ibm)->min && goal <= (u->ibm)->max)
+                    ? bm_atomic_claim_near(u->ibm, goal) // unallocated inode nearest to the goal
+                    : bm_atomic_claim(u->ibm); // next unallocated inode number
     if(freeInode < 0) { // no free inode found
         return ERR_NOMEM; // return appropriate error code
     }
-
-    bm_set(u->ibm, freeInode); // set the bit (inode is now allocated)
     return freeInode; // return the inode number
 }
 
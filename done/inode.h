@@ -15,6 +15,36 @@
 extern "C" {
 #endif
 
+#define INODE_SCAN_SECTORS 16 // number of inode sectors read with a single I/O when scanning the inode table
+#define INODE_SCAN_BATCH 8 // number of chunks of INODE_SCAN_SECTORS in flight together when scanning the inode table
+
+/**
+ * @brief kinds of inodes selected by a filter of inode_foreach()
+ */
+enum inode_type {
+    INODE_ANY,  // directories and files
+    INODE_DIR,  // directories (IFDIR)
+    INODE_FILE  // files, i.e. not directories
+};
+
+/**
+ * @brief the allocated inodes passed to the callback of inode_foreach()
+ */
+struct inode_filter {
+    enum inode_type type;
+    uint32_t min_size; // smallest size, in bytes
+    uint32_t max_size; // largest size, in bytes; INODE_MAX_SIZE for no limit
+};
+
+/**
+ * @brief callback of inode_foreach()
+ * @param inr the inode number
+ * @param inode the content of the inode
+ * @param ctx the context given to inode_foreach()
+ * @return 0 to go on; >0 to stop the iteration; <0 to stop it on error
+ */
+typedef int (*inode_callback)(uint16_t inr, const struct inode *inode, void *ctx);
+
 /**
  * @brief Return the size of a file associated to a given inode.
  *
@@ -73,6 +103,38 @@ void inode_print(const struct inode *inode);
  */
 int inode_scan_print(const struct unix_filesystem *u);
 
+/**
+ * @brief call back for each allocated inode of the inode table that
+ *        matches the filter, in the order of their numbers; the table is
+ *        read INODE_SCAN_BATCH chunks of INODE_SCAN_SECTORS sectors at a
+ *        time and the inodes of each sector are filtered at once
+ *        (inode_filter_mask()); like the inode table, this includes
+ *        inode 0 if it is allocated
+ * @param u the filesystem
+ * @param filter which inodes are passed; NULL for all the allocated ones
+ * @param callback the function called for each of them
+ * @param ctx passed to callback
+ * @return 0 on success; >0 if the callback stopped the iteration; <0 on
+ *         error, of the callback or of the reads
+ */
+int inode_foreach(const struct unix_filesystem *u, const struct inode_filter *filter, inode_callback callback,
+                  void *ctx);
+
+/**
+ * @brief mask of the inodes of one sector that are allocated and match
+ *        the filter: bit i is set for inodes[i]; computed 8 inodes at a
+ *        time with AVX2 when the CPU has it
+ * @param inodes the INODES_PER_SECTOR inodes of a sector
+ * @param filter the filter; NULL for all the allocated inodes
+ * @return the mask
+ */
+uint32_t inode_filter_mask(const struct inode *inodes, const struct inode_filter *filter);
+
+/**
+ * @brief inode_filter_mask() without SIMD, one inode at a time
+ */
+uint32_t inode_filter_mask_sw(const struct inode *inodes, const struct inode_filter *filter);
+
 /**
  * @brief read the content of an inode from disk
  * @param u the filesystem (IN)
@@ -92,11 +154,52 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
 int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off);
 
 /**
- * @brief alloc a new inode (returns its inr if possible)
+ * @brief identify the indirect sector that holds the address of a given
+ *        sector of a large file: one of i_addr[0..6] or, for a huge file,
+ *        an entry of the double-indirect sector i_addr[7]
+ * @param u the filesystem (IN)
+ * @param i the inode (IN)
+ * @param file_sec_off the offset within the file (in sector-size units)
+ * @return the indirect sector; <0 on error
+ */
+int inode_indirect(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off);
+
+/**
+ * @brief find the longest run of consecutive sectors on disk that holds
+ *        the file from a given offset on, so that it can be read or
+ *        written with a single I/O
+ * @param u the filesystem (IN)
+ * @param inode the inode (IN)
+ * @param first_off the offset of the first sector of the run within the
+ *        file (in sector-size units)
+ * @param max_count the maximal length of the run, >0
+ * @param phys_start the sector on disk of first_off, as inode_findsector() (OUT)
+ * @param run_len the number of sectors of the run, from 1 to max_count;
+ *        never beyond the end of the file (OUT)
+ * @return 0 on success; <0 on error
+ */
+int inode_map_range(const struct unix_filesystem *u, const struct inode *inode, int32_t first_off,
+                    uint32_t max_count, uint32_t *phys_start, uint32_t *run_len);
+
+/**
+ * @brief length of the run of consecutive sectors at the start of an
+ *        array of sector addresses
+ * @param addr the addresses (IN)
+ * @param n the number of addresses
+ * @param first the sector expected at addr[0]
+ * @return the largest k <= n such that addr[j] == first + j for j < k
+ */
+uint32_t inode_addr_run(const uint16_t *addr, uint32_t n, uint32_t first);
+
+/**
+ * @brief alloc a new inode (returns its inr if possible); several threads
+ *        may allocate at once
  * @param u the filesystem (IN)
+ * @param goal the free inode nearest to goal is taken, e.g. the
+ *        directory of the new inode; 0 for the first free inode
  * @return the inode number of the new inode or error code on error
  */
-int inode_alloc(struct unix_filesystem *u);
+int inode_alloc(struct unix_filesystem *u, uint16_t goal);
 
 /**
  * @brief write the content of an inode to disk
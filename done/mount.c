@@ -2,37 +2,348 @@
 
 #include "mount.h"
 #include "sector.h"
+#include "bdev.h"
+#include "csum.h"
 #include "error.h"
 #include "bmblock.h"
 #include "inode.h"
 #include <string.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
-void fill_ibm(struct unix_filesystem *u);
-void fill_fbm(struct unix_filesystem *u);
+#define MOUNT_BITS_PER_SECTOR (SECTOR_SIZE * 8) // elements of a bitmap per sector
+
+#define MOUNT_SCAN_INDIRECT 64 // indirect sectors read together by each scan of fill_bitmaps()
+#define MOUNT_SCAN_MAX_THREADS 16 // largest number of threads of fill_bitmaps()
+#define MOUNT_SCAN_MIN_SECTORS 256 // fewest inode sectors worth a thread of fill_bitmaps()
+
+static int fill_bitmaps(struct unix_filesystem *u, unsigned int nb_threads, struct aio_ctx *aio);
+static int mount_dev(struct bdev *dev, struct unix_filesystem *u, const struct mount_options *opts);
 
 int mountv6(const char *filename, struct unix_filesystem *u)
+{
+    return mountv6_opts(filename, u, NULL);
+}
+
+int mountv6_opts(const char *filename, struct unix_filesystem *u, const struct mount_options *opts)
 {
     M_REQUIRE_NON_NULL(filename);
     M_REQUIRE_NON_NULL(u);
+
+    enum bdev_type backend = (opts != NULL) ? opts->backend : BDEV_PREAD;
+    struct bdev *dev = bdev_open(filename, backend, 0); // open the disk in binary read and write mode
+    if(dev == NULL && backend == BDEV_MMAP) { // cannot be mapped: positional I/O
+        dev = bdev_open(filename, BDEV_PREAD, 0);
+    }
+    if(dev == NULL) { // open error
+        memset(u, 0, sizeof(*u));
+        return ERR_IO;
+    }
+
+    enum mount_checksums checksums = (opts != NULL) ? opts->checksums : MOUNT_CSUM_OFF;
+    char sidecar[FILENAME_MAX];
+    snprintf(sidecar, sizeof(sidecar), "%s.crc", filename);
+    if(checksums == MOUNT_CSUM_CREATE || (checksums == MOUNT_CSUM_USE && access(sidecar, F_OK) == 0)) {
+        struct bdev *csum = csum_open(dev, sidecar, checksums == MOUNT_CSUM_CREATE);
+        if(csum == NULL) { // unusable sidecar
+            bdev_close(dev);
+            memset(u, 0, sizeof(*u));
+            return ERR_IO;
+        }
+        dev = csum;
+    }
+
+    int error = mountv6_dev(dev, u, opts);
+    if(error) { // error occured, the disk is still ours
+        bdev_close(dev);
+    }
+    return error;
+}
+
+/**
+ * @brief tell whether the superblock has bitmap regions, with a bit for
+ *        every sector and every inode
+ */
+static int mount_has_bitmaps(const struct superblock *s)
+{
+    return s->s_fbmsize > 0 && s->s_ibmsize > 0
+           && s->s_fbm_start > SUPERBLOCK_SECTOR && s->s_ibm_start > SUPERBLOCK_SECTOR
+           && (uint32_t)s->s_fbmsize * MOUNT_BITS_PER_SECTOR >= s->s_fsize
+           && (uint32_t)s->s_ibmsize * MOUNT_BITS_PER_SECTOR >= (uint32_t)s->s_isize * INODES_PER_SECTOR;
+}
+
+/**
+ * @brief read a bitmap region of the disk into bm
+ * @param start the first sector of the region
+ * @param size the number of sectors of the region
+ * @return 0 on success; <0 on error
+ */
+static int mount_read_bitmap(struct unix_filesystem *u, struct bmblock_array *bm, uint16_t start, uint16_t size)
+{
+    uint64_t *words = malloc((size_t)size * SECTOR_SIZE);
+    int error = (words != NULL) ? bcache_read_range(u->cache, start, size, words) : ERR_NOMEM; // the region at once
+    error = error ? error : bm_load(bm, words, (size_t)size * SECTOR_SIZE / sizeof(uint64_t));
+    free(words);
+    return error;
+}
+
+/**
+ * @brief write bm to a bitmap region of the disk, through the cache
+ * @param start the first sector of the region
+ * @param size the number of sectors of the region
+ * @return 0 on success; <0 on error
+ */
+static int mount_write_bitmap(struct unix_filesystem *u, const struct bmblock_array *bm, uint16_t start, uint16_t size)
+{
+    uint64_t *words = malloc((size_t)size * SECTOR_SIZE);
+    int error = (words != NULL) ? bm_store(bm, words, (size_t)size * SECTOR_SIZE / sizeof(uint64_t)) : ERR_NOMEM;
+    for(uint16_t i = 0; !error && i < size; i++) {
+        error = bcache_write(u->cache, start + i, &(words[i * SECTOR_SIZE / sizeof(uint64_t)]));
+    }
+    free(words);
+    return error;
+}
+
+/**
+ * @brief fill both bitmaps: read them if umountv6() wrote them back,
+ *        otherwise rebuild them from the inodes and the files
+ * @param nb_threads the threads of the rebuild, see fill_bitmaps()
+ * @param aio the asynchronous reads of the rebuild, NULL for synchronous reads
+ * @return 0 on success; <0 if the rebuild failed (see fill_bitmaps())
+ */
+static int mount_build_bitmaps(struct unix_filesystem *u, unsigned int nb_threads, struct aio_ctx *aio)
+{
+    if(!((u->s).s_fmod == MOUNT_BM_CLEAN && mount_has_bitmaps(&(u->s)))
+       || mount_read_bitmap(u, u->ibm, (u->s).s_ibm_start, (u->s).s_ibmsize)
+       || mount_read_bitmap(u, u->fbm, (u->s).s_fbm_start, (u->s).s_fbmsize)) {
+        int error = fill_bitmaps(u, nb_threads, aio);
+        if(error) { // error occured
+            return error; // propagate error
+        }
+    }
+    for(unsigned int g = 0; g < u->nb_groups; g++) { // free sectors of each group
+        struct mount_group *group = &(u->groups[g]);
+        uint32_t size = group->last - group->first + 1;
+        group->free = size - bm_count(u->fbm, group->first, size);
+    }
+    return 0;
+}
+
+/**
+ * @brief divide the data sectors into MOUNT_GROUPS groups (fewer if a
+ *        group would have less than a 64 bits bloc); their free counts
+ *        are set by mount_build_bitmaps()
+ * @return 0 on success; <0 on error
+ */
+static int mount_alloc_groups(struct unix_filesystem *u)
+{
+    uint64_t nb = (u->fbm)->max - (u->fbm)->min + 1; // data sectors
+    uint64_t size = (nb + MOUNT_GROUPS - 1) / MOUNT_GROUPS;
+    size = (size + BITS_PER_VECTOR - 1) / BITS_PER_VECTOR * BITS_PER_VECTOR; // whole blocs
+    u->nb_groups = (nb + size - 1) / size;
+    u->groups = aligned_alloc(sizeof(struct mount_group), u->nb_groups * sizeof(struct mount_group));
+    if(u->groups == NULL) {
+        return ERR_NOMEM;
+    }
+    for(unsigned int g = 0; g < u->nb_groups; g++) {
+        uint64_t first = (u->fbm)->min + g * size;
+        uint64_t last = (first + size - 1 < (u->fbm)->max) ? first + size - 1 : (u->fbm)->max;
+        u->groups[g] = (struct mount_group) { first, last, 0 };
+    }
+    return 0;
+}
+
+/**
+ * @brief index of the group of a data sector
+ */
+static unsigned int mount_group_of(const struct unix_filesystem *u, uint32_t sector)
+{
+    uint32_t size = u->groups[0].last - u->groups[0].first + 1; // all groups but the last one
+    return (sector - u->groups[0].first) / size;
+}
+
+/**
+ * @brief add delta to the free counts of the groups, for each of the n
+ *        sectors from first
+ */
+static void mount_count_sectors(struct unix_filesystem *u, uint32_t first, uint32_t n, int delta)
+{
+    uint32_t end = first + n;
+    for(unsigned int g = mount_group_of(u, first); first < end && g < u->nb_groups; g++) {
+        struct mount_group *group = &(u->groups[g]);
+        uint32_t count = (end - 1 < group->last) ? end - first : group->last - first + 1; // sectors in the group
+        __atomic_fetch_add(&(group->free), delta * (int32_t)count, __ATOMIC_RELAXED);
+        first += count;
+    }
+}
+
+int mountv6_alloc_sectors(struct unix_filesystem *u, uint32_t n, uint32_t goal)
+{
+    M_REQUIRE_NON_NULL(u);
+    if(n == 0 || goal < (u->fbm)->min || goal > (u->fbm)->max) {
+        return ERR_BAD_PARAMETER;
+    }
+    int error = mountv6_bm_modified(u); // the on-disk bitmaps become stale
+    if(error) { // error occured
+        return error; // propagate error
+    }
+
+    unsigned int first_group = mount_group_of(u, goal);
+    for(unsigned int i = 0; i < u->nb_groups; i++) {
+        struct mount_group *group = &(u->groups[(first_group + i) % u->nb_groups]);
+        if(__atomic_load_n(&(group->free), __ATOMIC_RELAXED) < (int32_t)n) { // exhausted: the next group
+            continue;
+        }
+        int first = bm_atomic_claim_within(u->fbm, n, (i == 0) ? goal : group->first, group->first, group->last);
+        if(first >= 0) {
+            __atomic_fetch_sub(&(group->free), (int32_t)n, __ATOMIC_RELAXED);
+            return first;
+        }
+    }
+    if(n == 1) { // no group has a free sector
+        return ERR_BITMAP_FULL;
+    }
+    int first = bm_atomic_claim_run(u->fbm, n, goal); // a run larger than a group, or across groups
+    if(first >= 0) {
+        mount_count_sectors(u, first, n, -1);
+    }
+    return first;
+}
+
+void mountv6_free_sectors(struct unix_filesystem *u, uint32_t first, uint32_t n)
+{
+    if(u != NULL && n > 0) {
+        bm_atomic_clear_range(u->fbm, first, n);
+        mount_count_sectors(u, first, n, 1);
+    }
+}
+
+uint32_t mountv6_group_goal(const struct unix_filesystem *u, uint16_t inr)
+{
+    return u->groups[inr % u->nb_groups].first;
+}
+
+/**
+ * @brief background build of MOUNT_BM_PREBUILD, concurrent with the
+ *        reads of the filesystem: one thread, every sector through the
+ *        cache, and no aio, which belongs to the thread of the filesystem
+ */
+static void *mount_prebuild(void *arg)
+{
+    struct unix_filesystem *u = arg;
+    pthread_mutex_lock(&(u->bm_lock));
+    if(!__atomic_load_n(&(u->bm_ready), __ATOMIC_ACQUIRE) && mount_build_bitmaps(u, 1, NULL) == 0) {
+        __atomic_store_n(&(u->bm_ready), 1, __ATOMIC_RELEASE); // otherwise mountv6_bitmaps() tries again
+    }
+    pthread_mutex_unlock(&(u->bm_lock));
+    return NULL;
+}
+
+int mountv6_bitmaps(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    if(__atomic_load_n(&(u->bm_ready), __ATOMIC_ACQUIRE)) { // built: no lock
+        return 0;
+    }
+    pthread_mutex_lock(&(u->bm_lock)); // waits for a background build
+    if(!(u->bm_ready)) {
+        // the scan reads the inode table: the inodes written since the mount must be in it
+        int error = icache_sync(u);
+        if(error) { // error occured
+            pthread_mutex_unlock(&(u->bm_lock));
+            return error; // propagate error, built by the next call
+        }
+        // the threads of the rebuild read the disk directly: the writes since the mount must be on it
+        unsigned int nb_threads = u->scan_threads;
+        if(nb_threads != 1 && bcache_sync(u->cache)) {
+            nb_threads = 1;
+        }
+        error = mount_build_bitmaps(u, nb_threads, u->aio);
+        if(error) { // error occured
+            pthread_mutex_unlock(&(u->bm_lock));
+            return error; // propagate error, built by the next call
+        }
+        __atomic_store_n(&(u->bm_ready), 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(u->bm_lock));
+    return 0;
+}
+
+/**
+ * @brief release what mount_dev() allocated, except the disk
+ */
+static void mount_release(struct unix_filesystem *u)
+{
+    if(u->bm_thread_started) { // nothing may be freed under the background build
+        pthread_join(u->bm_thread, NULL);
+    }
+    pthread_mutex_destroy(&(u->bm_lock));
+    icache_free(u->icache);
+    bcache_free(u->cache);
+    aio_free(u->aio);
+    free(u->fbm);
+    free(u->ibm);
+    free(u->groups);
+    memset(u, 0, sizeof(*u));
+}
+
+int mountv6_dev(struct bdev *dev, struct unix_filesystem *u, const struct mount_options *opts)
+{
+    M_REQUIRE_NON_NULL(dev);
+    M_REQUIRE_NON_NULL(u);
+    int error = mount_dev(dev, u, opts);
+    if(error) { // error occured
+        mount_release(u);
+    }
+    return error;
+}
+
+/**
+ * @brief mountv6_dev() without the cleanup on error
+ */
+static int mount_dev(struct bdev *dev, struct unix_filesystem *u, const struct mount_options *opts)
+{
     //init u
     memset(u, 0, sizeof(*u));
+    pthread_mutex_init(&(u->bm_lock), NULL);
+    u->dev = dev;
 
+    u->cache = bcache_alloc(u->dev, (opts != NULL) ? opts->cache_size : 0); // buffer cache of the disk
+    if(u->cache == NULL) { // allocation error
+        return ERR_NOMEM;
+    }
+    u->icache = icache_alloc((opts != NULL) ? opts->icache_size : 0); // inode cache, on top of it
+    if(u->icache == NULL) { // allocation error
+        return ERR_NOMEM;
+    }
 
-    u->f = fopen(filename,"r+b"); // open file in u->f in binary read and write mode
-    if(u->f == NULL) { // open error
-        return ERR_IO;
+    int age = (opts != NULL) ? opts->flush_age_ms : 0; // background write-back
+    if(age >= 0) {
+        int error = bcache_start_flusher(u->cache, age, (opts != NULL) ? opts->flush_dirty : 0);
+        if(error) { // error occured
+            return error; // propagate error
+        }
     }
+
+    u->readahead = (opts != NULL) ? opts->readahead : 0; // used by filev6_open()
+
+    unsigned int depth = (opts != NULL) ? opts->aio_depth : 0; // queue depth of bulk reads
+    if(depth != 1 && dev->fd >= 0) { // no asynchronous I/O without a descriptor
+        u->aio = aio_alloc(u->dev, depth, AIO_AUTO); // on failure, bulk reads are synchronous
+    }
+
     uint8_t bootBlock[SECTOR_SIZE];
-    int error = sector_read(u->f,BOOTBLOCK_SECTOR,bootBlock); // read boot block sector
+    int error = bcache_read(u->cache,BOOTBLOCK_SECTOR,bootBlock); // read boot block sector
 
     if(!error && bootBlock[BOOTBLOCK_MAGIC_NUM_OFFSET] != BOOTBLOCK_MAGIC_NUM) { // no read error but magic num not found
         return ERR_BADBOOTSECTOR;
     } else if(error) { // read error
         return error;
     } else { // correctly mounted
-        int error = sector_read(u->f,SUPERBLOCK_SECTOR,&(u->s)); // read and return the returned value: 0 if success, error otherwise
+        int error = bcache_read(u->cache,SUPERBLOCK_SECTOR,&(u->s)); // read and return the returned value: 0 if success, error otherwise
         if(error) { // error occured
             return error; // propagate error
         }
@@ -46,9 +357,22 @@ int mountv6(const char *filename, struct unix_filesystem *u)
         uint64_t max_fbm = (u->s).s_fsize-1; // data sectors end
         u->fbm = bm_alloc(min_fbm, max_fbm); // allocate data sectors bitmaps
         M_REQUIRE_NON_NULL(u->fbm); // require non NULL
+        error = mount_alloc_groups(u);
+        if(error) { // error occured
+            return error; // propagate error
+        }
 
-        fill_ibm(u); // fill bitmap vector
-        fill_fbm(u); // fill bitmap vector
+        u->scan_threads = (opts != NULL) ? opts->scan_threads : 0;
+        enum mount_bitmaps when = (opts != NULL) ? opts->bitmaps : MOUNT_BM_EAGER;
+        if(when == MOUNT_BM_EAGER) {
+            error = mount_build_bitmaps(u, u->scan_threads, u->aio);
+            if(error) { // error occured: the bitmaps could hand out used sectors
+                return error; // propagate error
+            }
+            u->bm_ready = 1;
+        } else if(when == MOUNT_BM_PREBUILD && pthread_create(&(u->bm_thread), NULL, mount_prebuild, u) == 0) {
+            u->bm_thread_started = 1;
+        } // otherwise built by the first mountv6_bitmaps()
 
         return 0;
     }
@@ -78,105 +402,431 @@ void mountv6_print_superblock(const struct unix_filesystem *u)
 
 }
 
-int umountv6(struct unix_filesystem *u)
+int mountv6_bm_modified(struct unix_filesystem *u)
 {
     M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
-    if(!fclose(u->f)) { // closed
-        free(u->fbm); // free allocated space
-        free(u->ibm); // free allocated space
-        u->f = NULL; // init f
+    if(__atomic_load_n(&(u->bm_dirty), __ATOMIC_ACQUIRE)) { // already known
         return 0;
-    } else { // error upon closing
-        return ERR_IO;
     }
-
+    pthread_mutex_lock(&(u->bm_lock)); // the other allocating threads wait until the flag is cleared on the disk
+    int error = 0;
+    if(!(u->bm_dirty) && (u->s).s_fmod == MOUNT_BM_CLEAN) { // otherwise the bitmaps of the disk are not used anyway
+        (u->s).s_fmod = 0;
+        error = bcache_write(u->cache, SUPERBLOCK_SECTOR, &(u->s));
+        error = error ? error : bcache_sync(u->cache); // on the disk before the changes
+        if(error) { // the disk may still say clean: no change may be made
+            (u->s).s_fmod = MOUNT_BM_CLEAN;
+        }
+    }
+    if(!error) {
+        __atomic_store_n(&(u->bm_dirty), 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(u->bm_lock));
+    return error;
 }
 
-void fill_ibm(struct unix_filesystem *u)
+void mountv6_bm_failed(struct unix_filesystem *u)
 {
-    struct bmblock_array *ibm = u->ibm;
-
-    for(uint64_t i = ibm->min; i <= ibm->max; i++) { // iterate over all elements
-        bm_clear(ibm, i); // default value
+    if(u != NULL) {
+        __atomic_store_n(&(u->bm_failed), 1, __ATOMIC_RELEASE);
     }
+}
 
-    uint16_t sector = (u->s).s_inode_start; // number of first sector of inodes
-    uint16_t size = (u->s).s_isize; // number of sectors containing inodes
+int umountv6(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+    int error = icache_sync(u); // the inodes first: their sectors go with the others
+    int trusted = !__atomic_load_n(&(u->bm_failed), __ATOMIC_ACQUIRE); // otherwise the next mount rebuilds them
+    if(!error && u->bm_dirty && trusted && mount_has_bitmaps(&(u->s))) { // the bitmaps, then the flag that makes them valid
+        error = mount_write_bitmap(u, u->ibm, (u->s).s_ibm_start, (u->s).s_ibmsize);
+        error = error ? error : mount_write_bitmap(u, u->fbm, (u->s).s_fbm_start, (u->s).s_fbmsize);
+        error = error ? error : bcache_sync(u->cache);
+        if(!error) {
+            (u->s).s_fmod = MOUNT_BM_CLEAN;
+            error = bcache_write(u->cache, SUPERBLOCK_SECTOR, &(u->s));
+        }
+    }
+    error = error ? error : bcache_sync(u->cache); // write back dirty sectors
+    if(error) { // error occured
+        return error; // propagate error, filesystem stays mounted
+    }
+    struct bdev *dev = u->dev;
+    mount_release(u); // free caches, bitmaps and init u
+    if(bdev_close(dev)) { // error upon closing
+        return ERR_IO;
+    }
+    return 0;
+}
 
-    uint64_t current = ibm->min; // current inode
+int mountv6_sync(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+    int error = icache_sync(u); // into the buffer cache
+    return error ? error : bcache_sync(u->cache); // then to the disk
+}
 
-    // iteration on the inode sectors
-    for(uint32_t s = 0; s < size; ++s) {
-        struct inode inodes[INODES_PER_SECTOR];
-        int error = sector_read(u->f, sector + s, inodes);
+/**
+ * @brief a part of the inode table scanned by fill_bitmaps(), with the
+ *        bitmaps it fills and what it read
+ */
+struct mount_worker {
+    struct unix_filesystem *u;     // the filesystem
+    uint32_t first;                // first inode sector, relative to s_inode_start
+    uint32_t end;                  // end of the part, relative to s_inode_start
+    int direct;                    // read the disk directly instead of through the cache
+    struct aio_ctx *aio;           // asynchronous reads through the cache, NULL for synchronous reads
+    struct bmblock_array *ibm;     // inode bitmap to fill
+    struct bmblock_array *fbm;     // sector bitmap to fill
+    struct mount_scan scan;        // sectors read
+    int error;                     // first read error: the sector bitmap is then incomplete
+    pthread_t thread;
+};
+
+/**
+ * @brief read several runs of sectors for a worker: through the cache and
+ *        aio, or straight from the disk by each thread
+ * @return 0 if all runs were read; the first error (<0) otherwise
+ */
+static int read_runs(struct mount_worker *w, struct aio_req *runs, size_t n)
+{
+    if(!(w->direct)) {
+        return bcache_read_runs((w->u)->cache, w->aio, runs, n);
+    }
+    int error = 0;
+    for(size_t r = 0; r < n; r++) {
+        runs[r].result = bdev_read((w->u)->dev, runs[r].sector, runs[r].count, runs[r].data);
+        error = error ? error : runs[r].result;
+    }
+    return error;
+}
 
-        // iteration on the sector's inodes
-        for(int i = 0; i < INODES_PER_SECTOR; ++i) {
-            if(s == 0 && i == 0) { // if read first sector and current inode is inode 0
-                i += 2; // skip first two inodes (number 0 and 1)
-            }
+/**
+ * @brief read the chunks of INODE_SCAN_SECTORS inode sectors starting at
+ *        sector s of the inode table (at most INODE_SCAN_BATCH of them,
+ *        before the end of the part of the worker), all in flight together
+ * @param w the worker
+ * @param s the first sector of the batch, relative to s_inode_start
+ * @param reqs the chunks (OUT: result of each chunk)
+ * @param inodes room for INODE_SCAN_BATCH chunks of inodes (OUT)
+ * @return the number of chunks of the batch
+ */
+static size_t read_inode_batch(struct mount_worker *w, uint32_t s, struct aio_req *reqs, struct inode *inodes)
+{
+    uint32_t size = w->end; // end of the inode sectors to read
+    size_t nb = 0;
+    for(; nb < INODE_SCAN_BATCH && s < size; nb++, s += INODE_SCAN_SECTORS) {
+        reqs[nb].sector = ((w->u)->s).s_inode_start + s;
+        reqs[nb].count = (size - s < INODE_SCAN_SECTORS) ? size - s : INODE_SCAN_SECTORS; // number of sectors to read
+        reqs[nb].data = &(inodes[nb * INODE_SCAN_SECTORS * INODES_PER_SECTOR]);
+        reqs[nb].write = 0;
+    }
+    int error = (inodes != NULL) ? read_runs(w, reqs, nb) : ERR_NOMEM;
+    for(size_t c = 0; error == ERR_NOMEM && c < nb; c++) { // the batch could not be started: every chunk failed
+        reqs[c].result = error;
+    }
+    return nb;
+}
 
-            // if an error occured while reading the sector, consider
-            // all inodes as allocated. Otherwise, check if the inode is
-            // allocated.
-            if(error || (inodes[i].i_mode & IALLOC)) {
-                bm_set(ibm, current);
+/**
+ * @brief mark the sectors of n addresses as used, a run of consecutive
+ *        sectors at a time; the 0 addresses (holes) are skipped
+ */
+static void mark_sectors(struct bmblock_array *fbm, const uint16_t *addr, uint32_t n)
+{
+    uint32_t k = 0;
+    while(k < n) {
+        uint32_t run = (addr[k] > 0) ? inode_addr_run(&(addr[k]), n - k, addr[k]) : 1;
+        if(addr[k] > 0 && addr[k] >= fbm->min && addr[k] + run - 1 <= fbm->max) {
+            bm_set_range(fbm, addr[k], run); // update sectors state to be used
+        } else {
+            for(uint32_t j = k; addr[k] > 0 && j < k + run; j++) { // partly out of range: only the sectors in range
+                bm_set(fbm, addr[j]);
             }
-            current++;
         }
+        k += run;
     }
 }
 
-void fill_fbm(struct unix_filesystem *u)
+/**
+ * @brief indirect sectors queued by fill_part(), with the number of
+ *        addresses of each one that belong to its file; indirect sectors
+ *        queued one after the other that are contiguous on disk share a
+ *        single read
+ */
+struct mount_indirect {
+    struct aio_req reqs[MOUNT_SCAN_INDIRECT]; // reads of the queued sectors
+    uint32_t used[MOUNT_SCAN_INDIRECT];
+    uint16_t addr[MOUNT_SCAN_INDIRECT][ADDRESSES_PER_SECTOR];
+    size_t nb; // queued sectors
+    size_t nb_reqs; // reads of the queued sectors
+};
+
+/**
+ * @brief queue the read of an indirect sector of a file
+ * @param sector the indirect sector
+ * @param used the number of its addresses that belong to the file
+ */
+static void queue_indirect(struct mount_indirect *ind, uint16_t sector, uint32_t used)
 {
-    struct bmblock_array *fbm = u->fbm;
-
-    for(uint64_t i = fbm->min; i <= fbm->max; i++) { // iterate over all elements
-        bm_clear(u->fbm, i); // default value
+    struct aio_req *last = (ind->nb_reqs > 0) ? &(ind->reqs[ind->nb_reqs - 1]) : NULL;
+    if(last != NULL && last->sector + last->count == sector) { // follows the previous read on disk and in addr
+        last->count++;
+    } else {
+        ind->reqs[ind->nb_reqs] = (struct aio_req) { sector, 1, ind->addr[ind->nb], 0, 0 };
+        ind->nb_reqs++;
     }
+    ind->used[ind->nb] = used;
+    ind->nb++;
+}
 
-    uint16_t sector = (u->s).s_inode_start; // number of first sector of inodes
-    uint16_t size = (u->s).s_isize; // number of sectors containing inodes
-
-    // iteration on the inode sectors
-    for(uint32_t s = 0; s < size; ++s) {
-        struct inode inodes[INODES_PER_SECTOR];
-        int error = sector_read(u->f, sector + s, inodes);
+/**
+ * @brief read the queued indirect sectors, all in flight together, and
+ *        mark the data sectors they address; a failed read is recorded
+ *        in w->error
+ */
+static void fill_indirect(struct mount_worker *w, struct mount_indirect *ind)
+{
+    int error = read_runs(w, ind->reqs, ind->nb_reqs); // the result of each read is checked below
+    w->error = w->error ? w->error : error;
+    size_t k = 0; // queued sector
+    for(size_t r = 0; r < ind->nb_reqs; r++) {
+        for(uint32_t c = 0; c < ind->reqs[r].count; c++, k++) {
+            if(ind->reqs[r].result == 0) {
+                mark_sectors(w->fbm, ind->addr[k], ind->used[k]);
+            }
+        }
+    }
+    (w->scan).indirect_sectors += ind->nb;
+    (w->scan).indirect_reads += ind->nb_reqs;
+    ind->nb = 0;
+    ind->nb_reqs = 0;
+}
 
-        if(!error) { // no error occured
-            // iteration on the sector's inodes
-            for(int i = 0; i < INODES_PER_SECTOR; ++i) {
-                if(s == 0 && i == 0) { // if read first sector and current inode is inode 0
-                    i += 1; // skip first inode (number 0)
+/**
+ * @brief scan the part of the inode table of a worker: the inode table is
+ *        read once, each inode marks the inode bitmap and its direct
+ *        sectors, the indirect sectors are read MOUNT_SCAN_INDIRECT at a
+ *        time (each exactly once) to mark the sectors they address. A
+ *        sector that cannot be read leaves sectors of files unmarked,
+ *        which could be allocated again: its error is kept in w->error
+ */
+static void fill_part(struct mount_worker *w)
+{
+    struct bmblock_array *ibm = w->ibm;
+    struct bmblock_array *fbm = w->fbm;
+    uint32_t smallFileMaxSize = ADDR_SMALL_LENGTH * SECTOR_SIZE; // small file is 8 * 512 bytes = 4 Kbytes
+
+    struct inode *inodes = malloc(INODE_SCAN_BATCH * INODE_SCAN_SECTORS * SECTOR_SIZE);
+    struct mount_indirect *ind = malloc(sizeof(struct mount_indirect));
+    if(ind != NULL) {
+        ind->nb = 0;
+        ind->nb_reqs = 0;
+    }
+    w->error = (inodes != NULL && ind != NULL) ? 0 : ERR_NOMEM;
+
+    // iteration on the inode sectors, INODE_SCAN_BATCH chunks of INODE_SCAN_SECTORS at a time
+    for(uint32_t b = w->first; b < w->end; b += INODE_SCAN_BATCH * INODE_SCAN_SECTORS) {
+        struct aio_req reqs[INODE_SCAN_BATCH];
+        size_t nb = read_inode_batch(w, b, reqs, (ind != NULL) ? inodes : NULL);
+
+        for(size_t c = 0; c < nb; c++) {
+            uint32_t s = reqs[c].sector - ((w->u)->s).s_inode_start; // first sector of the chunk
+            struct inode *chunk = reqs[c].data;
+            int error = reqs[c].result;
+            w->error = w->error ? w->error : error;
+            (w->scan).inode_sectors += reqs[c].count;
+
+            // iteration on the sectors, then on their allocated inodes
+            for(uint32_t sec = 0; sec < reqs[c].count; sec++) {
+                struct inode *sectorInodes = &(chunk[sec * INODES_PER_SECTOR]);
+                uint32_t firstInr = (s + sec) * INODES_PER_SECTOR; // inode number of sectorInodes[0]
+
+                // if an error occured while reading the sectors, consider
+                // all inodes as allocated, and their sectors as unknown (the
+                // scan fails)
+                for(uint32_t i = 0; error && i < INODES_PER_SECTOR; i++) {
+                    bm_set(ibm, firstInr + i); // out of range (thus ignored) for inode 0
+                }
+                uint32_t mask = error ? 0 : inode_filter_mask(sectorInodes, NULL); // allocated inodes, bit i for sectorInodes[i]
+                if(firstInr == 0) { // inode 0 is not used
+                    mask &= ~1u;
                 }
 
-                uint32_t size = inode_getsize(&(inodes[i])); // file size
-                uint32_t smallFileMaxSize = ADDR_SMALL_LENGTH * SECTOR_SIZE; // small file is 8 * 512 bytes = 4 Kbytes
-                uint32_t largeFileMaxSize = (ADDR_SMALL_LENGTH - 1) * ADDRESSES_PER_SECTOR * SECTOR_SIZE; // large file is 7 * 256 * 512 bytes = 896 Kbytes
-
-                if(size > smallFileMaxSize && size <= largeFileMaxSize) { // file is a large file
-                    for(int j = 0; j < ADDR_SMALL_LENGTH-1; j++) { // iterate on indirect sector
-                        int sectorNb = inodes[i].i_addr[j]; // get indirect sector numbers
-                        if(sectorNb > 0) {
-                            bm_set(fbm, sectorNb); // update sector state to be used
+                while(mask != 0) {
+                    uint32_t i = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    struct inode *inode = &(sectorInodes[i]);
+                    bm_set(ibm, firstInr + i); // out of range (thus ignored) for the root inode
+
+                    uint32_t fileSize = inode_getsize(inode); // file size
+                    uint32_t nbSectors = fileSize / SECTOR_SIZE + ((fileSize % SECTOR_SIZE == 0) ? 0 : 1); // data sectors of the file
+                    if(fileSize > smallFileMaxSize) { // file is a large file
+                        int huge = (nbSectors > ADDR_LARGE_SECTORS); // i_addr[7] is its double-indirect sector
+                        mark_sectors(fbm, inode->i_addr, huge ? ADDR_SMALL_LENGTH : ADDR_SMALL_LENGTH-1); // the indirect sectors
+                        // the indirect sectors beyond i_addr[0..6], read right away (rare)
+                        uint16_t dind[ADDRESSES_PER_SECTOR];
+                        struct aio_req dreq = { inode->i_addr[ADDR_SMALL_LENGTH-1], 1, dind, 0, 0 };
+                        uint32_t nbIndirect = (nbSectors + ADDRESSES_PER_SECTOR - 1) / ADDRESSES_PER_SECTOR;
+                        if(huge && ind != NULL) {
+                            read_runs(w, &dreq, 1); // its result is checked below
+                            if(dreq.result == 0) {
+                                mark_sectors(fbm, dind, nbIndirect - (ADDR_SMALL_LENGTH-1));
+                            } else { // the sectors under it are unknown
+                                w->error = w->error ? w->error : dreq.result;
+                            }
+                            (w->scan).indirect_sectors++;
+                            (w->scan).indirect_reads++;
+                        }
+                        for(uint32_t j = 0; ind != NULL && j < nbIndirect && (j < ADDR_SMALL_LENGTH-1 || dreq.result == 0); j++) { // queue the indirect sectors
+                            uint32_t left = nbSectors - j * ADDRESSES_PER_SECTOR; // data sectors from this one
+                            uint16_t sector = (j < ADDR_SMALL_LENGTH-1) ? inode->i_addr[j] : dind[j - (ADDR_SMALL_LENGTH-1)];
+                            queue_indirect(ind, sector, (left < ADDRESSES_PER_SECTOR) ? left : ADDRESSES_PER_SECTOR);
+                            if(ind->nb == MOUNT_SCAN_INDIRECT) {
+                                fill_indirect(w, ind);
+                            }
                         }
+                    } else { // small file: direct addresses
+                        uint32_t j = 0;
+                        while(j < nbSectors && inode->i_addr[j] > 0) { // up to the first hole
+                            j++;
+                        }
+                        mark_sectors(fbm, inode->i_addr, j);
                     }
                 }
-                int32_t offset = 0; // offset of sector of inode
-                int sectorNb = inode_findsector(u, &(inodes[i]), offset); // find sector number of given offset
-                while(sectorNb > 0) { // iterate while not last sector used
-                    bm_set(fbm, sectorNb); // update sector state to be used
-                    offset++; // next offset
-                    sectorNb = inode_findsector(u, &(inodes[i]), offset); // find sector number of given offset
-                }
-
             }
+        }
+    }
+    if(ind != NULL && ind->nb > 0) {
+        fill_indirect(w, ind);
+    }
+    free(ind);
+    free(inodes);
+}
+
+static void *fill_worker(void *arg)
+{
+    fill_part(arg);
+    return NULL;
+}
 
+/**
+ * @brief rebuild both bitmaps from the inodes and the files
+ * @param nb_threads the threads of the scan, 0 for one per CPU; fewer
+ *        for small inode tables
+ * @param aio the asynchronous reads of the scan, NULL for synchronous reads
+ * @return 0 on success; <0 if a sector could not be read, or memory
+ *         allocated: the bitmaps are then incomplete and must not be used
+ */
+static int fill_bitmaps(struct unix_filesystem *u, unsigned int nb_threads, struct aio_ctx *aio)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bm_clear_range(u->ibm, (u->ibm)->min, (u->ibm)->max - (u->ibm)->min + 1); // default value
+    bm_clear_range(u->fbm, (u->fbm)->min, (u->fbm)->max - (u->fbm)->min + 1); // default value
+
+    // threads: one per CPU by default, each with MOUNT_SCAN_MIN_SECTORS inode sectors at least
+    uint32_t size = (u->s).s_isize; // number of sectors containing inodes
+    if(nb_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = (cpus > 0) ? cpus : 1;
+    }
+    nb_threads = (nb_threads > MOUNT_SCAN_MAX_THREADS) ? MOUNT_SCAN_MAX_THREADS : nb_threads;
+    if(nb_threads > size / MOUNT_SCAN_MIN_SECTORS) {
+        nb_threads = (size / MOUNT_SCAN_MIN_SECTORS > 0) ? size / MOUNT_SCAN_MIN_SECTORS : 1;
+    }
+    uint32_t per = (size + nb_threads - 1) / nb_threads; // inode sectors per thread, whole chunks
+    per = (per + INODE_SCAN_SECTORS - 1) / INODE_SCAN_SECTORS * INODE_SCAN_SECTORS;
+
+    struct mount_worker workers[MOUNT_SCAN_MAX_THREADS];
+    unsigned int nb = 0; // workers with their own bitmaps
+    for(; nb + 1 < nb_threads && nb * per < size; nb++) { // the caller scans the last part
+        struct mount_worker *w = &(workers[nb]);
+        // nothing in the cache is dirty (mount, or mountv6_bitmaps()): the disk can be read directly, from every thread
+        *w = (struct mount_worker) { u, nb * per, (size - nb * per < per) ? size : nb * per + per, 1, NULL,
+                                     bm_alloc((u->ibm)->min, (u->ibm)->max), bm_alloc((u->fbm)->min, (u->fbm)->max),
+                                     { 0, 0, 0, 0, 0 }, 0, 0 };
+        if(w->ibm == NULL || w->fbm == NULL || pthread_create(&(w->thread), NULL, fill_worker, w)) {
+            free(w->ibm);
+            free(w->fbm);
+            break; // the rest is scanned by the caller
         }
+    }
+
+    struct mount_worker last = { u, nb * per, size, nb > 0, aio, u->ibm, u->fbm, { 0, 0, 0, 0, 0 }, 0, 0 }; // what is left
+    fill_part(&last);
+    u->scan = last.scan;
+    int error = last.error;
+    for(unsigned int t = 0; t < nb; t++) { // merge the partial bitmaps
+        pthread_join(workers[t].thread, NULL);
+        error = error ? error : workers[t].error;
+        bm_or(u->ibm, workers[t].ibm);
+        bm_or(u->fbm, workers[t].fbm);
+        free(workers[t].ibm);
+        free(workers[t].fbm);
+        (u->scan).inode_sectors += workers[t].scan.inode_sectors;
+        (u->scan).indirect_sectors += workers[t].scan.indirect_sectors;
+        (u->scan).indirect_reads += workers[t].scan.indirect_reads;
+    }
+    (u->scan).threads = nb + ((last.first < last.end) ? 1 : 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    (u->scan).seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    return error;
+}
 
+/**
+ * @brief write the bitmap region of a new filesystem: elements from min
+ *        to max unused, the others used
+ * @return 0 on success; <0 on error
+ */
+static int mkfs_bitmap(struct bdev *dev, uint16_t start, uint16_t size, uint64_t min, uint64_t max)
+{
+    struct bmblock_array *bm = bm_alloc(min, max);
+    uint64_t *words = malloc((size_t)size * SECTOR_SIZE);
+    int error = (bm != NULL && words != NULL) ? bm_store(bm, words, (size_t)size * SECTOR_SIZE / sizeof(uint64_t)) : ERR_NOMEM;
+    error = error ? error : bdev_write(dev, start, size, words);
+    free(words);
+    free(bm);
+    return error;
+}
 
+/**
+ * @brief fill the superblock of a new filesystem
+ * @return 0 on success; <0 on error
+ */
+static int mkfs_superblock(struct superblock *s, uint16_t num_blocks, uint16_t num_inodes)
+{
+    memset(s, 0, sizeof(struct superblock));
+    if(num_blocks == 0 || num_inodes == 0) {
+        return ERR_BAD_PARAMETER;
     }
+
+    s->s_isize = (num_inodes / INODES_PER_SECTOR) + ((num_inodes % INODES_PER_SECTOR == 0) ? 0 : 1); // number of blocks containing inodes, minimum 1
+    uint32_t nb_inodes = (uint32_t)s->s_isize * INODES_PER_SECTOR; // inodes of the inode sectors
+
+    s->s_fbm_start = SUPERBLOCK_SECTOR + 1; // bitmaps follow the superblock
+    s->s_fbmsize = num_blocks / MOUNT_BITS_PER_SECTOR + ((num_blocks % MOUNT_BITS_PER_SECTOR == 0) ? 0 : 1);
+    s->s_ibm_start = s->s_fbm_start + s->s_fbmsize;
+    s->s_ibmsize = nb_inodes / MOUNT_BITS_PER_SECTOR + ((nb_inodes % MOUNT_BITS_PER_SECTOR == 0) ? 0 : 1);
+    s->s_fmod = MOUNT_BM_CLEAN; // written by mountv6_mkfs_dev()
+
+    s->s_inode_start = s->s_ibm_start + s->s_ibmsize; // start of blocks containing inodes
+    s->s_block_start = s->s_inode_start + s->s_isize; // start of data blocks
+    s->s_fsize = num_blocks; // total number of blocks
+
+    if(s->s_fsize < s->s_isize + num_inodes) { // should have at least one block per inodes block + one block per inode created
+        return ERR_NOT_ENOUGH_BLOCS; // return appropriate error code
+    }
+    // the bitmaps and the inodes must fit, with room for a data sector
+    // of the root directory (the data bitmap starts after s_block_start)
+    uint32_t blockStart = (uint32_t)s->s_ibm_start + s->s_ibmsize + s->s_isize; // s_block_start, without overflow
+    if(blockStart + 1 >= s->s_fsize) {
+        return ERR_NOT_ENOUGH_BLOCS;
+    }
+    return 0;
 }
 
 int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
@@ -184,52 +834,70 @@ int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
     M_REQUIRE_NON_NULL(filename);
 
     struct superblock s;
-    memset(&s, 0, sizeof(struct superblock));
+    int error = mkfs_superblock(&s, num_blocks, num_inodes);
+    if(error) { // checked before creating the file
+        return error;
+    }
 
-    s.s_inode_start = SUPERBLOCK_SECTOR + 1; // start of blocks containing inodes
+    struct bdev *dev = bdev_open(filename, BDEV_PREAD, 1); //open new file
+    if(dev == NULL) { // open error
+        return ERR_IO; // return appropriate error code
+    }
+    error = mountv6_mkfs_dev(dev, num_blocks, num_inodes);
+    if(bdev_close(dev) && !error) { // error upon closing
+        return ERR_IO;
+    }
+    char sidecar[FILENAME_MAX];
+    snprintf(sidecar, sizeof(sidecar), "%s.crc", filename);
+    unlink(sidecar); // checksums of the old content, if any
+    return error;
+}
 
-    s.s_isize = (num_inodes / INODES_PER_SECTOR) + ((num_inodes % INODES_PER_SECTOR == 0) ? 0 : 1); // number of blocks containing inodes, minimum 1
-    s.s_block_start = s.s_inode_start + s.s_isize; // start of data blocks
-    s.s_fsize = num_blocks; // total number of blocks
+int mountv6_mkfs_dev(struct bdev *dev, uint16_t num_blocks, uint16_t num_inodes)
+{
+    M_REQUIRE_NON_NULL(dev);
 
-    if(s.s_fsize < s.s_isize + num_inodes) { // should have at least one block per inodes block + one block per inode created
-        return ERR_NOT_ENOUGH_BLOCS; // return appropriate error code
+    struct superblock s;
+    int error = mkfs_superblock(&s, num_blocks, num_inodes);
+    if(error) { // error occured
+        return error; // propagate error
     }
 
-    FILE *f = fopen(filename,"w+b"); //open new file
-    if(f == NULL) { // open error
-        return ERR_IO; // return appropriate error code
-    }
     uint8_t bootBlock[SECTOR_SIZE]; //create boot block sector
+    memset(bootBlock, 0, sizeof(bootBlock));
+    int lastError = bdev_write(dev, num_blocks - 1, 1, bootBlock); // full size at once: the unwritten sectors are holes of the image
+    if(lastError) { // error occured
+        return lastError; // propagate error
+    }
     bootBlock[BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM; // set magic number
-    int bootBlockError = sector_write(f, BOOTBLOCK_SECTOR, bootBlock); //write boot block sector
-    if(bootBlockError) { //error occured while trying to write the boot block sector
-        fclose(f); // close file
-        return bootBlockError; // propagate error
+    struct sector_iovec header[] = { // boot block and superblock are contiguous: written with a single I/O
+        { BOOTBLOCK_SECTOR, bootBlock },
+        { SUPERBLOCK_SECTOR, &s }
+    };
+    int headerError = bdev_writev(dev, header, sizeof(header) / sizeof(header[0])); //write boot block and superblock sectors
+    if(headerError) { //error occured while trying to write the boot block or the superblock sector
+        return headerError; // propagate error
     }
 
-    int superblockError = sector_write(f, SUPERBLOCK_SECTOR, &s); //write superblock sector
-    if(superblockError) { //error occured while trying to write the superblock sector
-        fclose(f); // close file
-        return superblockError; // propagate error
+    // the same ranges as the bitmaps of mountv6()
+    int bitmapError = mkfs_bitmap(dev, s.s_fbm_start, s.s_fbmsize, s.s_block_start + 1, s.s_fsize - 1);
+    bitmapError = bitmapError ? bitmapError : mkfs_bitmap(dev, s.s_ibm_start, s.s_ibmsize, ROOT_INUMBER + 1,
+                  (uint32_t)s.s_isize * INODES_PER_SECTOR - 1);
+    if(bitmapError) {
+        return bitmapError; // propagate error
     }
 
-    for(uint16_t i = s.s_inode_start; i < s.s_block_start ; i++) { // iterate on inodes blocks
-        struct inode inodes[INODES_PER_SECTOR];
-        memset(inodes, 0, sizeof(struct inode)*INODES_PER_SECTOR); // set all values of the inodes array to zero
-        if(i == s.s_inode_start) { // sector containing root
-            inodes[ROOT_INUMBER].i_mode = IALLOC | IFDIR;
-        }
-        int writeError = sector_write(f, i, inodes); //write the modified array to appropriate sector
+    struct inode inodes[INODE_SCAN_SECTORS * INODES_PER_SECTOR];
+    memset(inodes, 0, sizeof(inodes)); // set all values of the inodes array to zero
+    inodes[ROOT_INUMBER].i_mode = IALLOC | IFDIR; // root is in the first inode sector
+    for(uint32_t i = s.s_inode_start; i < s.s_block_start ; i += INODE_SCAN_SECTORS) { // iterate on inodes blocks, INODE_SCAN_SECTORS at a time
+        uint32_t nb = (s.s_block_start - i < INODE_SCAN_SECTORS) ? s.s_block_start - i : INODE_SCAN_SECTORS; // number of sectors to write
+        int writeError = bdev_write(dev, i, nb, inodes); //write the array to appropriate sectors
         if(writeError) {
-            fclose(f); // close file
             return writeError; // propagate error
         }
+        inodes[ROOT_INUMBER].i_mode = 0; // next sectors don't contain root
     }
 
-    if(!fclose(f)) { // closed
-        return 0;
-    } else { // error upon closing
-        return ERR_IO;
-    }
+    return bdev_flush(dev);
 }
@@ -9,28 +9,136 @@
  */
 
 #include <stdio.h>
+#include <pthread.h>
 #include "unixv6fs.h"
 #include "bmblock.h"
+#include "bcache.h"
+#include "icache.h"
+#include "aio.h"
+#include "bdev.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define MOUNT_BM_CLEAN 0xc1       /* s_fmod of a filesystem whose on-disk bitmaps are up to date */
+#define MOUNT_GROUPS 16           /* allocation groups of the data sectors, fewer on small disks */
+
+/**
+ * @brief an allocation group: a range of the data sectors, made of whole
+ *        64 bits blocs of u->fbm so that groups never share a bloc
+ */
+struct mount_group {
+    uint32_t first;                /* first sector of the group */
+    uint32_t last;                 /* last sector of the group */
+    int32_t free;                  /* free sectors of the group, changed atomically */
+} __attribute__((aligned(64)));   /* one cache line each: the counters of the groups do not contend */
+
+/**
+ * @brief what the scan of the inodes read to rebuild the bitmaps at mount
+ */
+struct mount_scan {
+    uint32_t inode_sectors;        /* sectors of the inode table */
+    uint32_t indirect_sectors;     /* indirect sectors of the large files */
+    uint32_t indirect_reads;       /* reads of the indirect sectors, contiguous ones together */
+    unsigned int threads;          /* threads that scanned a part of the inode table */
+    double seconds;                /* wall time of the scan */
+};
+
 struct unix_filesystem {
-    FILE *f;
+    struct bdev *dev;              /* the disk, NULL if not mounted */
     struct superblock s;           /* copy of the superblock */
     struct bmblock_array *fbm;     /* block bitmmap -- ignore before WEEK 10 */
     struct bmblock_array *ibm;     /* inode bitmap  -- ignore before WEEK 10 */
+    struct bcache *cache;          /* buffer cache, all sector accesses go through it */
+    struct icache *icache;         /* inode cache, all inode accesses go through it */
+    struct aio_ctx *aio;           /* asynchronous reads of bulk work, NULL for synchronous reads */
+    int readahead;                 /* largest readahead window of the files, see struct mount_options */
+    int bm_dirty;                  /* the bitmaps changed since the mount, see mountv6_bm_modified() */
+    int bm_failed;                 /* a change of the bitmaps may be left undone, see mountv6_bm_failed() */
+    struct mount_scan scan;        /* the scan of the mount, all zero if the bitmaps were read from the disk */
+    int bm_ready;                  /* fbm and ibm are built, see mountv6_bitmaps() */
+    unsigned int scan_threads;     /* threads of the scan, see struct mount_options */
+    pthread_mutex_t bm_lock;       /* held while the bitmaps are built */
+    pthread_t bm_thread;           /* background build of MOUNT_BM_PREBUILD */
+    int bm_thread_started;         /* bm_thread must be joined */
+    struct mount_group *groups;    /* allocation groups of u->fbm, see mountv6_alloc_sectors() */
+    unsigned int nb_groups;        /* number of groups */
+};
+
+enum mount_checksums {
+    MOUNT_CSUM_OFF,                /* no checksums */
+    MOUNT_CSUM_USE,                /* verify the sectors if the sidecar file exists */
+    MOUNT_CSUM_CREATE              /* verify the sectors, create the sidecar file if needed */
+};
+
+enum mount_bitmaps {
+    MOUNT_BM_EAGER,                /* build the bitmaps during the mount */
+    MOUNT_BM_LAZY,                 /* build them at the first allocation: read-only use never does */
+    MOUNT_BM_PREBUILD              /* build them in a background thread started by the mount */
+};
+
+/**
+ * @brief options of mountv6_opts(); all fields to zero give mountv6()
+ */
+struct mount_options {
+    enum bdev_type backend;        /* I/O backend of the disk, BDEV_PREAD by default */
+    size_t cache_size;             /* number of sectors of the buffer cache, 0 for BCACHE_DEFAULT_SIZE */
+    size_t icache_size;            /* number of inodes of the inode cache, 0 for ICACHE_DEFAULT_SIZE */
+    unsigned int aio_depth;        /* queue depth of the asynchronous reads, 0 for AIO_DEFAULT_DEPTH, 1 for synchronous reads */
+    int readahead;                 /* largest readahead window of the files, in sectors: 0 for FILEV6_RA_MAX, <0 to disable */
+    int flush_age_ms;              /* background write-back of sectors dirty for that long: 0 for BCACHE_FLUSH_AGE_MS, <0 for no flusher */
+    size_t flush_dirty;            /* number of dirty sectors that wakes up the flusher, 0 for half the cache */
+    enum mount_checksums checksums; /* CRC32C of the sectors in the sidecar file <filename>.crc, see csum.h */
+    unsigned int scan_threads;     /* threads rebuilding the bitmaps, 0 for one per CPU (each with 256 inode sectors at least) */
+    enum mount_bitmaps bitmaps;    /* when the bitmaps are built, MOUNT_BM_EAGER by default */
 };
 
 /**
  * @brief  mount a unix v6 filesystem
+ *
+ *         If the superblock has bitmap regions and s_fmod is
+ *         MOUNT_BM_CLEAN, the bitmaps are read from the disk; otherwise
+ *         they are rebuilt from the inodes and the files; if a sector
+ *         of the inode table or an indirect sector cannot be read, the
+ *         rebuild (thus the mount) fails, since the sectors of the files
+ *         would be left free. mountv6_opts() can defer this until the first allocation
+ *         (opts->bitmaps), so that a mount only reads the superblock.
+ *
  * @param filename name of the unixv6 filesystem on the underlying disk (IN)
  * @param u the filesystem (OUT)
  * @return 0 on success; <0 on error
  */
 int mountv6(const char *filename, struct unix_filesystem *u);
 
+/**
+ * @brief  mount a unix v6 filesystem with the given options
+ *
+ *         The disk is opened with opts->backend. With BDEV_MMAP (and
+ *         BDEV_RAM), the read paths use bcache_view() instead of copying
+ *         sectors; if the disk cannot be mapped, it is opened with
+ *         BDEV_PREAD, as by mountv6(). With opts->checksums, a
+ *         checksummed device (csum_open()) is stacked on the disk; it
+ *         has no memory views and reads are never submitted to io_uring.
+ *
+ * @param filename name of the unixv6 filesystem on the underlying disk (IN)
+ * @param u the filesystem (OUT)
+ * @param opts the options, NULL for the defaults (IN)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_opts(const char *filename, struct unix_filesystem *u, const struct mount_options *opts);
+
+/**
+ * @brief  mount a unix v6 filesystem from an already open disk, e.g. a
+ *         disk in memory made by bdev_open(NULL, BDEV_RAM, 1) and
+ *         mountv6_mkfs_dev()
+ * @param dev the disk, owned by the filesystem (closed by umountv6()) on success (IN)
+ * @param u the filesystem (OUT)
+ * @param opts the options, NULL for the defaults; backend is ignored (IN)
+ * @return 0 on success; <0 on error
+ */
+int mountv6_dev(struct bdev *dev, struct unix_filesystem *u, const struct mount_options *opts);
+
 /**
  * @brief print to stdout the content of the superblock
  * @param u - the mounted filesytem
@@ -38,19 +146,105 @@ int mountv6(const char *filename, struct unix_filesystem *u);
 void mountv6_print_superblock(const struct unix_filesystem *u);
 
 /**
- * @brief umount the given filesystem
+ * @brief umount the given filesystem, after writing back the inode cache,
+ *        the bitmaps (if they changed, no change failed and the disk has
+ *        bitmap regions) and the buffer cache
  * @param u - the mounted filesytem
  * @return 0 on success; <0 on error
  */
 int umountv6(struct unix_filesystem *u);
 
 /**
- * @brief create a new filesystem
+ * @brief write back the dirty inodes of the inode cache, then the dirty
+ *        sectors of the buffer cache, and flush the disk
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error
+ */
+int mountv6_sync(struct unix_filesystem *u);
+
+/**
+ * @brief make sure that u->fbm, u->ibm and u->scan are built: with
+ *        MOUNT_BM_LAZY, the first call reads or rebuilds them; with
+ *        MOUNT_BM_PREBUILD, it waits for the background build. Every
+ *        user of the bitmaps calls it first.
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error, e.g. of the rebuild (see mountv6()):
+ *         the bitmaps are then not built, and the next call tries again
+ */
+int mountv6_bitmaps(struct unix_filesystem *u);
+
+/**
+ * @brief tell the filesystem that its bitmaps are about to change; the
+ *        first time, a MOUNT_BM_CLEAN flag is cleared on the disk before
+ *        the change, so that a crash before umountv6() makes the next
+ *        mount rebuild the bitmaps; several threads may call it
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error, when the flag may still be set on
+ *         the disk: the bitmaps must not be changed
+ */
+int mountv6_bm_modified(struct unix_filesystem *u);
+
+/**
+ * @brief tell the filesystem that an operation failed after changing its
+ *        bitmaps, which may then hold elements no inode refers to: umountv6()
+ *        leaves the MOUNT_BM_CLEAN flag cleared, so that the next mount
+ *        rebuilds the bitmaps from the inodes; several threads may call it
+ * @param u - the mounted filesytem
+ */
+void mountv6_bm_failed(struct unix_filesystem *u);
+
+/**
+ * @brief allocate n consecutive data sectors, in the group of goal if it
+ *        has room (searched from goal), otherwise in the next groups with
+ *        enough free sectors (searched from their start); several
+ *        threads may allocate at once
+ * @param u - the mounted filesytem, with its bitmaps built (mountv6_bitmaps())
+ * @param n the number of sectors, >0
+ * @param goal where the search starts
+ * @return the first sector of the run; <0 on error
+ */
+int mountv6_alloc_sectors(struct unix_filesystem *u, uint32_t n, uint32_t goal);
+
+/**
+ * @brief free n consecutive data sectors allocated by mountv6_alloc_sectors()
+ * @param u - the mounted filesytem
+ * @param first the first sector
+ * @param n the number of sectors
+ */
+void mountv6_free_sectors(struct unix_filesystem *u, uint32_t first, uint32_t n);
+
+/**
+ * @brief the first sector of the allocation group of an inode, where its
+ *        file starts: consecutive inodes (e.g. of the same directory)
+ *        are in different groups, so that files written together do not
+ *        take each other's sectors
+ * @param u - the mounted filesytem
+ * @param inr the inode number
+ * @return the sector
+ */
+uint32_t mountv6_group_goal(const struct unix_filesystem *u, uint16_t inr);
+
+/**
+ * @brief create a new filesystem, with bitmap regions after the
+ *        superblock; a sidecar file <filename>.crc, which
+ *        would describe the old content, is removed
  * @param num_blocks the total number of blocks (= max size of disk), in sectors
  * @param num_inodes the total number of inodes
+ * @return 0 on success; ERR_BAD_PARAMETER if either number is 0;
+ *         ERR_NOT_ENOUGH_BLOCS if the bitmaps, the inodes and a data
+ *         sector for the root directory do not fit (nothing is written);
+ *         <0 on other errors
  */
 int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes);
 
+/**
+ * @brief create a new filesystem on an open disk; see mountv6_mkfs()
+ * @param dev the disk, left open (IN)
+ * @param num_blocks the total number of blocks (= max size of disk), in sectors
+ * @param num_inodes the total number of inodes
+ */
+int mountv6_mkfs_dev(struct bdev *dev, uint16_t num_blocks, uint16_t num_inodes);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,21 +1,36 @@
+#define _GNU_SOURCE // for fallocate()
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <string.h>
 #include "sector.h"
 #include "error.h"
 #include "unixv6fs.h"
 
+#if defined(__x86_64__)
+#include <emmintrin.h> // SSE2, always available on x86-64
+#endif
+
+#define SECTOR_IOV_MAX 1024 // max. number of buffers per preadv/pwritev (Linux UIO_MAXIOV)
+
+static int sector_write_sparse(FILE *f, uint32_t first, const struct iovec *iov, int iovcnt);
+
 int sector_read(FILE *f, uint32_t sector, void *data)
 {
     M_REQUIRE_NON_NULL(f); // return error message if f == NULL
     M_REQUIRE_NON_NULL(data); // return error message if data == NULL
 
-    int error = fseek(f, SECTOR_SIZE * sector, SEEK_SET); // move cursor SECTOR_SIZE * sector bytes from the beginning of the disk (sector start point)
-    if(error) { // error occured
+    int fd = fileno(f); // raw descriptor of the disk, bypasses the stdio buffer
+    if(fd < 0) { // not a valid stream
         return ERR_IO; // return appropriate error code
     }
-    int elemRead = fread(data, sizeof(uint8_t), SECTOR_SIZE, f); // read SECTOR_SIZE bytes from f to data
+    off_t position = (off_t)SECTOR_SIZE * sector; // sector start point, in bytes from the beginning of the disk
+    ssize_t bytesRead = pread(fd, data, SECTOR_SIZE, position); // read SECTOR_SIZE bytes at position, the file cursor is left untouched
 
-    if(elemRead == SECTOR_SIZE) { // no error
+    if(bytesRead == SECTOR_SIZE) { // no error
         return 0;
-    } else { // not enough elements read
+    } else { // error or not enough bytes read
         return ERR_IO;
     }
 
@@ -26,14 +41,223 @@ int sector_write(FILE *f, uint32_t sector, const void *data)
     M_REQUIRE_NON_NULL(f); // return error message if f == NULL
     M_REQUIRE_NON_NULL(data); // return error message if data == NULL
 
-    int error = fseek(f, SECTOR_SIZE * sector, SEEK_SET); // move cursor SECTOR_SIZE * sector bytes from the beginning of the disk (sector start point)
-    if(error) { // error occured
+    int fd = fileno(f); // raw descriptor of the disk, bypasses the stdio buffer
+    if(fd < 0) { // not a valid stream
         return ERR_IO; // return appropriate error code
     }
-    int elemWritten = fwrite(data, sizeof(uint8_t), SECTOR_SIZE, f); // write SECTOR_SIZE bytes from data to f
-    if(elemWritten == SECTOR_SIZE) { // no error
+    if(sector_is_zero(data)) { // a hole rather than zeros, if possible
+        struct iovec iov = { (void*)data, SECTOR_SIZE };
+        return sector_write_sparse(f, sector, &iov, 1);
+    }
+    off_t position = (off_t)SECTOR_SIZE * sector; // sector start point, in bytes from the beginning of the disk
+    ssize_t bytesWritten = pwrite(fd, data, SECTOR_SIZE, position); // write SECTOR_SIZE bytes at position, the file cursor is left untouched
+    if(bytesWritten == SECTOR_SIZE) { // no error
         return 0;
-    } else { // not enough elements written
+    } else { // error or not enough bytes written
         return ERR_IO;
     }
 }
+
+int sector_is_zero(const void *data)
+{
+#if defined(__x86_64__)
+    const __m128i *p = data;
+    __m128i acc = _mm_setzero_si128();
+    for(size_t i = 0; i < SECTOR_SIZE / sizeof(__m128i); i += 4) { // 64 bytes per iteration
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_loadu_si128(&p[i]), _mm_loadu_si128(&p[i + 1])));
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_loadu_si128(&p[i + 2]), _mm_loadu_si128(&p[i + 3])));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+#else
+    const uint8_t *p = data;
+    uint64_t acc = 0;
+    for(size_t i = 0; i < SECTOR_SIZE; i += sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, &p[i], sizeof(v));
+        acc |= v;
+    }
+    return acc == 0;
+#endif
+}
+
+/**
+ * @brief transfer the given buffers from/to the disk, starting at sector first,
+ *        with as many preadv/pwritev as needed to handle short transfers
+ * @param f open file of the virtual disk
+ * @param first the first sector of the transfer
+ * @param iov the buffers, contiguous on disk (modified on short transfers)
+ * @param iovcnt the number of buffers
+ * @param write 0 to read, 1 to write
+ * @return 0 on success; <0 on error
+ */
+static int sector_transfer(FILE *f, uint32_t first, struct iovec *iov, int iovcnt, int write)
+{
+    int fd = fileno(f); // raw descriptor of the disk, bypasses the stdio buffer
+    if(fd < 0) { // not a valid stream
+        return ERR_IO; // return appropriate error code
+    }
+    off_t position = (off_t)SECTOR_SIZE * first; // first sector start point
+
+    while(iovcnt > 0) { // loop while some buffers are not fully transfered
+        ssize_t done = write ? pwritev(fd, iov, iovcnt, position) : preadv(fd, iov, iovcnt, position);
+        if(done <= 0) { // error or end of file
+            return ERR_IO; // return appropriate error code
+        }
+        position += done;
+        while(iovcnt > 0 && (size_t)done >= iov->iov_len) { // skip fully transfered buffers
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) { // first remaining buffer is partially transfered
+            iov->iov_base = (uint8_t*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief punch a hole over count sectors from first, if they lie within
+ *        the image: holes read as zeros and take no space
+ * @param fd the descriptor of the image
+ * @param size the size of the image, in bytes
+ * @return 0 if punched; <0 if the sectors must be written
+ */
+static int sector_punch(int fd, off_t size, uint32_t first, uint32_t count)
+{
+    off_t position = (off_t)SECTOR_SIZE * first;
+    off_t len = (off_t)SECTOR_SIZE * count;
+    if(position + len > size) { // would not extend the image: write the zeros
+        return ERR_IO;
+    }
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, len) ? ERR_IO : 0;
+}
+
+/**
+ * @brief run of consecutive sectors to write, all zero or all not
+ */
+struct sector_run {
+    struct iovec iov[SECTOR_IOV_MAX]; // one sector per buffer
+    int count;                        // number of sectors
+    int zero;                         // 1 if all sectors are zero
+    uint32_t first;                   // first sector
+};
+
+/**
+ * @brief write a run of sectors, or punch it if it is made of zeros
+ * @param size the size of the image, read at the first run of zeros (IN/OUT)
+ * @return 0 on success; <0 on error
+ */
+static int sector_run_write(FILE *f, off_t *size, struct sector_run *run)
+{
+    if(run->zero && *size < 0) {
+        struct stat st;
+        *size = fstat(fileno(f), &st) ? 0 : st.st_size;
+    }
+    int count = run->count;
+    run->count = 0;
+    if(run->zero && !sector_punch(fileno(f), *size, run->first, count)) { // hole
+        return 0;
+    }
+    return sector_transfer(f, run->first, run->iov, count, 1); // data, or zeros that cannot be punched
+}
+
+/**
+ * @brief write the buffers, contiguous on disk from sector first, each
+ *        made of whole sectors; runs of all-zero sectors within the image
+ *        are punched instead of written, the others are written with as
+ *        few pwritev as possible
+ * @return 0 on success; <0 on error
+ */
+static int sector_write_sparse(FILE *f, uint32_t first, const struct iovec *iov, int iovcnt)
+{
+    if(fileno(f) < 0) { // not a valid stream
+        return ERR_IO; // return appropriate error code
+    }
+    off_t size = -1; // size of the image, unknown yet
+    struct sector_run run;
+    run.count = 0;
+    uint32_t sector = first;
+    for(int i = 0; i < iovcnt; i++) {
+        for(size_t off = 0; off < iov[i].iov_len; off += SECTOR_SIZE, sector++) {
+            uint8_t *data = (uint8_t*)iov[i].iov_base + off;
+            int zero = sector_is_zero(data);
+            if(run.count > 0 && (zero != run.zero || run.count == SECTOR_IOV_MAX)) { // end of the run
+                int error = sector_run_write(f, &size, &run);
+                if(error) { // error occured
+                    return error; // propagate error
+                }
+            }
+            if(run.count == 0) { // start of a run
+                run.zero = zero;
+                run.first = sector;
+            }
+            run.iov[run.count].iov_base = data;
+            run.iov[run.count].iov_len = SECTOR_SIZE;
+            run.count++;
+        }
+    }
+    return (run.count > 0) ? sector_run_write(f, &size, &run) : 0;
+}
+
+int sector_read_range(FILE *f, uint32_t first, uint32_t count, void *data)
+{
+    M_REQUIRE_NON_NULL(f); // return error message if f == NULL
+    M_REQUIRE_NON_NULL(data); // return error message if data == NULL
+
+    if(count == 0) { // nothing to read (preadv would return 0, taken as an error)
+        return 0;
+    }
+    struct iovec iov = { data, (size_t)count * SECTOR_SIZE }; // the whole range at once
+    return sector_transfer(f, first, &iov, 1, 0);
+}
+
+int sector_write_range(FILE *f, uint32_t first, uint32_t count, const void *data)
+{
+    M_REQUIRE_NON_NULL(f); // return error message if f == NULL
+    M_REQUIRE_NON_NULL(data); // return error message if data == NULL
+
+    struct iovec iov = { (void*)data, (size_t)count * SECTOR_SIZE }; // the whole range at once
+    return sector_write_sparse(f, first, &iov, 1);
+}
+
+/**
+ * @brief common part of sector_readv() and sector_writev(): issue one
+ *        transfer per run of consecutive sectors in vec
+ */
+static int sector_transferv(FILE *f, const struct sector_iovec *vec, size_t count, int write)
+{
+    M_REQUIRE_NON_NULL(f); // return error message if f == NULL
+    M_REQUIRE_NON_NULL(vec); // return error message if vec == NULL
+
+    struct iovec iov[SECTOR_IOV_MAX];
+    size_t i = 0;
+    while(i < count) { // one iteration per run
+        uint32_t first = vec[i].sector; // start of the run
+        int iovcnt = 0; // length of the run
+        do {
+            M_REQUIRE_NON_NULL(vec[i].data);
+            iov[iovcnt].iov_base = vec[i].data;
+            iov[iovcnt].iov_len = SECTOR_SIZE;
+            iovcnt++;
+            i++;
+        } while(i < count && iovcnt < SECTOR_IOV_MAX && vec[i].sector == first + iovcnt);
+
+        int error = write ? sector_write_sparse(f, first, iov, iovcnt) : sector_transfer(f, first, iov, iovcnt, 0);
+        if(error) { // error occured
+            return error; // propagate error
+        }
+    }
+    return 0;
+}
+
+int sector_readv(FILE *f, const struct sector_iovec *vec, size_t count)
+{
+    return sector_transferv(f, vec, count, 0);
+}
+
+int sector_writev(FILE *f, const struct sector_iovec *vec, size_t count)
+{
+    return sector_transferv(f, vec, count, 1);
+}
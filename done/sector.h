@@ -8,6 +8,7 @@
  * @date summer 2016
  */
 
+#include <stddef.h> // for size_t
 #include <stdint.h>
 #include <stdio.h>
 
@@ -18,6 +19,11 @@ extern "C" {
 // Implemented WEEK 4
 /**
  * @brief read one 512-byte sector from the virtual disk
+ *
+ *        The read is positional (pread on the underlying descriptor):
+ *        it neither uses nor moves the cursor of f, so several threads
+ *        may read from the same disk concurrently.
+ *
  * @param f open file of the virtual disk
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (OUT)
@@ -29,6 +35,13 @@ int sector_read(FILE *f, uint32_t sector, void *data);
 // Implemented WEEK 11
 /**
  * @brief write one 512-byte sector from the virtual disk
+ *
+ *        Like sector_read(), the write is positional (pwrite) and goes
+ *        straight to the descriptor, without the stdio buffer of f.
+ *        A sector of zeros within the image is not written: a hole is
+ *        punched instead (it reads as zeros and takes no space). The
+ *        same holds for the sectors written by the functions below.
+ *
  * @param f open file of the virtual disk
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (IN)
@@ -36,6 +49,61 @@ int sector_read(FILE *f, uint32_t sector, void *data);
  */
 int sector_write(FILE *f, uint32_t sector, const void *data);
 
+/**
+ * @brief tell whether a sector is all zeros (SSE2 on x86-64)
+ * @param data a pointer to 512-bytes of memory
+ * @return 1 if all bytes are 0, 0 otherwise
+ */
+int sector_is_zero(const void *data);
+
+/**
+ * @brief one element of a scatter/gather list: a sector and its memory
+ */
+struct sector_iovec {
+    uint32_t sector; // the location (in sector units) within the virtual disk
+    void *data;      // a pointer to 512-bytes of memory
+};
+
+/**
+ * @brief read count contiguous sectors with a single preadv
+ * @param f open file of the virtual disk
+ * @param first the first sector to read
+ * @param count the number of sectors to read (0 reads nothing)
+ * @param data a pointer to count * 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read_range(FILE *f, uint32_t first, uint32_t count, void *data);
+
+/**
+ * @brief write count contiguous sectors with a single pwritev
+ * @param f open file of the virtual disk
+ * @param first the first sector to write
+ * @param count the number of sectors to write
+ * @param data a pointer to count * 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_write_range(FILE *f, uint32_t first, uint32_t count, const void *data);
+
+/**
+ * @brief read a list of sectors, each into its own buffer;
+ *        consecutive elements of vec that target consecutive sectors
+ *        are grouped into one preadv
+ * @param f open file of the virtual disk
+ * @param vec the (sector, buffer) pairs (buffers are OUT)
+ * @param count the number of elements in vec
+ * @return 0 on success; <0 on error
+ */
+int sector_readv(FILE *f, const struct sector_iovec *vec, size_t count);
+
+/**
+ * @brief write a list of sectors, grouped like sector_readv()
+ * @param f open file of the virtual disk
+ * @param vec the (sector, buffer) pairs (buffers are IN)
+ * @param count the number of elements in vec
+ * @return 0 on success; <0 on error
+ */
+int sector_writev(FILE *f, const struct sector_iovec *vec, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -55,7 +55,8 @@ void print_sha_inode(struct unix_filesystem *u, struct inode inode, int inr)
             int read = 0;
 
             do {
-                read = filev6_readblock(&fv6, &(data[fv6.offset]));
+                int sectorsLeft = (size - 1 - fv6.offset) / SECTOR_SIZE; // sectors not yet read
+                read = filev6_readblocks(&fv6, &(data[fv6.offset]), sectorsLeft);
                 if(read < 0) { // error occured
                     return; // return
                 }
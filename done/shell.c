@@ -11,10 +11,12 @@
 #include "inode.h"
 #include "direntv6.h"
 #include "sha.h"
+#include "bcache.h"
+#include "csum.h"
 #include "unixv6fs.h"
 #include <string.h>
 
-#define CMD_NUM 13
+#define CMD_NUM 16
 #define MAX_CHARS 255
 #define MAX_ARGS 3
 
@@ -24,6 +26,7 @@ enum shell_codes {
     SHELL_INVALID_ARGS,
     SHELL_UNMOUNTED_FS,
     SHELL_CAT_ON_DIR,
+    SHELL_NO_CHECKSUMS,
     SHELL_LAST // not an actual error but to have e.g. the total number of errors
 };
 
@@ -129,6 +132,27 @@ int do_mkdir(char** args);
  */
 int do_add(char** args);
 
+/**
+ * @brief prints the statistics of the buffer and inode caches of the mounted filesystem
+ * @param args not used
+ * @return 0 on success; >0 or <0 on error
+ */
+int do_cache(char** args);
+
+/**
+ * @brief writes back the dirty sectors of the mounted filesystem
+ * @param args not used
+ * @return 0 on success; >0 or <0 on error
+ */
+int do_sync(char** args);
+
+/**
+ * @brief verifies the checksums of all sectors of the mounted filesystem
+ * @param args not used
+ * @return 0 on success; >0 or <0 on error
+ */
+int do_scrub(char** args);
+
 /**
  * @brief tokenizes the input using the character ' ' (space)
  * @param input the input to tokenise (IN)
@@ -156,7 +180,8 @@ const char * const SHELL_MESSAGES[] = {
     "invalid command",
     "wrong number of arguments",
     "mount the FS before the operation",
-    "cat on a directory is not defined"
+    "cat on a directory is not defined",
+    "the FS has no checksums (no <diskname>.crc)"
 };
 
 // global array of supported shell commands
@@ -174,6 +199,9 @@ struct shell_map shell_cmds[] = {
     {"inode", do_inode, "display the inode number of a file", 1, " <pathname>"},
     {"sha", do_sha, "display the SHA of a file", 1, " <pathname>"},
     {"psb", do_psb, "Print SuperBlock of the currently mounted filesystem", 0, ""},
+    {"cache", do_cache, "display the hit/miss counters of the buffer and inode caches", 0, ""},
+    {"sync", do_sync, "write back the modified inodes and sectors to the disk", 0, ""},
+    {"scrub", do_scrub, "verify the checksums of all the sectors of the disk", 0, ""},
 };
 
 // global variable representing the mounted unixv6 filesystem
@@ -184,7 +212,7 @@ int end = 0;
 
 int main(void)
 {
-    u.f = NULL; // file is NULL (not mounted yet)
+    u.dev = NULL; // disk is NULL (not mounted yet)
     printf("Shell interpretor\n");
     printf("Type \"help\" for more information.\n");
 
@@ -219,7 +247,7 @@ int main(void)
 
 int do_exit(char** args)
 {
-    if(u.f != NULL) { // already mounted
+    if(u.dev != NULL) { // already mounted
         int error = umountv6(&u); // unmount
         if(error) { // error unmounting
             return error; // propagate error
@@ -247,15 +275,17 @@ int do_help(char** args)
 int do_mount(char** args)
 {
     M_REQUIRE_NON_NULL(args);
-    if(u.f != NULL) { // already mounted
+    if(u.dev != NULL) { // already mounted
         int error = umountv6(&u); // unmount
         if(error) { // error unmounting
             return error; // propagate error
         }
     }
-    int error = mountv6(args[0],&u); // mount the filesystem
+    struct mount_options opts = { .checksums = MOUNT_CSUM_USE, // verify the sectors if <diskname>.crc exists
+                                  .bitmaps = MOUNT_BM_PREBUILD }; // bitmaps built while the user types
+    int error = mountv6_opts(args[0],&u,&opts); // mount the filesystem
     if(error) { // error occured while mounting
-        u.f = NULL; // file is NULL (not mounted yet)
+        u.dev = NULL; // disk is NULL (not mounted yet)
         return error; // propagate error
     }
     // mounted
@@ -264,7 +294,7 @@ int do_mount(char** args)
 
 int do_lsall(char** args)
 {
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -277,7 +307,7 @@ int do_lsall(char** args)
 
 int do_psb(char** args)
 {
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -289,7 +319,7 @@ int do_cat(char** args)
 {
     M_REQUIRE_NON_NULL(args);
 
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -318,7 +348,8 @@ int do_cat(char** args)
 
     // read the whole file
     do {
-        read = filev6_readblock(&file, &(data[file.offset]));
+        int sectorsLeft = (sectorsSize - 1 - file.offset) / SECTOR_SIZE; // sectors not yet read
+        read = filev6_readblocks(&file, &(data[file.offset]), sectorsLeft);
         if(read < 0) {
             return read;
         }
@@ -335,7 +366,7 @@ int do_sha(char** args)
 {
     M_REQUIRE_NON_NULL(args);
 
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -359,7 +390,7 @@ int do_inode(char** args)
 {
     M_REQUIRE_NON_NULL(args);
 
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -376,7 +407,7 @@ int do_istat(char** args)
 {
     M_REQUIRE_NON_NULL(args);
 
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -425,7 +456,7 @@ int do_mkdir(char** args)
 {
     M_REQUIRE_NON_NULL(args);
 
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -443,7 +474,7 @@ int do_add(char** args)
 {
     M_REQUIRE_NON_NULL(args);
 
-    if(u.f == NULL) { // if filesystem not mounted
+    if(u.dev == NULL) { // if filesystem not mounted
         return SHELL_UNMOUNTED_FS; // return appropriate error code
     }
     // mounted
@@ -494,6 +525,51 @@ int do_add(char** args)
     return 0;
 }
 
+int do_cache(char** args)
+{
+    if(u.dev == NULL) { // if filesystem not mounted
+        return SHELL_UNMOUNTED_FS; // return appropriate error code
+    }
+    // mounted
+    bcache_print_stats(u.cache);
+    icache_print_stats(u.icache);
+    return 0;
+}
+
+int do_sync(char** args)
+{
+    if(u.dev == NULL) { // if filesystem not mounted
+        return SHELL_UNMOUNTED_FS; // return appropriate error code
+    }
+    // mounted
+    return mountv6_sync(&u);
+}
+
+int do_scrub(char** args)
+{
+    if(u.dev == NULL) { // if filesystem not mounted
+        return SHELL_UNMOUNTED_FS; // return appropriate error code
+    }
+    if(!csum_is_csum(u.dev)) { // mounted without checksums
+        return SHELL_NO_CHECKSUMS; // return appropriate error code
+    }
+    // mounted
+    int error = mountv6_sync(&u); // scrub what the filesystem holds, not what the disk held
+    if(error) { // error occured
+        return error; // propagate error
+    }
+    struct csum_report report;
+    error = csum_scrub(u.dev, 0, &report); // one thread per CPU
+    if(error) { // error occured
+        return error; // propagate error
+    }
+    printf("%u sectors verified, %u bad\n", report.checked, report.bad);
+    for(uint32_t i = 0; i < report.bad && i < CSUM_SCRUB_MAX_BAD; i++) {
+        printf("bad sector %u\n", report.bad_sectors[i]);
+    }
+    return 0;
+}
+
 int tokenize_input(char* input, char** tokenized)
 {
     M_REQUIRE_NON_NULL(input); // return error code if NULL
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "mount.h"
+#include "bdev.h"
+#include "direntv6.h"
+#include "filev6.h"
+#include "inode.h"
+#include "error.h"
+
+#define USAGE "test-bdev <diskname> [<scratch diskname>]"
+
+/**
+ * @brief mount the disk with the given backend and print its tree
+ */
+static void test_backend(const char *filename, enum bdev_type backend)
+{
+    struct unix_filesystem u;
+    struct mount_options opts = { .backend = backend };
+    int error = mountv6_opts(filename, &u, &opts);
+    printf("mount with %s: %d\n", bdev_name(u.dev), error);
+    if(!error) {
+        direntv6_print_tree(&u, ROOT_INUMBER, "");
+        printf("umount: %d\n", umountv6(&u));
+    }
+}
+
+/**
+ * @brief create a filesystem in memory, write a file and read it back
+ */
+static void test_ram(void)
+{
+    struct bdev *dev = bdev_open(NULL, BDEV_RAM, 1);
+    printf("ram disk: %s\n", bdev_name(dev));
+    int error = mountv6_mkfs_dev(dev, 1000, 32);
+    printf("mkfs: %d, %u sectors\n", error, bdev_size(dev));
+
+    struct unix_filesystem u;
+    error = mountv6_dev(dev, &u, NULL);
+    printf("mount: %d\n", error);
+    if(error) {
+        bdev_close(dev);
+        return;
+    }
+    char data[3000];
+    for(size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+    printf("create: %d\n", direntv6_create(&u, "/tmp", IALLOC | IFDIR));
+    printf("create: %d\n", direntv6_create(&u, "/tmp/file", IALLOC));
+    struct filev6 fv6;
+    int inr = direntv6_dirlookup(&u, ROOT_INUMBER, "/tmp/file");
+    printf("open: %d\n", filev6_open(&u, inr, &fv6));
+    printf("write: %d\n", filev6_writebytes(&u, &fv6, data, sizeof(data)));
+
+    char back[sizeof(data) + SECTOR_SIZE];
+    printf("open: %d\n", filev6_open(&u, inr, &fv6));
+    int read = filev6_readblocks(&fv6, back, sizeof(back) / SECTOR_SIZE);
+    printf("read: %d, same: %d\n", read, read == sizeof(data) && !memcmp(back, data, sizeof(data)));
+    direntv6_print_tree(&u, ROOT_INUMBER, "");
+    printf("umount: %d\n", umountv6(&u));
+}
+
+/**
+ * @brief space taken by a file, in sectors
+ */
+static long allocated(const char *filename)
+{
+    struct stat st;
+    return stat(filename, &st) ? -1 : (long)st.st_blocks * 512 / SECTOR_SIZE;
+}
+
+/**
+ * @brief create a large, empty filesystem and check that it is sparse and
+ *        that zero sectors are not stored
+ */
+static void test_sparse(const char *filename)
+{
+    printf("mkfs: %d\n", mountv6_mkfs(filename, 60000, 1600));
+    long mkfs = allocated(filename);
+    struct bdev *dev = bdev_open(filename, BDEV_PREAD, 0);
+    printf("sectors: %u, sparse: %d\n", bdev_size(dev), mkfs < 100);
+
+    uint8_t data[8 * SECTOR_SIZE]; // one block of 4 KB of the image
+    memset(data, 0xff, sizeof(data));
+    int error = bdev_read(dev, 50000, 8, data);
+    printf("read hole: %d, zeros: %d\n", error, sector_is_zero(data) && sector_is_zero(&data[SECTOR_SIZE]));
+    printf("read beyond: %d\n", bdev_read(dev, 60000, 1, data));
+    printf("read empty range: %d\n", sector_read_range(dev->f, 50000, 0, data));
+
+    memset(data, 'x', sizeof(data));
+    printf("write: %d, ", bdev_write(dev, 50000, 8, data));
+    memset(data, 0, sizeof(data));
+    error = bdev_read(dev, 50000, 8, data);
+    printf("read: %d, data: %d, ", error, data[0] == 'x' && data[sizeof(data) - 1] == 'x');
+    printf("allocated: %d\n", allocated(filename) > mkfs);
+
+    memset(data, 0, sizeof(data));
+    printf("write zeros: %d, ", bdev_write(dev, 50000, 8, data));
+    memset(data, 0xff, sizeof(data));
+    error = bdev_read(dev, 50000, 8, data);
+    printf("read: %d, zeros: %d, ", error, sector_is_zero(data) && sector_is_zero(&data[SECTOR_SIZE]));
+    printf("released: %d\n", allocated(filename) <= mkfs);
+    bdev_close(dev);
+
+    struct unix_filesystem u;
+    printf("mount: %d\n", mountv6(filename, &u));
+    printf("create: %d\n", direntv6_create(&u, "/file", IALLOC));
+    direntv6_print_tree(&u, ROOT_INUMBER, "");
+    printf("umount: %d\n", umountv6(&u));
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    test_backend(argv[1], BDEV_PREAD);
+    test_backend(argv[1], BDEV_STDIO);
+    test_backend(argv[1], BDEV_MMAP);
+    test_backend(argv[1], BDEV_RAM);
+    test_ram();
+    if(argc == 3) {
+        test_sparse(argv[2]);
+    }
+    return 0;
+}
@@ -26,6 +26,32 @@ int main(void)
     bm_print(bm);
     printf("find_next() = %u\n", bm_find_next(bm));
 
+    printf("find_next_from(100) = %d\n", bm_find_next_from(bm, 100));
+    printf("find_next_from(131) = %d\n", bm_find_next_from(bm, 131));
+    printf("find_next_from(132) = %d\n", bm_find_next_from(bm, 132));
+    for(int i = 4; i <= 131; i++) {
+        bm_set(bm, i);
+    }
+    printf("find_next() = %d\n", bm_find_next(bm));
+    bm_clear(bm, 70);
+    printf("find_next() = %d\n", bm_find_next(bm));
+    printf("find_next_from(100) = %d\n", bm_find_next_from(bm, 100));
+    bm_clear(bm, 40);
+    printf("find_near(100) = %d\n", bm_find_near(bm, 100));
+    printf("find_near(50) = %d\n", bm_find_near(bm, 50));
+    printf("find_near(55) = %d\n", bm_find_near(bm, 55));
+    printf("find_near(4) = %d\n", bm_find_near(bm, 4));
+    bm_set(bm, 40);
+
+    bm_clear_range(bm, 60, 64);
+    printf("find_run(64, 4) = %d\n", bm_find_run(bm, 64, 4));
+    printf("find_run(65, 4) = %d\n", bm_find_run(bm, 65, 4));
+    printf("find_run(10, 100) = %d\n", bm_find_run(bm, 10, 100));
+    bm_set_range(bm, 62, 60);
+    bm_print(bm);
+    printf("find_run(2, 4) = %d\n", bm_find_run(bm, 2, 4));
+    printf("find_run(3, 4) = %d\n", bm_find_run(bm, 3, 4));
+
     free(bm);
     bm = NULL;
 
@@ -0,0 +1,243 @@
+/**
+ * @file test-claim.c
+ * @brief stress test of the atomic operations of the bitmaps: threads
+ *        claim every element, then claim and clear at random; the inodes
+ *        and the sectors of a filesystem are then allocated by threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "bmblock.h"
+#include "mount.h"
+#include "inode.h"
+#include "bdev.h"
+
+#define NB_THREADS 8
+#define MIN 5
+#define MAX 200004 // not a multiple of 64 elements
+#define ROUNDS 5000
+#define NB_BLOCKS 8000
+#define NB_INODES 4096
+
+struct worker {
+    struct bmblock_array *bm;
+    struct unix_filesystem *u;
+    unsigned int seed;
+    uint64_t *values; // claimed elements
+    size_t nb; // number of values
+    pthread_t thread;
+};
+
+/**
+ * @brief claim until the array is full
+ */
+static void *claim_all(void *arg)
+{
+    struct worker *w = arg;
+    int x;
+    while((x = bm_atomic_claim(w->bm)) >= 0) {
+        w->values[w->nb++] = x;
+    }
+    return NULL;
+}
+
+/**
+ * @brief claim runs and single elements near random goals, and clear
+ *        half of them at random; the elements kept are in values
+ */
+static void *claim_random(void *arg)
+{
+    struct worker *w = arg;
+    for(int r = 0; r < ROUNDS; r++) {
+        uint64_t goal = MIN + rand_r(&(w->seed)) % (MAX - MIN + 1);
+        uint64_t n = 1 + rand_r(&(w->seed)) % 20;
+        int x = (r % 2) ? bm_atomic_claim_near(w->bm, goal) : bm_atomic_claim_run(w->bm, n, goal);
+        n = (r % 2) ? 1 : n;
+        if(x < 0) {
+            continue;
+        }
+        if(rand_r(&(w->seed)) % 2) { // cleared again
+            bm_atomic_clear_range(w->bm, x, n);
+        } else {
+            for(uint64_t i = 0; i < n; i++) {
+                w->values[w->nb++] = x + i;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief allocate inodes until there is none left
+ */
+static void *alloc_inodes(void *arg)
+{
+    struct worker *w = arg;
+    int inr;
+    while((inr = inode_alloc(w->u, 0)) >= 0) {
+        w->values[w->nb++] = inr;
+    }
+    return NULL;
+}
+
+/**
+ * @brief allocate runs of sectors from the group of the worker until
+ *        there is none left, then free one run out of two
+ */
+static void *alloc_sectors(void *arg)
+{
+    struct worker *w = arg;
+    uint32_t goal = mountv6_group_goal(w->u, w->seed);
+    size_t kept = 0;
+    for(;;) {
+        uint32_t n = 1 + rand_r(&(w->seed)) % 8;
+        int first = mountv6_alloc_sectors(w->u, n, goal);
+        if(first < 0) {
+            n = 1;
+            first = mountv6_alloc_sectors(w->u, n, goal);
+        }
+        if(first < 0) {
+            break;
+        }
+        for(uint32_t i = 0; i < n; i++) {
+            w->values[w->nb++] = first + i;
+        }
+        goal = (first + n <= ((w->u)->fbm)->max) ? first + n : first;
+    }
+    for(size_t i = 0; i < w->nb; i++) { // one sector out of two freed
+        if(i % 2) {
+            mountv6_free_sectors(w->u, w->values[i], 1);
+        } else {
+            w->values[kept++] = w->values[i];
+        }
+    }
+    w->nb = kept;
+    return NULL;
+}
+
+/**
+ * @brief compare the free counts of the groups with their bits
+ * @return the number of groups whose count is wrong
+ */
+static int check_groups(struct unix_filesystem *u)
+{
+    int wrong = 0;
+    for(unsigned int g = 0; g < u->nb_groups; g++) {
+        uint32_t size = u->groups[g].last - u->groups[g].first + 1;
+        wrong += (u->groups[g].free != (int32_t)(size - bm_count(u->fbm, u->groups[g].first, size)));
+    }
+    return wrong;
+}
+
+/**
+ * @brief run the workers, then check the elements claimed by them: how
+ *        many twice, how many not set in the array
+ * @return the number of elements claimed
+ */
+static size_t run(struct worker *workers, void *(*f)(void *), uint64_t min, uint64_t max, const char *name)
+{
+    for(int t = 0; t < NB_THREADS; t++) {
+        pthread_create(&(workers[t].thread), NULL, f, &(workers[t]));
+    }
+    uint8_t *seen = calloc(max + 1, 1);
+    size_t total = 0, twice = 0, unset = 0;
+    for(int t = 0; t < NB_THREADS; t++) {
+        pthread_join(workers[t].thread, NULL);
+        for(size_t i = 0; i < workers[t].nb; i++) {
+            uint64_t x = workers[t].values[i];
+            twice += (x < min || x > max || seen[x]);
+            unset += (workers[t].bm != NULL && bm_get(workers[t].bm, x) != 1);
+            seen[x] = 1;
+        }
+        total += workers[t].nb;
+    }
+    free(seen);
+    printf("%s: %zu twice, %zu not set\n", name, twice, unset);
+    return total;
+}
+
+/**
+ * @brief compare the searches, which go through the summary levels, with
+ *        the bits themselves
+ * @return the number of wrong answers
+ */
+static int check_summary(struct bmblock_array *bm)
+{
+    int wrong = 0;
+    unsigned int seed = 1;
+    for(int q = 0; q < 1000; q++) {
+        uint64_t goal = MIN + rand_r(&seed) % (MAX - MIN + 1);
+        uint64_t x = goal;
+        while(x <= MAX && bm_get(bm, x) == 1) {
+            x++;
+        }
+        int found = bm_find_next_from(bm, goal);
+        wrong += (x <= MAX) ? (found != (int)x) : (found >= 0 && (uint64_t)found < goal);
+    }
+    return wrong;
+}
+
+int main(void)
+{
+    struct bmblock_array *bm = bm_alloc(MIN, MAX);
+    struct worker workers[NB_THREADS];
+    for(int t = 0; t < NB_THREADS; t++) {
+        workers[t] = (struct worker) { bm, NULL, t + 1, malloc((MAX - MIN + 1) * sizeof(uint64_t)), 0, 0 };
+    }
+
+    size_t claimed = run(workers, claim_all, MIN, MAX, "claim all");
+    printf("claimed: %zu of %d, find_next: %d\n", claimed, MAX - MIN + 1, bm_find_next(bm));
+
+    bm_atomic_clear_range(bm, MIN, MAX - MIN + 1);
+    for(int t = 0; t < NB_THREADS; t++) {
+        workers[t].nb = 0;
+    }
+    claimed = run(workers, claim_random, MIN, MAX, "claim random");
+    size_t kept = 0;
+    for(uint64_t x = MIN; x <= MAX; x++) {
+        kept += bm_get(bm, x);
+    }
+    printf("set: %d, summary errors: %d\n", kept == claimed, check_summary(bm));
+    free(bm);
+
+    // inodes of a filesystem in memory
+    struct bdev *dev = bdev_open(NULL, BDEV_RAM, 1);
+    struct unix_filesystem u;
+    int error = (dev != NULL) ? mountv6_mkfs_dev(dev, NB_BLOCKS, NB_INODES) : -1;
+    error = error ? error : mountv6_dev(dev, &u, NULL);
+    printf("mount: %d\n", error);
+    for(int t = 0; !error && t < NB_THREADS; t++) {
+        workers[t].bm = u.ibm;
+        workers[t].u = &u;
+        workers[t].nb = 0;
+    }
+    if(!error) {
+        claimed = run(workers, alloc_inodes, (u.ibm)->min, (u.ibm)->max, "inode_alloc");
+        printf("inodes: %zu of %lu\n", claimed, (unsigned long)((u.ibm)->max - (u.ibm)->min + 1));
+
+        uint64_t used = bm_count(u.fbm, (u.fbm)->min, (u.fbm)->max - (u.fbm)->min + 1); // root directory
+        for(int t = 0; t < NB_THREADS; t++) {
+            workers[t].bm = u.fbm;
+            workers[t].nb = 0;
+        }
+        claimed = run(workers, alloc_sectors, (u.fbm)->min, (u.fbm)->max, "alloc_sectors");
+        printf("groups: %u, sectors kept: %d, wrong counts: %d\n", u.nb_groups,
+               claimed + used == bm_count(u.fbm, (u.fbm)->min, (u.fbm)->max - (u.fbm)->min + 1), check_groups(&u));
+        uint32_t n = 3 * (u.groups[0].last - u.groups[0].first + 1) / 2; // larger than a group
+        for(int t = 0; t < NB_THREADS; t++) {
+            for(size_t i = 0; i < workers[t].nb; i++) {
+                mountv6_free_sectors(&u, workers[t].values[i], 1);
+            }
+        }
+        int first = mountv6_alloc_sectors(&u, n, u.groups[1].first);
+        printf("run of %u: %d, wrong counts: %d\n", n, first >= 0, check_groups(&u));
+        umountv6(&u);
+    }
+    for(int t = 0; t < NB_THREADS; t++) {
+        free(workers[t].values);
+    }
+    return 0;
+}
@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mount.h"
+#include "bdev.h"
+#include "csum.h"
+#include "direntv6.h"
+#include "filev6.h"
+#include "inode.h"
+#include "error.h"
+#include "unixv6fs.h"
+
+#define USAGE "test-csum <diskname> <scratch diskname>"
+#define NB_SECTORS 64 // sectors of the disks of test_crash() and test_race()
+#define NB_WRITES 2000 // writes racing the reads of test_race()
+
+/**
+ * @brief compare the implementations of CRC32C on known values and on
+ *        buffers of every alignment and length
+ */
+static void test_crc32c(void)
+{
+    printf("crc32c(\"123456789\"): %08x\n", csum_crc32c(0, "123456789", 9));
+    printf("crc32c_sw(\"123456789\"): %08x\n", csum_crc32c_sw(0, "123456789", 9));
+    uint8_t data[SECTOR_SIZE + 16];
+    for(size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand();
+    }
+    int same = 1;
+    for(size_t offset = 0; offset < 16; offset++) {
+        for(size_t len = 0; len <= SECTOR_SIZE; len++) {
+            same &= csum_crc32c(0, &data[offset], len) == csum_crc32c_sw(0, &data[offset], len);
+        }
+    }
+    uint32_t split = csum_crc32c(csum_crc32c(0, data, 100), &data[100], SECTOR_SIZE - 100);
+    printf("same: %d, incremental: %d\n", same, split == csum_crc32c(0, data, SECTOR_SIZE));
+}
+
+/**
+ * @brief copy the file src to dst
+ * @return 0 on success; <0 on error
+ */
+static int copy(const char *src, const char *dst)
+{
+    FILE *in = fopen(src, "rb");
+    FILE *out = fopen(dst, "wb");
+    int error = (in == NULL || out == NULL) ? ERR_IO : 0;
+    char buf[4096];
+    size_t n;
+    while(!error && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        error = (fwrite(buf, 1, n, out) != n) ? ERR_IO : 0;
+    }
+    if(in != NULL) {
+        fclose(in);
+    }
+    if(out != NULL && fclose(out)) {
+        error = ERR_IO;
+    }
+    return error;
+}
+
+/**
+ * @brief xor one byte of the image file, behind the filesystem
+ */
+static void corrupt(const char *filename, long offset)
+{
+    FILE *f = fopen(filename, "r+b");
+    if(f == NULL) {
+        return;
+    }
+    fseek(f, offset, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, offset, SEEK_SET);
+    fputc(c ^ 0x5a, f);
+    fclose(f);
+}
+
+/**
+ * @brief scrub the mounted filesystem and print the report
+ */
+static void scrub(struct unix_filesystem *u)
+{
+    struct csum_report report;
+    int error = csum_scrub(u->dev, 4, &report);
+    printf("scrub: %d, %u sectors, %u bad", error, report.checked, report.bad);
+    for(uint32_t i = 0; i < report.bad && i < CSUM_SCRUB_MAX_BAD; i++) {
+        printf(" %u", report.bad_sectors[i]);
+    }
+    printf("\n");
+}
+
+/**
+ * @brief write beyond the end of a one-sector disk: the sectors skipped
+ *        read as zeros and must pass the verification, before and after
+ *        the sidecar is written back
+ */
+static void test_grow(const char *filename)
+{
+    char sidecar[FILENAME_MAX];
+    snprintf(sidecar, sizeof(sidecar), "%s.crc", filename);
+    unlink(sidecar);
+    uint8_t data[SECTOR_SIZE];
+    memset(data, 'x', sizeof(data));
+    FILE *f = fopen(filename, "wb");
+    int error = (f == NULL || fwrite(data, sizeof(data), 1, f) != 1) ? ERR_IO : 0;
+    if(f != NULL && fclose(f)) {
+        error = ERR_IO;
+    }
+    struct bdev *dev = error ? NULL : bdev_open(filename, BDEV_PREAD, 0);
+    struct bdev *c = (dev != NULL) ? csum_open(dev, sidecar, 1) : NULL;
+    printf("grow: open: %d\n", c != NULL);
+    if(c == NULL) {
+        bdev_close(dev);
+        return;
+    }
+    printf("write beyond: %d, ", bdev_write(c, 10, 1, data));
+    memset(data, 0xff, sizeof(data));
+    error = bdev_read(c, 5, 1, data);
+    printf("read gap: %d, zeros: %d\n", error, sector_is_zero(data));
+    struct csum_report report;
+    error = csum_scrub(c, 2, &report);
+    printf("scrub: %d, %u sectors, %u bad\n", error, report.checked, report.bad);
+    printf("close: %d\n", bdev_close(c));
+
+    dev = bdev_open(filename, BDEV_PREAD, 0);
+    c = (dev != NULL) ? csum_open(dev, sidecar, 0) : NULL;
+    printf("reopen: %d, ", c != NULL);
+    if(c == NULL) {
+        bdev_close(dev);
+        return;
+    }
+    printf("read gap: %d, ", bdev_read(c, 5, 1, data));
+    error = csum_scrub(c, 2, &report);
+    printf("scrub: %d, %u sectors, %u bad\n", error, report.checked, report.bad);
+    bdev_close(c);
+    unlink(sidecar);
+}
+
+/**
+ * @brief make a disk of NB_SECTORS sectors of 'x' and stack checksums on it
+ * @return the checksummed device or NULL on failure
+ */
+static struct bdev *make_disk(const char *filename, const char *sidecar)
+{
+    unlink(sidecar);
+    uint8_t data[SECTOR_SIZE];
+    memset(data, 'x', sizeof(data));
+    FILE *f = fopen(filename, "wb");
+    int error = (f == NULL) ? ERR_IO : 0;
+    for(int i = 0; !error && i < NB_SECTORS; i++) {
+        error = (fwrite(data, sizeof(data), 1, f) != 1) ? ERR_IO : 0;
+    }
+    if(f != NULL && fclose(f)) {
+        error = ERR_IO;
+    }
+    struct bdev *dev = error ? NULL : bdev_open(filename, BDEV_PREAD, 0);
+    struct bdev *c = (dev != NULL) ? csum_open(dev, sidecar, 1) : NULL;
+    if(c == NULL) {
+        bdev_close(dev);
+    }
+    return c;
+}
+
+/**
+ * @brief crash after a write, before the checksums are written back: the
+ *        copies of the disk and of the sidecar must open without bad sectors
+ */
+static void test_crash(const char *filename)
+{
+    char sidecar[FILENAME_MAX];
+    char crashed[FILENAME_MAX];
+    char crashedSidecar[FILENAME_MAX];
+    snprintf(sidecar, sizeof(sidecar), "%s.crc", filename);
+    snprintf(crashed, sizeof(crashed), "%s.crash", filename);
+    snprintf(crashedSidecar, sizeof(crashedSidecar), "%s.crash.crc", filename);
+    struct bdev *c = make_disk(filename, sidecar);
+    printf("crash: open: %d\n", c != NULL);
+    if(c == NULL) {
+        return;
+    }
+    uint8_t data[SECTOR_SIZE];
+    memset(data, 'y', sizeof(data));
+    int error = bdev_write(c, 2, 1, data);
+    error = error ? error : copy(filename, crashed); // what the crash leaves
+    error = error ? error : copy(sidecar, crashedSidecar);
+    printf("write: %d, close: %d\n", error, bdev_close(c));
+
+    struct bdev *dev = bdev_open(crashed, BDEV_PREAD, 0);
+    c = (dev != NULL) ? csum_open(dev, crashedSidecar, 0) : NULL;
+    printf("reopen: %d, ", c != NULL);
+    if(c == NULL) {
+        bdev_close(dev);
+        return;
+    }
+    error = bdev_read(c, 2, 1, data);
+    printf("read: %d, written: %d, ", error, data[0] == 'y');
+    struct csum_report report;
+    error = csum_scrub(c, 2, &report);
+    printf("scrub: %d, %u sectors, %u bad\n", error, report.checked, report.bad);
+    bdev_close(c);
+    unlink(crashed);
+    unlink(crashedSidecar);
+    unlink(sidecar);
+}
+
+/**
+ * @brief write sectors over and over, each with a content of its own
+ */
+static void *race_writer(void *arg)
+{
+    struct bdev *c = arg;
+    uint8_t data[SECTOR_SIZE];
+    for(int i = 0; i < NB_WRITES; i++) {
+        memset(data, i, sizeof(data));
+        if(bdev_write(c, (uint32_t)i % NB_SECTORS, 1, data)) {
+            return c; // write error
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief read and scrub while the sectors are written: the sectors whose
+ *        checksum is not updated yet must not be reported
+ */
+static void test_race(const char *filename)
+{
+    char sidecar[FILENAME_MAX];
+    snprintf(sidecar, sizeof(sidecar), "%s.crc", filename);
+    struct bdev *c = make_disk(filename, sidecar);
+    printf("race: open: %d\n", c != NULL);
+    if(c == NULL) {
+        return;
+    }
+    pthread_t writer;
+    if(pthread_create(&writer, NULL, race_writer, c)) {
+        bdev_close(c);
+        return;
+    }
+    uint8_t data[NB_SECTORS * SECTOR_SIZE];
+    int readErrors = 0;
+    uint32_t bad = 0;
+    for(int i = 0; i < NB_WRITES / 10; i++) {
+        readErrors += bdev_read(c, 0, NB_SECTORS, data) != 0;
+        struct csum_report report;
+        readErrors += csum_scrub(c, 2, &report) != 0;
+        bad += report.bad;
+    }
+    void *writeError;
+    pthread_join(writer, &writeError);
+    printf("write errors: %d, read errors: %d, bad: %u\n", writeError != NULL, readErrors, bad);
+    bdev_close(c);
+    unlink(sidecar);
+}
+
+/**
+ * @brief rebuild the bitmaps of a filesystem whose huge file has a bad
+ *        double-indirect sector: the mount must fail rather than leave
+ *        the sectors under it free
+ */
+static void test_bad_scan(const char *filename)
+{
+    static char content[ADDR_LARGE_SECTORS * SECTOR_SIZE + 100 * SECTOR_SIZE]; // beyond i_addr[0..6]
+    memset(content, 'x', sizeof(content));
+    struct unix_filesystem u;
+    struct mount_options create = { .checksums = MOUNT_CSUM_CREATE };
+    int error = mountv6_mkfs(filename, 4000, 32);
+    error = error ? error : mountv6_opts(filename, &u, &create);
+    if(error) {
+        printf("huge: mount: %d\n", error);
+        return;
+    }
+    struct filev6 fv6;
+    struct inode inode;
+    int inr = direntv6_create(&u, "/huge", IALLOC);
+    inr = (inr < 0) ? inr : direntv6_dirlookup(&u, ROOT_INUMBER, "/huge");
+    error = (inr < 0) ? inr : filev6_open(&u, inr, &fv6);
+    error = error ? error : filev6_writebytes(&u, &fv6, content, sizeof(content));
+    error = error ? error : inode_read(&u, inr, &inode);
+    uint16_t fbm = u.s.s_fbm_start;
+    printf("huge: write: %d, umount: %d\n", error, umountv6(&u));
+
+    // the bitmaps on the disk cannot be read, then the double-indirect sector
+    corrupt(filename, (long)fbm * SECTOR_SIZE + 3);
+    struct mount_options use = { .checksums = MOUNT_CSUM_USE };
+    error = mountv6_opts(filename, &u, &use);
+    printf("huge: rebuild: %s\n", (error < 0) ? ERR_MESSAGES[error - ERR_FIRST] : "ok");
+    umountv6(&u);
+    corrupt(filename, (long)inode.i_addr[ADDR_SMALL_LENGTH - 1] * SECTOR_SIZE + 5);
+    error = mountv6_opts(filename, &u, &use);
+    printf("huge: rebuild (bad double-indirect sector): %s\n", (error < 0) ? ERR_MESSAGES[error - ERR_FIRST] : "ok");
+    if(!error) {
+        umountv6(&u);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 3) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    test_crc32c();
+
+    const char *scratch = argv[2];
+    char sidecar[FILENAME_MAX];
+    snprintf(sidecar, sizeof(sidecar), "%s.crc", scratch);
+    unlink(sidecar);
+    printf("copy: %d\n", copy(argv[1], scratch));
+
+    struct unix_filesystem u;
+    struct mount_options use = { .checksums = MOUNT_CSUM_USE };
+    struct mount_options create = { .checksums = MOUNT_CSUM_CREATE };
+    int error = mountv6_opts(scratch, &u, &use);
+    printf("mount (no sidecar): %d, %s\n", error, bdev_name(u.dev));
+    umountv6(&u);
+    error = mountv6_opts(scratch, &u, &create);
+    printf("mount (create): %d, %s\n", error, bdev_name(u.dev));
+    scrub(&u);
+    printf("create: %d\n", direntv6_create(&u, "/csum", IALLOC | IFDIR));
+    printf("umount: %d\n", umountv6(&u));
+
+    error = mountv6_opts(scratch, &u, &use);
+    printf("mount: %d, %s\n", error, bdev_name(u.dev));
+    direntv6_print_tree(&u, ROOT_INUMBER, "");
+    scrub(&u);
+    umountv6(&u);
+
+    // one byte of the last sectors, then one of the superblock
+    struct bdev *dev = bdev_open(scratch, BDEV_PREAD, 0);
+    uint32_t last = bdev_size(dev) - 1;
+    bdev_close(dev);
+    corrupt(scratch, (long)last * SECTOR_SIZE + 7);
+    corrupt(scratch, (long)(last - 2) * SECTOR_SIZE + 300);
+    printf("mount: %d\n", mountv6_opts(scratch, &u, &use));
+    scrub(&u);
+    umountv6(&u);
+    corrupt(scratch, (long)SUPERBLOCK_SECTOR * SECTOR_SIZE + 2);
+    error = mountv6_opts(scratch, &u, &use);
+    printf("mount (bad superblock): %s\n", (error < 0) ? ERR_MESSAGES[error - ERR_FIRST] : "ok");
+    printf("mount (no checksums): %d\n", mountv6(scratch, &u));
+    umountv6(&u);
+
+    printf("mkfs: %d\n", mountv6_mkfs(scratch, 1000, 32));
+    printf("sidecar removed: %d\n", access(sidecar, F_OK) != 0);
+
+    test_grow(scratch);
+    test_crash(scratch);
+    test_race(scratch);
+    test_bad_scan(scratch);
+    return 0;
+}
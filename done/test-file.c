@@ -35,7 +35,7 @@ void print_inode(const struct unix_filesystem *u, uint16_t inr)
             printf("the first sector of data of which contains:\n");
             char firstSector[SECTOR_SIZE+1];
             firstSector[SECTOR_SIZE] = '\0';
-            sector_read(u->f,inode_findsector(u,&n,0),firstSector);
+            bdev_read(u->dev,inode_findsector(u,&n,0),1,firstSector);
             printf("%s\n",firstSector);
             printf("----\n\n");
         }
@@ -54,7 +54,7 @@ void print_all_SHA(struct unix_filesystem *u)
     /* iteration on the sectors */
     for(uint32_t s = 0; s < size; ++s) { // s the sector number is uint32_t to get correct value passed to sector_read
         struct inode inodes[INODES_PER_SECTOR];
-        int error = sector_read(u->f, sector + s, inodes);
+        int error = bdev_read(u->dev, sector + s, 1, inodes);
 
         /* an error occured while trying to read sector */
         if(error) {
@@ -0,0 +1,127 @@
+/**
+ * @file test-foreach.c
+ * @brief test of inode_foreach(): the masks of inode_filter_mask() and
+ *        inode_filter_mask_sw() on random sectors, then the inodes passed
+ *        by each filter on a filesystem of directories and files
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "bdev.h"
+#include "error.h"
+
+#define NB_BLOCKS 4000
+#define NB_INODES 512
+#define NB_SECTORS 20000 // random sectors of inodes
+#define NB_DIRS 10
+#define NB_FILES 40 // of sizes 0, 100, 200, ... bytes, then large ones
+
+struct count {
+    int nb; // inodes passed to the callback
+    int previous; // last inode number passed
+    int errors; // inodes out of order, or not matching the filter
+    const struct inode_filter *filter;
+    int stop; // the callback stops after stop inodes if >0
+};
+
+/**
+ * @brief callback of inode_foreach(): counts the inodes and checks them
+ */
+static int count_inode(uint16_t inr, const struct inode *inode, void *ctx)
+{
+    struct count *c = ctx;
+    const struct inode_filter *f = c->filter;
+    uint32_t size = inode_getsize(inode);
+    int dir = (inode->i_mode & IFDIR) != 0;
+    c->errors += (inr <= c->previous || !(inode->i_mode & IALLOC));
+    c->errors += (f != NULL && (size < f->min_size || size > f->max_size || (f->type == INODE_DIR && !dir)
+                                || (f->type == INODE_FILE && dir)));
+    c->previous = inr;
+    c->nb++;
+    return (c->stop > 0 && c->nb == c->stop) ? 1 : 0;
+}
+
+int main(void)
+{
+    // random sectors: random modes and sizes, with sizes at the bounds of the filters
+    const struct inode_filter filters[] = {
+        { INODE_ANY, 0, INODE_MAX_SIZE }, { INODE_DIR, 0, INODE_MAX_SIZE }, { INODE_FILE, 0, INODE_MAX_SIZE },
+        { INODE_ANY, 1000, 1000 }, { INODE_FILE, 4096, 4097 }, { INODE_ANY, 0, 0 },
+        { INODE_DIR, 1 << 20, 0xffffffff }, { INODE_ANY, 0xffffffff, 0xffffffff }, { INODE_FILE, 10, 5 }
+    };
+    const size_t nb_filters = sizeof(filters) / sizeof(filters[0]);
+    const uint32_t bounds[] = { 0, 1, 5, 10, 999, 1000, 1001, 4096, 4097, 1 << 20, INODE_MAX_SIZE };
+    srand(1);
+    int errors = 0;
+    for(int s = 0; s < NB_SECTORS; s++) {
+        struct inode sector[INODES_PER_SECTOR];
+        for(uint32_t i = 0; i < INODES_PER_SECTOR; i++) {
+            for(size_t b = 0; b < sizeof(struct inode); b++) {
+                ((uint8_t *)&(sector[i]))[b] = rand() & 0xff;
+            }
+            if(rand() % 2) {
+                inode_setsize(&(sector[i]), bounds[rand() % (sizeof(bounds) / sizeof(bounds[0]))]);
+            }
+        }
+        errors += (inode_filter_mask(sector, NULL) != inode_filter_mask_sw(sector, NULL));
+        for(size_t f = 0; f < nb_filters; f++) {
+            errors += (inode_filter_mask(sector, &(filters[f])) != inode_filter_mask_sw(sector, &(filters[f])));
+        }
+    }
+    printf("masks: %d sectors, %zu filters, errors: %d\n", NB_SECTORS, nb_filters + 1, errors);
+
+    // a filesystem in memory: the root, NB_DIRS directories and NB_FILES files
+    struct unix_filesystem u;
+    struct bdev *dev = bdev_open(NULL, BDEV_RAM, 1);
+    int error = (dev != NULL) ? mountv6_mkfs_dev(dev, NB_BLOCKS, NB_INODES) : ERR_NOMEM;
+    error = error ? error : mountv6_dev(dev, &u, NULL);
+    static char content[NB_FILES * 100 + 200000];
+    memset(content, 'x', sizeof(content));
+    for(int d = 0; !error && d < NB_DIRS; d++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/d%d", d);
+        int inr = direntv6_create(&u, name, IALLOC | IFDIR);
+        error = (inr < 0) ? inr : 0;
+    }
+    for(int f = 0; !error && f < NB_FILES; f++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/d%d/f%d", f % NB_DIRS, f);
+        struct filev6 fv6;
+        int inr = direntv6_create(&u, name, IALLOC);
+        inr = (inr < 0) ? inr : direntv6_dirlookup(&u, ROOT_INUMBER, name);
+        error = (inr < 0) ? inr : filev6_open(&u, inr, &fv6);
+        int size = (f < NB_FILES - 2) ? f * 100 : 200000; // the last two are large files
+        error = (error || size == 0) ? error : filev6_writebytes(&u, &fv6, content, size);
+    }
+    printf("filesystem: %d\n", error);
+    if(error) {
+        return 1;
+    }
+
+    // the inodes are not written back yet: inode_foreach() syncs them first
+    const char *names[] = { "all", "directories", "files", "1000 bytes", "0 bytes", "large files", "none" };
+    const struct inode_filter fs_filters[] = {
+        { INODE_ANY, 0, INODE_MAX_SIZE }, { INODE_DIR, 0, INODE_MAX_SIZE }, { INODE_FILE, 0, INODE_MAX_SIZE },
+        { INODE_ANY, 1000, 1000 }, { INODE_FILE, 0, 0 }, { INODE_FILE, ADDR_SMALL_LENGTH * SECTOR_SIZE + 1, INODE_MAX_SIZE },
+        { INODE_ANY, 2, 1 }
+    };
+    for(size_t f = 0; f < sizeof(fs_filters) / sizeof(fs_filters[0]); f++) {
+        struct count c = { 0, 0, 0, &(fs_filters[f]), 0 };
+        error = inode_foreach(&u, &(fs_filters[f]), count_inode, &c);
+        printf("%-12s: %d, inodes: %d, errors: %d\n", names[f], error, c.nb, c.errors);
+    }
+    struct count c = { 0, 0, 0, NULL, 0 };
+    error = inode_foreach(&u, NULL, count_inode, &c);
+    printf("%-12s: %d, inodes: %d, errors: %d\n", "NULL", error, c.nb, c.errors);
+    c = (struct count) { 0, 0, 0, NULL, 5 };
+    error = inode_foreach(&u, NULL, count_inode, &c);
+    printf("%-12s: %d, inodes: %d, errors: %d\n", "stop at 5", error, c.nb, c.errors);
+    umountv6(&u);
+    return 0;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file test-full.c
+ * @brief test of writes on a full disk: a write that does not fit fails
+ *        as a whole, leaves the file as it was and frees every sector it
+ *        allocated; the bitmaps written back at umount are then rebuilt
+ *        by the next mount
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bench-core.h"
+#include "mount.h"
+#include "inode.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "bmblock.h"
+#include "error.h"
+
+#define NB_BLOCKS 300
+#define NB_INODES 16
+#define FILL_SIZE 40000 // about half of the data sectors
+#define SMALL_SIZE 4096 // the largest small file: an append makes it large
+#define TOO_LARGE (1000 * 1000)
+#define USAGE "test-full <scratch diskname>"
+
+static char content[TOO_LARGE];
+
+/**
+ * @brief number of used data sectors
+ */
+static uint64_t used_sectors(const struct unix_filesystem *u)
+{
+    return bm_count(u->fbm, (u->fbm)->min, (u->fbm)->max - (u->fbm)->min + 1);
+}
+
+/**
+ * @brief append size bytes of content to a file
+ * @return 0 on success; <0 on error
+ */
+static int append(struct unix_filesystem *u, int inr, int size)
+{
+    struct filev6 fv6;
+    int error = filev6_open(u, inr, &fv6);
+    return error ? error : filev6_writebytes(u, &fv6, content, size); // at the end of the file
+}
+
+/**
+ * @brief read the whole file back and compare it with content
+ * @return its size if it matches; <0 otherwise
+ */
+static int check(struct unix_filesystem *u, int inr)
+{
+    struct filev6 fv6;
+    int error = filev6_open(u, inr, &fv6);
+    if(error) {
+        return error;
+    }
+    char data[SECTOR_SIZE];
+    int total = 0;
+    int read = 0;
+    while((read = filev6_readblock(&fv6, data)) > 0) {
+        if(memcmp(data, &content[total], read)) {
+            return ERR_IO;
+        }
+        total += read;
+    }
+    return (read < 0) ? read : total;
+}
+
+static const char *message(int error)
+{
+    return (error < 0) ? ERR_MESSAGES[error - ERR_FIRST] : "ok";
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        fprintf(stderr, "Usage: " USAGE "\n");
+        return 1;
+    }
+    for(size_t i = 0; i < sizeof(content); i++) {
+        content[i] = 'a' + i % 26;
+    }
+    struct unix_filesystem u;
+    int error = mountv6_mkfs(argv[1], NB_BLOCKS, NB_INODES);
+    error = error ? error : mountv6(argv[1], &u);
+    printf("mount: %d\n", error);
+    if(error) {
+        return 1;
+    }
+    int fill = create_file(&u, "/fill", content, FILL_SIZE);
+    int small = create_file(&u, "/small", content, SMALL_SIZE);
+    printf("fill: %d, small: %d\n", fill > 0, small > 0);
+    uint64_t used = used_sectors(&u);
+
+    // a new file, then an append that turns a small file into a large one
+    int large = create_file(&u, "/large", content, TOO_LARGE);
+    int inr = direntv6_dirlookup(&u, ROOT_INUMBER, "/large");
+    printf("write too large: %s, sectors freed: %d, size: %d\n", message(large), used_sectors(&u) == used,
+           check(&u, inr));
+    error = append(&u, small, TOO_LARGE);
+    printf("append too large: %s, sectors freed: %d, size: %d\n", message(error), used_sectors(&u) == used,
+           check(&u, small));
+
+    // what is left is still usable
+    error = append(&u, inr, FILL_SIZE / 2);
+    printf("write: %s, size: %d\n", message(error), check(&u, inr));
+    used = used_sectors(&u);
+    printf("umount: %d\n", umountv6(&u));
+
+    // after the failed writes, the next mount rebuilds the bitmaps from the inodes
+    error = mountv6(argv[1], &u);
+    error = error ? error : mountv6_bitmaps(&u);
+    printf("remount: %d, rebuilt: %d, same sectors: %d\n", error, u.scan.inode_sectors > 0, used_sectors(&u) == used);
+    if(error) {
+        return 1;
+    }
+    int more = create_file(&u, "/more", content, FILL_SIZE / 4);
+    printf("write: %s, size: %d\n", message((more < 0) ? more : 0), (more < 0) ? more : check(&u, more));
+    used = used_sectors(&u);
+    printf("umount: %d\n", umountv6(&u));
+
+    // and this time, they are read from the disk
+    error = mountv6(argv[1], &u);
+    error = error ? error : mountv6_bitmaps(&u);
+    printf("remount: %d, rebuilt: %d, same sectors: %d\n", error, u.scan.inode_sectors > 0, used_sectors(&u) == used);
+    printf("umount: %d\n", umountv6(&u));
+    return 0;
+}
@@ -0,0 +1,292 @@
+/**
+ * @file test-icache.c
+ * @brief test of the inode cache: batched write-back of the dirty inodes
+ *        of a sector, eviction of dirty inodes from a small cache, pinned
+ *        entries, threads writing and reading their own inodes, then
+ *        the block map of a large file and its runs of contiguous sectors,
+ *        and a huge file written across the double-indirect boundary
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "mount.h"
+#include "inode.h"
+#include "icache.h"
+#include "filev6.h"
+#include "direntv6.h"
+#include "bcache.h"
+#include "bdev.h"
+#include "error.h"
+
+#define NB_BLOCKS 6000
+#define NB_INODES 1024
+#define FIRST 2 // first inode written, after the root
+#define NB 40 // inodes written by the single thread tests
+#define NB_THREADS 8
+#define PER_THREAD 100 // inodes of each thread
+#define ROUNDS 20
+#define LARGE_SIZE (300 * 1000) // 586 sectors: 3 indirect sectors
+#define HUGE_HALF (600 * 1000) // appended twice: 2344 sectors, 3 indirect sectors in the double-indirect one
+
+struct worker {
+    struct unix_filesystem *u;
+    uint16_t first; // first inode of the thread
+    int errors;
+    pthread_t thread;
+};
+
+/**
+ * @brief mount a new filesystem in memory
+ * @return 0 on success; <0 on error
+ */
+static int mount_ram(struct unix_filesystem *u, size_t icache_size)
+{
+    struct bdev *dev = bdev_open(NULL, BDEV_RAM, 1);
+    struct mount_options opts = { .icache_size = icache_size };
+    int error = (dev != NULL) ? mountv6_mkfs_dev(dev, NB_BLOCKS, NB_INODES) : ERR_NOMEM;
+    return error ? error : mountv6_dev(dev, u, &opts);
+}
+
+/**
+ * @brief write n inodes from first on, each with its number and round in
+ *        its fields
+ * @return 0 on success; <0 on error
+ */
+static int write_inodes(struct unix_filesystem *u, uint16_t first, uint16_t n, uint8_t round)
+{
+    int error = 0;
+    for(uint16_t inr = first; !error && inr < first + n; inr++) {
+        struct inode i = { .i_mode = IALLOC, .i_nlink = round, .i_uid = inr & 0xff, .i_gid = inr >> 8 };
+        error = inode_write(u, inr, &i);
+    }
+    return error;
+}
+
+/**
+ * @brief number of inodes, from first on, that are not as written by
+ *        write_inodes(); read through the inode cache, or straight from
+ *        the inode table in the buffer cache
+ */
+static int check_inodes(struct unix_filesystem *u, uint16_t first, uint16_t n, uint8_t round, int table)
+{
+    int errors = 0;
+    for(uint16_t inr = first; inr < first + n; inr++) {
+        struct inode i;
+        struct inode sector[INODES_PER_SECTOR];
+        if(table) {
+            int error = bcache_read(u->cache, (u->s).s_inode_start + inr / INODES_PER_SECTOR, sector);
+            i = sector[inr % INODES_PER_SECTOR];
+            errors += (error != 0);
+        } else {
+            errors += (inode_read(u, inr, &i) != 0);
+        }
+        errors += (i.i_nlink != round || i.i_uid != (inr & 0xff) || i.i_gid != inr >> 8);
+    }
+    return errors;
+}
+
+/**
+ * @brief number of sectors of the file for which filev6_findsector() and
+ *        inode_findsector() differ
+ */
+static int check_bmap(struct filev6 *fv6)
+{
+    int errors = 0;
+    int32_t nb = (inode_getsize(&(fv6->i_node)) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    for(int32_t s = nb - 1; s >= 0; s--) { // backwards: not in the order of the indirect sectors
+        int sector = filev6_findsector(fv6, s);
+        errors += (sector < 0 || sector != inode_findsector(fv6->u, &(fv6->i_node), s));
+    }
+    return errors;
+}
+
+/**
+ * @brief number of offsets of the file for which the runs of
+ *        filev6_map_range() and inode_map_range() differ, or are not the
+ *        longest runs of sectors found by inode_findsector(); *nb_runs is
+ *        the number of runs that read the whole file
+ */
+static int check_ranges(struct filev6 *fv6, int *nb_runs)
+{
+    int errors = 0;
+    int32_t nb = (inode_getsize(&(fv6->i_node)) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int32_t next = 0; // first sector after the runs that read the file so far
+    *nb_runs = 0;
+    for(int32_t s = 0; s < nb; s++) {
+        uint32_t start = 0, len = 0, istart = 0, ilen = 0;
+        errors += (filev6_map_range(fv6, s, nb, &start, &len) != 0);
+        errors += (inode_map_range(fv6->u, &(fv6->i_node), s, nb, &istart, &ilen) != 0);
+        errors += (start != istart || len != ilen || len < 1 || s + len > (uint32_t)nb);
+        for(uint32_t k = 0; k <= len && s + k < (uint32_t)nb; k++) {
+            int sector = inode_findsector(fv6->u, &(fv6->i_node), s + k);
+            errors += ((k < len) != (sector == (int)(start + k))); // contiguous up to the end of the run only
+        }
+        uint32_t one = 0;
+        errors += (filev6_map_range(fv6, s, 1, &start, &one) != 0 || one != 1);
+        if(s == next) { // the next run that reads the file
+            (*nb_runs)++;
+            next = s + len;
+        }
+    }
+    uint32_t start = 0, len = 0;
+    errors += (filev6_map_range(fv6, nb, 1, &start, &len) != ERR_OFFSET_OUT_OF_RANGE);
+    return errors;
+}
+
+/**
+ * @brief number of bytes of the file which differ from content
+ */
+static int check_content(struct filev6 *fv6, const char *content, int size)
+{
+    int errors = 0;
+    uint8_t data[SECTOR_SIZE];
+    int read = 0;
+    int done = 0;
+    errors += (filev6_lseek(fv6, 0) != 0);
+    while((read = filev6_readblock(fv6, data)) > 0) {
+        for(int b = 0; b < read; b++) {
+            errors += (done + b >= size || data[b] != (uint8_t)content[done + b]);
+        }
+        done += read;
+    }
+    return errors + (read < 0) + (done != size);
+}
+
+/**
+ * @brief write and read the inodes of the worker, ROUNDS times
+ */
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    for(int r = 1; r <= ROUNDS; r++) {
+        w->errors += (write_inodes(w->u, w->first, PER_THREAD, r) != 0);
+        w->errors += check_inodes(w->u, w->first, PER_THREAD, r, 0);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    // inodes FIRST..FIRST+NB-1 are in 3 sectors of the inode table
+    struct unix_filesystem u;
+    int error = mount_ram(&u, 0);
+    printf("mount: %d\n", error);
+    if(error) {
+        return 1;
+    }
+    error = write_inodes(&u, FIRST, NB, 1);
+    printf("write: %d, dirty: %zu, table errors: %d\n", error, u.icache->nb_dirty, check_inodes(&u, FIRST, NB, 1, 1) > 0);
+    error = icache_sync(&u);
+    printf("sync: %d, writebacks: %lu, sector updates: %lu, table errors: %d\n", error,
+           (unsigned long)u.icache->stats.writebacks, (unsigned long)u.icache->stats.write_sectors,
+           check_inodes(&u, FIRST, NB, 1, 1));
+    printf("read errors: %d, misses: %lu\n", check_inodes(&u, FIRST, NB, 1, 0), (unsigned long)u.icache->stats.misses);
+    umountv6(&u);
+
+    // 16 entries: the dirty inodes are evicted, no prefill
+    error = mount_ram(&u, INODES_PER_SECTOR);
+    error = error ? error : write_inodes(&u, FIRST, NB, 2);
+    printf("small cache: %d, evictions: %d, read errors: %d\n", error, u.icache->stats.evictions > 0,
+           check_inodes(&u, FIRST, NB, 2, 0));
+    error = error ? error : mountv6_sync(&u);
+    printf("sync: %d, dirty: %zu, table errors: %d\n", error, u.icache->nb_dirty, check_inodes(&u, FIRST, NB, 2, 1));
+    umountv6(&u);
+
+    // one entry, pinned
+    error = mount_ram(&u, 1);
+    struct icache_entry *e = NULL;
+    struct icache_entry *other = NULL;
+    error = error ? error : icache_get(&u, ROOT_INUMBER, 1, &e);
+    printf("get: %d, refs: %u, directory: %d\n", error, error ? 0 : e->refs, error ? 0 : (e->inode.i_mode & IFDIR) != 0);
+    printf("get while pinned: %s\n", ERR_MESSAGES[icache_get(&u, FIRST, 1, &other) - ERR_FIRST]);
+    icache_put(&u, e, 0);
+    error = error ? error : icache_get(&u, FIRST, 1, &other);
+    printf("get after put: %d\n", error);
+    icache_put(&u, other, 0);
+    umountv6(&u);
+
+    // threads, each with its own inodes, sharing a cache smaller than all of them
+    error = mount_ram(&u, 4 * PER_THREAD);
+    struct worker workers[NB_THREADS];
+    for(int t = 0; !error && t < NB_THREADS; t++) {
+        workers[t] = (struct worker) { &u, FIRST + t * PER_THREAD, 0, 0 };
+        pthread_create(&(workers[t].thread), NULL, work, &(workers[t]));
+    }
+    int errors = 0;
+    for(int t = 0; !error && t < NB_THREADS; t++) {
+        pthread_join(workers[t].thread, NULL);
+        errors += workers[t].errors;
+    }
+    error = error ? error : mountv6_sync(&u);
+    printf("threads: %d, errors: %d, table errors: %d\n", error, errors,
+           check_inodes(&u, FIRST, NB_THREADS * PER_THREAD, ROUNDS, 1));
+    umountv6(&u);
+
+    // block map: each indirect sector read once, again after a write
+    static char content[LARGE_SIZE];
+    memset(content, 'x', sizeof(content));
+    struct filev6 fv6;
+    error = mount_ram(&u, 0);
+    int inr = error ? error : direntv6_create(&u, "/large", IALLOC);
+    inr = (inr < 0) ? inr : direntv6_dirlookup(&u, ROOT_INUMBER, "/large");
+    error = (inr < 0) ? inr : filev6_open(&u, inr, &fv6);
+    error = error ? error : filev6_writebytes(&u, &fv6, content, sizeof(content));
+    printf("large file: %d\n", error);
+    if(!error) {
+        int errors = check_bmap(&fv6);
+        errors += check_bmap(&fv6);
+        printf("block map errors: %d, loads: %lu\n", errors, (unsigned long)u.icache->stats.map_loads);
+        error = filev6_writebytes(&u, &fv6, content, sizeof(content)); // 1172 sectors: 5 indirect sectors
+        errors = check_bmap(&fv6);
+        printf("append: %d, block map errors: %d, loads: %lu\n", error, errors, (unsigned long)u.icache->stats.map_loads);
+        int runs = 0;
+        errors = check_ranges(&fv6, &runs);
+        printf("run errors: %d, runs: %d\n", errors, runs);
+    }
+
+    // small file: runs of its direct addresses
+    inr = error ? error : direntv6_create(&u, "/small", IALLOC);
+    inr = (inr < 0) ? inr : direntv6_dirlookup(&u, ROOT_INUMBER, "/small");
+    error = (inr < 0) ? inr : filev6_open(&u, inr, &fv6);
+    error = error ? error : filev6_writebytes(&u, &fv6, content, 3000); // 6 sectors
+    if(!error) {
+        int runs = 0;
+        int errors = check_ranges(&fv6, &runs);
+        printf("small file: %d, run errors: %d, runs: %d\n", error, errors, runs);
+    }
+
+    // huge file: the second half goes through the double-indirect sector;
+    // the scan of the inode table then finds all its sectors
+    static char huge[2 * HUGE_HALF];
+    for(size_t b = 0; b < sizeof(huge); b++) {
+        huge[b] = (char)(b % 251);
+    }
+    inr = error ? error : direntv6_create(&u, "/huge", IALLOC);
+    inr = (inr < 0) ? inr : direntv6_dirlookup(&u, ROOT_INUMBER, "/huge");
+    error = (inr < 0) ? inr : filev6_open(&u, inr, &fv6);
+    error = error ? error : filev6_writebytes(&u, &fv6, huge, HUGE_HALF);
+    error = error ? error : filev6_writebytes(&u, &fv6, &(huge[HUGE_HALF]), HUGE_HALF);
+    printf("huge file: %d\n", error);
+    if(!error) {
+        int runs = 0;
+        int errors = check_bmap(&fv6) + check_ranges(&fv6, &runs);
+        printf("double indirect: %d, block map errors: %d, content errors: %d\n",
+               fv6.i_node.i_addr[ADDR_SMALL_LENGTH - 1] > 0, errors, check_content(&fv6, huge, sizeof(huge)));
+        struct bmblock_array *fbm = u.fbm;
+        size_t words = fbm->length;
+        uint64_t *before = malloc(words * sizeof(uint64_t));
+        error = (before == NULL) ? ERR_NOMEM : mountv6_sync(&u);
+        if(!error) {
+            memcpy(before, fbm->bm, words * sizeof(uint64_t));
+            u.bm_ready = 0; // rebuilt by the scan
+            error = mountv6_bitmaps(&u);
+            printf("rescan: %d, bitmap same: %d\n", error, memcmp(before, fbm->bm, words * sizeof(uint64_t)) == 0);
+        }
+        free(before);
+    }
+    umountv6(&u);
+    return 0;
+}
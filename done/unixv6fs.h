@@ -158,6 +158,15 @@ extern "C" {
 #define ADDRESS_SIZE 2 /* bytes */
 #define ADDRESSES_PER_SECTOR (SECTOR_SIZE / ADDRESS_SIZE)
 
+/*
+ * A large file (more than ADDR_SMALL_LENGTH sectors) holds indirect sectors
+ * in i_addr[0..6]; beyond ADDR_LARGE_SECTORS data sectors, i_addr[7] is a
+ * double-indirect sector which holds the next indirect sectors (huge file).
+ */
+#define ADDR_LARGE_SECTORS ((ADDR_SMALL_LENGTH - 1) * ADDRESSES_PER_SECTOR) /* 896 KB */
+#define INODE_MAX_SIZE 0xffffff /* bytes: the size is on 24 bits */
+#define ADDR_MAX_INDIRECT ((INODE_MAX_SIZE / SECTOR_SIZE + ADDRESSES_PER_SECTOR) / ADDRESSES_PER_SECTOR) /* of a file */
+
 /*
  * Definition of the boot block
  *   On a real bootable device, this contains bootstrap code.